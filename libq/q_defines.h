@@ -32,7 +32,7 @@
 #define QREAL    double
 #define QREALFMT "%lf"
 #define QCOMPLEX double complex
-#define QNZCOUNT uint8_t
+#define QNZCOUNT uint16_t /* Rows have up to 1 << QSPARSE_ORDER_MAX entries */
 
 #define QSPARSE_LAST_ERROR_MAX 256
 
@@ -22,7 +22,16 @@
 #ifndef LIBQ_Q_UTIL_H_
 #define LIBQ_Q_UTIL_H_
 
+#include "q_defines.h"
+
+typedef QBOOL (*q_parallel_fn_t) (unsigned int, void *);
+
 void q_set_last_error (const char *, ...);
 const char *q_get_last_error (void);
 
+/* Worker threads */
+unsigned int q_get_thread_count (void);
+void q_set_thread_count (unsigned int);
+QBOOL q_parallel_for (unsigned int, q_parallel_fn_t, void *);
+
 #endif /* LIBQ_Q_UTIL_H_ */
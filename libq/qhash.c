@@ -0,0 +1,213 @@
+/*
+  qhash.c: SHA-256 hashing for content-addressed objects
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <string.h>
+
+#include "qhash.h"
+#include "qsb.h"
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t qhash_k[64] =
+{
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+  0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+  0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+  0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+  0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void
+qhash_transform (qhash_t *hash, const uint8_t *block)
+{
+  uint32_t w[64];
+  uint32_t a, b, c, d, e, f, g, h;
+  uint32_t s0, s1, t1, t2;
+  unsigned int i;
+
+  for (i = 0; i < 16; ++i)
+    w[i] = ((uint32_t) block[4 * i]     << 24) |
+           ((uint32_t) block[4 * i + 1] << 16) |
+           ((uint32_t) block[4 * i + 2] << 8)  |
+            (uint32_t) block[4 * i + 3];
+
+  for (i = 16; i < 64; ++i)
+  {
+    s0 = ROR32 (w[i - 15], 7) ^ ROR32 (w[i - 15], 18) ^ (w[i - 15] >> 3);
+    s1 = ROR32 (w[i - 2], 17) ^ ROR32 (w[i - 2], 19)  ^ (w[i - 2] >> 10);
+
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  a = hash->state[0];
+  b = hash->state[1];
+  c = hash->state[2];
+  d = hash->state[3];
+  e = hash->state[4];
+  f = hash->state[5];
+  g = hash->state[6];
+  h = hash->state[7];
+
+  for (i = 0; i < 64; ++i)
+  {
+    s1 = ROR32 (e, 6) ^ ROR32 (e, 11) ^ ROR32 (e, 25);
+    t1 = h + s1 + ((e & f) ^ (~e & g)) + qhash_k[i] + w[i];
+    s0 = ROR32 (a, 2) ^ ROR32 (a, 13) ^ ROR32 (a, 22);
+    t2 = s0 + ((a & b) ^ (a & c) ^ (b & c));
+
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  hash->state[0] += a;
+  hash->state[1] += b;
+  hash->state[2] += c;
+  hash->state[3] += d;
+  hash->state[4] += e;
+  hash->state[5] += f;
+  hash->state[6] += g;
+  hash->state[7] += h;
+}
+
+void
+qhash_init (qhash_t *hash)
+{
+  hash->state[0] = 0x6a09e667;
+  hash->state[1] = 0xbb67ae85;
+  hash->state[2] = 0x3c6ef372;
+  hash->state[3] = 0xa54ff53a;
+  hash->state[4] = 0x510e527f;
+  hash->state[5] = 0x9b05688c;
+  hash->state[6] = 0x1f83d9ab;
+  hash->state[7] = 0x5be0cd19;
+
+  hash->length = 0;
+  hash->used   = 0;
+}
+
+void
+qhash_update (qhash_t *hash, const void *data, size_t size)
+{
+  const uint8_t *bytes = (const uint8_t *) data;
+  size_t chunk;
+
+  hash->length += size;
+
+  while (size > 0)
+  {
+    chunk = QHASH_BLOCK - hash->used;
+
+    if (chunk > size)
+      chunk = size;
+
+    memcpy (hash->block + hash->used, bytes, chunk);
+
+    hash->used += chunk;
+    bytes      += chunk;
+    size       -= chunk;
+
+    if (hash->used == QHASH_BLOCK)
+    {
+      qhash_transform (hash, hash->block);
+      hash->used = 0;
+    }
+  }
+}
+
+void
+qhash_final (qhash_t *hash, uint8_t *digest)
+{
+  uint64_t bits;
+  unsigned int i;
+
+  bits = hash->length << 3;
+
+  hash->block[hash->used++] = 0x80;
+
+  if (hash->used > QHASH_BLOCK - 8)
+  {
+    memset (hash->block + hash->used, 0, QHASH_BLOCK - hash->used);
+    qhash_transform (hash, hash->block);
+    hash->used = 0;
+  }
+
+  memset (hash->block + hash->used, 0, QHASH_BLOCK - 8 - hash->used);
+
+  for (i = 0; i < 8; ++i)
+    hash->block[QHASH_BLOCK - 1 - i] = bits >> (i << 3);
+
+  qhash_transform (hash, hash->block);
+
+  for (i = 0; i < QHASH_LENGTH; ++i)
+    digest[i] = hash->state[i >> 2] >> (24 - ((i & 3) << 3));
+}
+
+void
+qhash_update_uint32_t (qhash_t *hash, uint32_t val)
+{
+  val = __qsb_htof32 (val);
+
+  qhash_update (hash, &val, sizeof (uint32_t));
+}
+
+void
+qhash_update_complex (qhash_t *hash, QCOMPLEX val)
+{
+  uint64_t parts[2];
+
+  /* -0.0 and 0.0 describe the same coefficient */
+  parts[0] = __qsb_htof_ieee754_64 (creal (val) + 0.0);
+  parts[1] = __qsb_htof_ieee754_64 (cimag (val) + 0.0);
+
+  qhash_update (hash, parts, sizeof (parts));
+}
+
+void
+qhash_to_string (const uint8_t *digest, char *string)
+{
+  static const char hex[] = "0123456789abcdef";
+  unsigned int i;
+
+  for (i = 0; i < QHASH_LENGTH; ++i)
+  {
+    string[i << 1]       = hex[digest[i] >> 4];
+    string[(i << 1) + 1] = hex[digest[i] & 0xf];
+  }
+
+  string[QHASH_LENGTH << 1] = '\0';
+}
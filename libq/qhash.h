@@ -0,0 +1,53 @@
+/*
+  qhash.h: SHA-256 hashing for content-addressed objects
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _LIBQ_QHASH_H
+#define _LIBQ_QHASH_H
+
+#include <stddef.h>
+
+#include "q_defines.h"
+
+#define QHASH_LENGTH 32 /* Digest size, in bytes */
+#define QHASH_BLOCK  64
+
+struct qhash
+{
+  uint32_t state[8];
+  uint64_t length; /* Bytes hashed so far */
+
+  uint8_t  block[QHASH_BLOCK];
+  unsigned int used;
+};
+
+typedef struct qhash qhash_t;
+
+void qhash_init (qhash_t *);
+void qhash_update (qhash_t *, const void *, size_t);
+void qhash_final (qhash_t *, uint8_t *);
+
+/* Feed values in a canonical, endianness-independent form */
+void qhash_update_uint32_t (qhash_t *, uint32_t);
+void qhash_update_complex (qhash_t *, QCOMPLEX);
+
+void qhash_to_string (const uint8_t *, char *);
+
+#endif /* _LIBQ_QHASH_H */
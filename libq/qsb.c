@@ -251,7 +251,7 @@ qsb_read_string (struct qsb *state, char **string)
     (*string)[len - 1] = '\0';
   }
 
-  return Q_FALSE;
+  return Q_TRUE;
 }
 
 
@@ -63,7 +63,7 @@ qsparse_new (unsigned int order)
     return NULL;
   }
   
-  if ((new = malloc (sizeof (qsparse_t))) == NULL)
+  if ((new = calloc (1, sizeof (qsparse_t))) == NULL)
     return NULL;
 
   new->order = order;
@@ -94,27 +94,168 @@ fail:
   return NULL;
 }
 
+/* Monomial matrix with undefined permutation and phases. Every row
+ * and column holds exactly one nonzero, so the counters are final.
+ */
+static qsparse_t *
+__qsparse_monomial_new (unsigned int order)
+{
+  qsparse_t *new;
+  unsigned int length, i;
+
+  length = 1 << order;
+
+  if (order > QSPARSE_ORDER_MAX)
+  {
+    q_set_last_error ("qsparse_new: qsparse matrix order %d (%ux%u) too big", order, length, length);
+    return NULL;
+  }
+
+  if ((new = calloc (1, sizeof (qsparse_t))) == NULL)
+    return NULL;
+
+  new->order = order;
+
+  if ((new->perm   = malloc (length * sizeof (unsigned int))) == NULL ||
+      (new->phase  = malloc (length * sizeof (QCOMPLEX))) == NULL ||
+      (new->row_nz = malloc (length * sizeof (QNZCOUNT))) == NULL ||
+      (new->col_nz = malloc (length * sizeof (QNZCOUNT))) == NULL)
+  {
+    q_set_last_error ("qsparse_init: memory exhausted while allocating matrix");
+    goto fail;
+  }
+
+  for (i = 0; i < length; ++i)
+    new->row_nz[i] = new->col_nz[i] = 1;
+
+  return new;
+
+fail:
+  qsparse_destroy (new);
+
+  return NULL;
+}
+
 qsparse_t *
 qsparse_eye_new (unsigned int order)
 {
   qsparse_t *new;
   unsigned int i, length;
 
-  if ((new = qsparse_new (order)) == NULL)
+  if ((new = __qsparse_monomial_new (order)) == NULL)
     return NULL;
 
   length = QSPARSE_LENGTH (new);
 
   for (i = 0; i < length; ++i)
-    if (!qsparse_set (new, i, i, 1.))
-      goto fail;
+  {
+    new->perm[i]  = i;
+    new->phase[i] = 1.;
+  }
 
   return new;
+}
 
-fail:
-  qsparse_destroy (new);
+/* Move a monomial matrix back to the generic storage class, so that
+ * arbitrary coefficients can be set.
+ */
+static QBOOL
+__qsparse_make_generic (qsparse_t *qsparse)
+{
+  qsparse_t *tmp;
+  unsigned int *perm;
+  QCOMPLEX *phase;
+  unsigned int i, length;
 
-  return NULL;
+  length = QSPARSE_LENGTH (qsparse);
+
+  if ((tmp = qsparse_new (qsparse->order)) == NULL)
+    return Q_FALSE;
+
+  for (i = 0; i < length; ++i)
+    if (!qsparse_set (tmp, i, qsparse->perm[i], qsparse->phase[i]))
+    {
+      qsparse_destroy (tmp);
+      return Q_FALSE;
+    }
+
+  /* Swap contents */
+  perm  = qsparse->perm;
+  phase = qsparse->phase;
+
+  free (qsparse->row_nz);
+  free (qsparse->col_nz);
+
+  qsparse->row_nz  = tmp->row_nz;
+  qsparse->col_nz  = tmp->col_nz;
+  qsparse->headers = tmp->headers;
+  qsparse->perm    = NULL;
+  qsparse->phase   = NULL;
+
+  tmp->row_nz  = NULL;
+  tmp->col_nz  = NULL;
+  tmp->headers = NULL;
+  tmp->perm    = perm;
+  tmp->phase   = phase;
+
+  qsparse_destroy (tmp);
+
+  return Q_TRUE;
+}
+
+static void __qsparse_free_rows (qsparse_t *);
+
+/* Switch to the monomial storage class if the matrix has exactly one
+ * nonzero per row and column. Does nothing otherwise. Fails only if
+ * memory is exhausted, in which case the matrix is left untouched.
+ */
+QBOOL
+qsparse_compact (qsparse_t *qsparse)
+{
+  qsparse_iterator_t it;
+  unsigned int *perm;
+  QCOMPLEX *phase;
+  unsigned int i, length;
+
+  if (QSPARSE_IS_MONOMIAL (qsparse))
+    return Q_TRUE;
+
+  length = QSPARSE_LENGTH (qsparse);
+
+  for (i = 0; i < length; ++i)
+    if (qsparse->row_nz[i] != 1 || qsparse->col_nz[i] != 1)
+      return Q_TRUE;
+
+  if ((perm = malloc (length * sizeof (unsigned int))) == NULL)
+  {
+    q_set_last_error ("qsparse_compact: memory exhausted");
+    return Q_FALSE;
+  }
+
+  if ((phase = malloc (length * sizeof (QCOMPLEX))) == NULL)
+  {
+    free (perm);
+    q_set_last_error ("qsparse_compact: memory exhausted");
+    return Q_FALSE;
+  }
+
+  for (
+        qsparse_iterator_init (qsparse, &it);
+        !qsparse_iterator_end (&it);
+        qsparse_iterator_next (&it)
+        )
+  {
+    perm[qsparse_iterator_row (&it)]  = qsparse_iterator_col (&it);
+    phase[qsparse_iterator_row (&it)] =
+        qsparse_get_from_iterator (qsparse, &it);
+  }
+
+  __qsparse_free_rows (qsparse);
+
+  qsparse->perm  = perm;
+  qsparse->phase = phase;
+
+  return Q_TRUE;
 }
 
 static inline int
@@ -183,6 +324,9 @@ qsparse_get (const qsparse_t *qsparse, unsigned int row, unsigned int col)
   if (row >= length)
     return 0.0;
 
+  if (QSPARSE_IS_MONOMIAL (qsparse))
+    return qsparse->perm[row] == col ? qsparse->phase[row] : 0.0;
+
   if ((val = qsparse_row_get_col_ptr (&qsparse->headers[row], col)) == NULL)
     return 0.0;
 
@@ -271,9 +415,46 @@ qsparse_det (const qsparse_t *qsparse, QCOMPLEX *det)
 {
   uint64_t *mask;
   unsigned int length;
+  unsigned int i, j, cycle;
 
   length = QSPARSE_LENGTH (qsparse);
 
+  /* Product of the phases times the sign of the permutation. The sign
+   * flips once for every even-length cycle. */
+  if (QSPARSE_IS_MONOMIAL (qsparse))
+  {
+    if ((mask = calloc ((length + 63) >> 6, sizeof (uint64_t))) == NULL)
+    {
+      q_set_last_error ("qsparse_det: memory exhausted when computing determinant");
+      return Q_FALSE;
+    }
+
+    *det = 1.;
+
+    for (i = 0; i < length; ++i)
+    {
+      *det *= qsparse->phase[i];
+
+      if (BITMAP_HAS_BIT (mask[i >> 6], i & 63))
+        continue;
+
+      cycle = 0;
+
+      for (j = i; !BITMAP_HAS_BIT (mask[j >> 6], j & 63); j = qsparse->perm[j])
+      {
+        mask[j >> 6] |= 1ull << (j & 63);
+        ++cycle;
+      }
+
+      if (!(cycle & 1))
+        *det = -*det;
+    }
+
+    free (mask);
+
+    return Q_TRUE;
+  }
+
   if (length < (sizeof (uint64_t) << 3))
     length = sizeof (uint64_t) << 3;
 
@@ -317,6 +498,18 @@ qsparse_set (qsparse_t *qsparse, unsigned int row, unsigned int col, QCOMPLEX va
     return Q_FALSE;
   }
 
+  if (QSPARSE_IS_MONOMIAL (qsparse))
+  {
+    if (qsparse->perm[row] == col && !QSPARSE_IS_ZERO (value))
+    {
+      qsparse->phase[row] = value;
+      return Q_TRUE;
+    }
+
+    if (!__qsparse_make_generic (qsparse))
+      return Q_FALSE;
+  }
+
   rowptr = &qsparse->headers[row];
 
   if (rowptr->coef == NULL)
@@ -423,6 +616,24 @@ qsparse_find_next_nz (const qsparse_t *qsparse, unsigned int *curr_row, unsigned
 
   col_start = *curr_col;
 
+  if (QSPARSE_IS_MONOMIAL (qsparse))
+  {
+    for (i = *curr_row; i < length; ++i)
+    {
+      if (qsparse->perm[i] >= col_start)
+      {
+        *curr_row = i;
+        *curr_col = qsparse->perm[i];
+
+        return 1;
+      }
+
+      col_start = 0;
+    }
+
+    return 0;
+  }
+
   for (i = *curr_row; i < length; ++i)
     if (!qsparse_row_is_empty (qsparse, i))
     {
@@ -619,6 +830,49 @@ qsparse_expand (const qsparse_t *src, unsigned int order, unsigned int *remap)
 
   assert (n == unmapped_order);
 
+  /* Monomial matrices stay monomial: every row of the source is copied
+   * once per combination of unmapped qubits. */
+  if (QSPARSE_IS_MONOMIAL (src))
+  {
+    if ((new = __qsparse_monomial_new (order)) == NULL)
+      goto fail;
+
+    for (j = 0; j < QSPARSE_LENGTH (src); ++j)
+    {
+      it_row = 0;
+      it_col = 0;
+
+      for (k = 0; k < src->order; ++k)
+      {
+        if (BITMAP_HAS_BIT (src->perm[j], k))
+          it_col |= 1 << remap[k];
+
+        if (BITMAP_HAS_BIT (j, k))
+          it_row |= 1 << remap[k];
+      }
+
+      for (i = 0; i < unmapped_length; ++i)
+      {
+        row = it_row;
+        col = it_col;
+
+        for (k = 0; k < unmapped_order; ++k)
+          if (BITMAP_HAS_BIT (i, k))
+          {
+            row |= 1 << unmapped_bits[k];
+            col |= 1 << unmapped_bits[k];
+          }
+
+        new->perm[row]  = col;
+        new->phase[row] = src->phase[j];
+      }
+    }
+
+    free (unmapped_bits);
+
+    return new;
+  }
+
   if ((new = qsparse_new (order)) == NULL) /* Error already given by qsparse_new */
     goto fail;
 
@@ -656,7 +910,8 @@ qsparse_expand (const qsparse_t *src, unsigned int order, unsigned int *remap)
           col |= 1 << unmapped_bits[k];
         }
 
-      qsparse_set (new, col, row, qsparse_get_from_iterator (src, &it));
+      if (!qsparse_set (new, row, col, qsparse_get_from_iterator (src, &it)))
+        goto fail;
     }
   }
 
@@ -674,8 +929,49 @@ fail:
   return NULL;
 }
 
-void
-qsparse_destroy (qsparse_t *qsparse)
+qsparse_t *
+qsparse_copy (const qsparse_t *qsparse)
+{
+  qsparse_t *new;
+  qsparse_iterator_t it;
+
+  if (QSPARSE_IS_MONOMIAL (qsparse))
+  {
+    if ((new = __qsparse_monomial_new (qsparse->order)) == NULL)
+      return NULL;
+
+    memcpy (new->perm, qsparse->perm, QSPARSE_LENGTH (qsparse) * sizeof (unsigned int));
+    memcpy (new->phase, qsparse->phase, QSPARSE_LENGTH (qsparse) * sizeof (QCOMPLEX));
+
+    return new;
+  }
+
+  if ((new = qsparse_new (qsparse->order)) == NULL)
+    return NULL;
+
+  for (
+        qsparse_iterator_init (qsparse, &it);
+        !qsparse_iterator_end (&it);
+        qsparse_iterator_next (&it)
+        )
+    if (!qsparse_set (
+        new,
+        qsparse_iterator_row (&it),
+        qsparse_iterator_col (&it),
+        qsparse_get_from_iterator (qsparse, &it)))
+      goto fail;
+
+  return new;
+
+fail:
+  qsparse_destroy (new);
+
+  return NULL;
+}
+
+/* Release the row headers of the generic storage class */
+static void
+__qsparse_free_rows (qsparse_t *qsparse)
 {
   int i;
   unsigned int length;
@@ -695,7 +991,21 @@ qsparse_destroy (qsparse_t *qsparse)
     }
 
     free (qsparse->headers);
+
+    qsparse->headers = NULL;
   }
+}
+
+void
+qsparse_destroy (qsparse_t *qsparse)
+{
+  __qsparse_free_rows (qsparse);
+
+  if (qsparse->perm != NULL)
+    free (qsparse->perm);
+
+  if (qsparse->phase != NULL)
+    free (qsparse->phase);
 
   if (qsparse->col_nz != NULL)
     free (qsparse->col_nz);
@@ -706,6 +1016,34 @@ qsparse_destroy (qsparse_t *qsparse)
   free (qsparse);
 }
 
+/* Approximate number of bytes held by a matrix */
+size_t
+qsparse_get_footprint (const qsparse_t *qsparse)
+{
+  unsigned int i;
+  unsigned int length;
+  size_t size;
+
+  length = QSPARSE_LENGTH (qsparse);
+
+  if (QSPARSE_IS_MONOMIAL (qsparse))
+    return sizeof (qsparse_t) + length *
+        (sizeof (unsigned int) + sizeof (QCOMPLEX) + 2 * sizeof (QNZCOUNT));
+
+  size = sizeof (qsparse_t) +
+      length * (sizeof (struct qsparse_row) + 2 * sizeof (QNZCOUNT));
+
+  for (i = 0; i < length; ++i)
+  {
+    size += qsparse->headers[i].allocation_size * sizeof (QCOMPLEX);
+
+    if (qsparse->order > QSPARSE_INLINE_ORDER_MAX)
+      size += (length >> QSPARSE_INLINE_ORDER_MAX) * sizeof (uint64_t);
+  }
+
+  return size;
+}
+
 void
 qsparse_debug (const qsparse_t *qsparse)
 {
@@ -776,7 +1114,15 @@ qsparse_serialize (const qsparse_t *sparse, void *buffer, uint32_t size)
 
   /* Store column allocation bitmaps */
   for (i = 0; i < length; ++i)
-    if (!qsparse_row_is_empty (sparse, i))
+    if (QSPARSE_IS_MONOMIAL (sparse))
+    {
+      for (j = 0; j < rowgroups; ++j)
+        qsb_write_uint64_t (
+            &s,
+            (sparse->perm[i] >> QSPARSE_INLINE_ORDER_MAX) == j ?
+                1ull << (sparse->perm[i] & QSPARSE_INLINE_BITMAP_MASK) : 0);
+    }
+    else if (!qsparse_row_is_empty (sparse, i))
     {
       if (sparse->order <= QSPARSE_INLINE_ORDER_MAX)
         qsb_write_uint64_t (&s, sparse->headers[i].bitmap_long);
@@ -883,8 +1229,6 @@ qsparse_deserialize (const void *buffer, uint32_t size)
     goto fail;
   }
 
-  printf ("With order %d, I have %d bitmap words\n", order, row_bitmap_words);
-
   for (i = 0; i < row_bitmap_words; ++i)
 
   {
@@ -956,6 +1300,9 @@ qsparse_deserialize (const void *buffer, uint32_t size)
         goto fail;
     }
 
+  if (!qsparse_compact (new))
+    goto fail;
+
   free (row_bitmap);
   free (col_bitmap);
 
@@ -974,56 +1321,422 @@ fail:
   return NULL;
 }
 
+/* Last column (excluded) of the allocated span of a row */
+static inline unsigned int
+qsparse_row_get_end (const qsparse_t *qsparse, unsigned int row)
+{
+  unsigned int end;
+
+  end = qsparse->headers[row].allocation_start +
+      qsparse->headers[row].allocation_size;
+
+  return end < QSPARSE_LENGTH (qsparse) ? end : QSPARSE_LENGTH (qsparse);
+}
+
+/* Store the nonzero entries of acc[first..last] as a row of an empty
+ * matrix and clear them. Column counters are left untouched so that
+ * different rows can be stored concurrently.
+ */
+static QBOOL
+__qsparse_store_row (
+    qsparse_t *qsparse,
+    unsigned int row,
+    QCOMPLEX *acc,
+    unsigned int first,
+    unsigned int last)
+{
+  struct qsparse_row *rowptr;
+  unsigned int j, start, size;
+
+  rowptr = &qsparse->headers[row];
+
+  while (first <= last && QSPARSE_IS_ZERO (acc[first]))
+    ++first;
+
+  while (last > first && QSPARSE_IS_ZERO (acc[last]))
+    --last;
+
+  if (first > last)
+    return Q_TRUE;
+
+  start = first;
+  size  = last - first + 1;
+
+  qsparse_row_get_allocation (&start, &size);
+
+  if ((rowptr->coef = calloc (size, sizeof (QCOMPLEX))) == NULL)
+  {
+    q_set_last_error ("qsparse_mul: memory exhausted while allocating row");
+    return Q_FALSE;
+  }
+
+  rowptr->allocation_start = start;
+  rowptr->allocation_size  = size;
+
+  for (j = first; j <= last; ++j)
+    if (!QSPARSE_IS_ZERO (acc[j]))
+    {
+      rowptr->coef[j - start] = acc[j];
+      acc[j] = 0;
+
+      if (QSPARSE_USES_INLINE (qsparse))
+        rowptr->bitmap_long |= 1ull << j;
+      else
+        rowptr->bitmap_buf[j >> QSPARSE_INLINE_ORDER_MAX] |=
+            1ull << (j & QSPARSE_INLINE_BITMAP_MASK);
+
+      ++qsparse->row_nz[row];
+    }
+
+  return Q_TRUE;
+}
+
+static void
+__qsparse_count_cols (qsparse_t *qsparse)
+{
+  unsigned int i, j, length;
+
+  length = QSPARSE_LENGTH (qsparse);
+
+  memset (qsparse->col_nz, 0, length * sizeof (QNZCOUNT));
+
+  for (i = 0; i < length; ++i)
+    if (!qsparse_row_is_empty (qsparse, i))
+      for (
+          j = qsparse->headers[i].allocation_start;
+          j < qsparse_row_get_end (qsparse, i);
+          ++j)
+        if (__qsparse_coef_is_nz (qsparse, i, j))
+          ++qsparse->col_nz[j];
+}
+
+/* acc += coef * (row K of B), widening [first, last] accordingly */
+static inline void
+__qsparse_acc_row (
+    const qsparse_t *b,
+    unsigned int k,
+    QCOMPLEX coef,
+    QCOMPLEX *acc,
+    unsigned int *first,
+    unsigned int *last)
+{
+  const struct qsparse_row *brow;
+  unsigned int j;
+
+  if (QSPARSE_IS_MONOMIAL (b))
+  {
+    j = b->perm[k];
+    acc[j] += coef * b->phase[k];
+
+    if (j < *first)
+      *first = j;
+
+    if (j > *last)
+      *last = j;
+
+    return;
+  }
+
+  if (qsparse_row_is_empty (b, k))
+    return;
+
+  brow = &b->headers[k];
+
+  for (j = brow->allocation_start; j < qsparse_row_get_end (b, k); ++j)
+    if (__qsparse_coef_is_nz (b, k, j))
+    {
+      acc[j] += coef * brow->coef[j - brow->allocation_start];
+
+      if (j < *first)
+        *first = j;
+
+      if (j > *last)
+        *last = j;
+    }
+}
+
+/* Row I of A * B. This is the row-by-row (Gustavson) scheme: each
+ * nonzero A(i, k) scales row K of B into a dense accumulator, so the
+ * work done is exactly the number of nonzero partial products.
+ */
+static QBOOL
+__qsparse_mul_row (
+    qsparse_t *new,
+    const qsparse_t *a,
+    const qsparse_t *b,
+    unsigned int i,
+    QCOMPLEX *acc)
+{
+  const struct qsparse_row *arow;
+  unsigned int k;
+  unsigned int first, last;
+
+  first = QSPARSE_LENGTH (a);
+  last  = 0;
+
+  if (QSPARSE_IS_MONOMIAL (a))
+    __qsparse_acc_row (b, a->perm[i], a->phase[i], acc, &first, &last);
+  else if (!qsparse_row_is_empty (a, i))
+  {
+    arow = &a->headers[i];
+
+    for (k = arow->allocation_start; k < qsparse_row_get_end (a, i); ++k)
+      if (__qsparse_coef_is_nz (a, i, k))
+        __qsparse_acc_row (
+            b,
+            k,
+            arow->coef[k - arow->allocation_start],
+            acc,
+            &first,
+            &last);
+  }
+
+  if (first > last)
+    return Q_TRUE;
+
+  return __qsparse_store_row (new, i, acc, first, last);
+}
+
+/* Product of two monomial matrices, in O(2^n). Returns NULL without
+ * error if some coefficient of the product vanishes (underflow), in
+ * which case the generic product must be used.
+ */
+static qsparse_t *
+__qsparse_mul_monomial (const qsparse_t *a, const qsparse_t *b, QBOOL *ok)
+{
+  qsparse_t *new;
+  unsigned int i, length;
+
+  length = QSPARSE_LENGTH (a);
+
+  if ((new = __qsparse_monomial_new (a->order)) == NULL)
+  {
+    *ok = Q_FALSE;
+    return NULL;
+  }
+
+  for (i = 0; i < length; ++i)
+  {
+    new->perm[i]  = b->perm[a->perm[i]];
+    new->phase[i] = a->phase[i] * b->phase[a->perm[i]];
+
+    if (QSPARSE_IS_ZERO (new->phase[i]))
+    {
+      qsparse_destroy (new);
+      return NULL;
+    }
+  }
+
+  return new;
+}
+
 qsparse_t *
 qsparse_mul (const qsparse_t *a, const qsparse_t *b)
 {
   qsparse_t *new = NULL;
-  unsigned int i, j, k;
+  QCOMPLEX *acc = NULL;
+  unsigned int i;
   unsigned int length;
-
-  QCOMPLEX prod;
+  QBOOL ok = Q_TRUE;
 
   if (a->order != b->order)
   {
-    q_set_last_error ("qsparse_apply: order mismatch");
+    q_set_last_error ("qsparse_mul: order mismatch");
     goto fail;
   }
 
   length = QSPARSE_LENGTH (a);
 
+  if (QSPARSE_IS_MONOMIAL (a) && QSPARSE_IS_MONOMIAL (b))
+    if ((new = __qsparse_mul_monomial (a, b, &ok)) != NULL || !ok)
+      return new;
+
   if ((new = qsparse_new (a->order)) == NULL)
     goto fail;
 
-  /*
-   * i: row number in A
-   * j: col number in B
-   */
+  if ((acc = calloc (length, sizeof (QCOMPLEX))) == NULL)
+  {
+    q_set_last_error ("qsparse_mul: memory exhausted while allocating accumulator");
+    goto fail;
+  }
 
-  for (j = 0; j < length; ++j)
-    if (b->col_nz[j] > 0) /* Is column J of B nonempty? */
-      for (i = 0; i < length; ++i)
-        if (a->row_nz[i] > 0) /* Is row I of A nonempty? */
-        {
-          prod = 0;
+  for (i = 0; i < length; ++i)
+    if (!__qsparse_mul_row (new, a, b, i, acc))
+      goto fail;
 
-          for (k = 0; k < length; ++k)
-            if (__qsparse_coef_is_nz (a, i, k) &&
-                __qsparse_coef_is_nz (b, k, j))
-              prod += qsparse_get (a, i, k) * qsparse_get (b, k, j);
+  __qsparse_count_cols (new);
 
-          if (!qsparse_set (new, i, j, prod))
-            goto fail;
-        }
+  if (!qsparse_compact (new))
+    goto fail;
+
+  free (acc);
 
   return new;
 
 fail:
-  if (new == NULL)
+  if (acc != NULL)
+    free (acc);
+
+  if (new != NULL)
     qsparse_destroy (new);
 
   return NULL;
 }
 
+#define QSPARSE_MUL_BLOCKS_PER_THREAD 4
+
+struct qsparse_mul_ctx
+{
+  qsparse_t *new;
+  const qsparse_t *a;
+  const qsparse_t *b;
+  unsigned int rows_per_block;
+};
+
+static QBOOL
+__qsparse_mul_block (unsigned int block, void *priv)
+{
+  struct qsparse_mul_ctx *ctx = (struct qsparse_mul_ctx *) priv;
+  QCOMPLEX *acc;
+  unsigned int i, first, last;
+  QBOOL ok = Q_TRUE;
+
+  if ((acc = calloc (QSPARSE_LENGTH (ctx->a), sizeof (QCOMPLEX))) == NULL)
+  {
+    q_set_last_error ("qsparse_mul_parallel: memory exhausted while allocating accumulator");
+    return Q_FALSE;
+  }
+
+  first = block * ctx->rows_per_block;
+  last  = first + ctx->rows_per_block;
+
+  if (last > QSPARSE_LENGTH (ctx->a))
+    last = QSPARSE_LENGTH (ctx->a);
+
+  for (i = first; ok && i < last; ++i)
+    ok = __qsparse_mul_row (ctx->new, ctx->a, ctx->b, i, acc);
+
+  free (acc);
+
+  return ok;
+}
+
+/* Same as qsparse_mul, with the rows of the result split among
+ * q_get_thread_count () threads. Use it only when no other product is
+ * being computed concurrently.
+ */
+qsparse_t *
+qsparse_mul_parallel (const qsparse_t *a, const qsparse_t *b)
+{
+  struct qsparse_mul_ctx ctx;
+  unsigned int length, blocks;
+
+  if (a->order != b->order)
+  {
+    q_set_last_error ("qsparse_mul_parallel: order mismatch");
+    return NULL;
+  }
+
+  length = QSPARSE_LENGTH (a);
+  blocks = q_get_thread_count () * QSPARSE_MUL_BLOCKS_PER_THREAD;
+
+  if (blocks <= QSPARSE_MUL_BLOCKS_PER_THREAD ||
+      (QSPARSE_IS_MONOMIAL (a) && QSPARSE_IS_MONOMIAL (b)))
+    return qsparse_mul (a, b);
+
+  if (blocks > length)
+    blocks = length;
+
+  if ((ctx.new = qsparse_new (a->order)) == NULL)
+    return NULL;
+
+  ctx.a = a;
+  ctx.b = b;
+  ctx.rows_per_block = (length + blocks - 1) / blocks;
+
+  blocks = (length + ctx.rows_per_block - 1) / ctx.rows_per_block;
+
+  if (!q_parallel_for (blocks, __qsparse_mul_block, &ctx))
+  {
+    qsparse_destroy (ctx.new);
+    return NULL;
+  }
+
+  __qsparse_count_cols (ctx.new);
+
+  if (!qsparse_compact (ctx.new))
+  {
+    qsparse_destroy (ctx.new);
+    return NULL;
+  }
+
+  return ctx.new;
+}
+
+/* Number of scalar products needed to compute A * B */
+uint64_t
+qsparse_mul_cost (const qsparse_t *a, const qsparse_t *b)
+{
+  unsigned int k, length;
+  uint64_t cost = 0;
+
+  length = QSPARSE_LENGTH (a);
+
+  for (k = 0; k < length; ++k)
+    cost += (uint64_t) a->col_nz[k] * b->row_nz[k];
+
+  return cost;
+}
+
+/* Decide how to associate A * B * C. The nonzero counters of the
+ * intermediate products are bounded from the counters of the operands
+ * (ignoring cancellations), which is enough to avoid the bad order
+ * when one of the ends is much sparser than the other.
+ *
+ * Returns Q_TRUE if (A * B) * C is expected to be cheaper than
+ * A * (B * C).
+ */
+QBOOL
+qsparse_mul3_left_first (const qsparse_t *a, const qsparse_t *b, const qsparse_t *c)
+{
+  qsparse_iterator_t it;
+  unsigned int *ab_col_nz, *bc_row_nz;
+  unsigned int k, length;
+  uint64_t left, right;
+
+  length = QSPARSE_LENGTH (b);
+
+  if ((ab_col_nz = calloc (2 * length, sizeof (unsigned int))) == NULL)
+    return Q_TRUE;
+
+  bc_row_nz = ab_col_nz + length;
+
+  /* Column K of A * B has nonzeros wherever a column M of A does, for
+   * every nonzero B(m, k). Conversely for rows of B * C. */
+  for (
+        qsparse_iterator_init (b, &it);
+        !qsparse_iterator_end (&it);
+        qsparse_iterator_next (&it)
+        )
+  {
+    ab_col_nz[qsparse_iterator_col (&it)] += a->col_nz[qsparse_iterator_row (&it)];
+    bc_row_nz[qsparse_iterator_row (&it)] += c->row_nz[qsparse_iterator_col (&it)];
+  }
+
+  left  = qsparse_mul_cost (a, b);
+  right = qsparse_mul_cost (b, c);
+
+  for (k = 0; k < length; ++k)
+  {
+    left  += (uint64_t) (ab_col_nz[k] < length ? ab_col_nz[k] : length) * c->row_nz[k];
+    right += (uint64_t) a->col_nz[k] * (bc_row_nz[k] < length ? bc_row_nz[k] : length);
+  }
+
+  free (ab_col_nz);
+
+  return left <= right;
+}
+
 QCOMPLEX *
 qsparse_alloc_vec (const qsparse_t *sparse)
 {
@@ -1044,6 +1757,14 @@ qsparse_mul_vec (const qsparse_t *sparse, const QCOMPLEX *x, QCOMPLEX *y)
 
   length = QSPARSE_LENGTH (sparse);
 
+  if (QSPARSE_IS_MONOMIAL (sparse))
+  {
+    for (i = 0; i < length; ++i)
+      y[i] = sparse->phase[i] * x[sparse->perm[i]];
+
+    return;
+  }
+
   for (i = 0; i < length; ++i)
   {
     prod = 0.0;
@@ -22,6 +22,8 @@
 #ifndef _LIBQ_QSPARSE_H
 #define _LIBQ_QSPARSE_H
 
+#include <stddef.h>
+
 #include "q_defines.h"
 #include "q_util.h"
 
@@ -32,6 +34,7 @@
 #define BITMAP_HAS_BIT(bitmap, id) ((bitmap) & (1ull << (id)))
 #define QSPARSE_LENGTH(qsparse) (1 << (qsparse)->order)
 #define QSPARSE_USES_INLINE(qsparse) ((qsparse)->order <= QSPARSE_INLINE_ORDER_MAX)
+#define QSPARSE_IS_MONOMIAL(qsparse) ((qsparse)->perm != NULL)
 #define QSPARSE_IS_ZERO(x) ((x) == 0.0)
 
 struct qsparse_row
@@ -66,6 +69,13 @@ struct qsparse
   QNZCOUNT *col_nz;
 
   struct qsparse_row *headers;
+
+  /* Monomial storage class: exactly one nonzero per row and column
+   * (permutations, phases and their products). Row i holds phase[i]
+   * at column perm[i]. Headers are not allocated in this case.
+   */
+  unsigned int *perm;
+  QCOMPLEX *phase;
 };
 
 struct qsparse_iterator
@@ -109,11 +119,17 @@ QBOOL qsparse_det (const qsparse_t *, QCOMPLEX *); /* Compute determinant */
 
 int qsparse_contractable (const qsparse_t *, unsigned int, unsigned int *);
 qsparse_t *qsparse_copy (const qsparse_t *);
+QBOOL qsparse_compact (qsparse_t *);
 QBOOL qsparse_apply (qsparse_t *, const qsparse_t *);
 qsparse_t *qsparse_mul (const qsparse_t *, const qsparse_t *);
+qsparse_t *qsparse_mul_parallel (const qsparse_t *, const qsparse_t *);
+uint64_t qsparse_mul_cost (const qsparse_t *, const qsparse_t *);
+QBOOL qsparse_mul3_left_first (const qsparse_t *, const qsparse_t *, const qsparse_t *);
 
 void qsparse_destroy (qsparse_t *);
 
+size_t qsparse_get_footprint (const qsparse_t *);
+
 uint32_t qsparse_serialize (const qsparse_t *, void *, uint32_t);
 qsparse_t *qsparse_deserialize (const void *, uint32_t);
 
@@ -21,11 +21,33 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "q_defines.h"
 #include "q_util.h"
 
-static char last_error[QSPARSE_LAST_ERROR_MAX];
+#define Q_THREAD_COUNT_MAX 64
+
+/* Errors are per thread, as workers may fail concurrently */
+static __thread char last_error[QSPARSE_LAST_ERROR_MAX];
+
+static unsigned int thread_count = 0; /* 0: one per online CPU */
+
+struct q_parallel_ctx
+{
+  q_parallel_fn_t fn;
+  void *priv;
+
+  unsigned int count;
+  unsigned int next; /* Next index to hand out, atomically incremented */
+
+  QBOOL failed;
+  char error[QSPARSE_LAST_ERROR_MAX];
+
+  pthread_mutex_t lock;
+};
 
 void
 q_set_last_error (const char *fmt, ...)
@@ -44,3 +66,111 @@ q_get_last_error (void)
 {
   return last_error;
 }
+
+unsigned int
+q_get_thread_count (void)
+{
+  long cpus;
+
+  if (thread_count != 0)
+    return thread_count;
+
+  if ((cpus = sysconf (_SC_NPROCESSORS_ONLN)) < 1)
+    return 1;
+
+  if (cpus > Q_THREAD_COUNT_MAX)
+    cpus = Q_THREAD_COUNT_MAX;
+
+  return cpus;
+}
+
+void
+q_set_thread_count (unsigned int count)
+{
+  if (count > Q_THREAD_COUNT_MAX)
+    count = Q_THREAD_COUNT_MAX;
+
+  thread_count = count;
+}
+
+static void *
+q_parallel_worker (void *data)
+{
+  struct q_parallel_ctx *ctx;
+  unsigned int i;
+
+  ctx = (struct q_parallel_ctx *) data;
+
+  /* failed is polled outside the lock by the other workers */
+  while (!__atomic_load_n (&ctx->failed, __ATOMIC_ACQUIRE) &&
+         (i = __sync_fetch_and_add (&ctx->next, 1)) < ctx->count)
+    if (!(ctx->fn) (i, ctx->priv))
+    {
+      pthread_mutex_lock (&ctx->lock);
+
+      if (!__atomic_load_n (&ctx->failed, __ATOMIC_RELAXED))
+      {
+        strncpy (ctx->error, q_get_last_error (), QSPARSE_LAST_ERROR_MAX - 1);
+        __atomic_store_n (&ctx->failed, Q_TRUE, __ATOMIC_RELEASE);
+      }
+
+      pthread_mutex_unlock (&ctx->lock);
+    }
+
+  return NULL;
+}
+
+/* Run fn (0 ... count - 1) on the worker threads. Indices are handed out
+ * one by one, so jobs of uneven cost are balanced automatically. The
+ * calling thread takes part in the loop too. If any call fails, no more
+ * indices are handed out and its error becomes the caller's last error.
+ */
+QBOOL
+q_parallel_for (unsigned int count, q_parallel_fn_t fn, void *priv)
+{
+  struct q_parallel_ctx ctx;
+  pthread_t threads[Q_THREAD_COUNT_MAX];
+  unsigned int i, n, started = 0;
+
+  n = q_get_thread_count ();
+
+  if (n > count)
+    n = count;
+
+  if (n <= 1)
+  {
+    for (i = 0; i < count; ++i)
+      if (!(fn) (i, priv))
+        return Q_FALSE;
+
+    return Q_TRUE;
+  }
+
+  memset (&ctx, 0, sizeof (struct q_parallel_ctx));
+
+  ctx.fn    = fn;
+  ctx.priv  = priv;
+  ctx.count = count;
+
+  pthread_mutex_init (&ctx.lock, NULL);
+
+  /* If we cannot create some thread, the remaining ones do its work */
+  for (i = 0; i < n - 1; ++i)
+    if (pthread_create (&threads[started], NULL, q_parallel_worker, &ctx) == 0)
+      ++started;
+
+  (void) q_parallel_worker (&ctx);
+
+  for (i = 0; i < started; ++i)
+    pthread_join (threads[i], NULL);
+
+  pthread_mutex_destroy (&ctx.lock);
+
+  if (ctx.failed)
+  {
+    q_set_last_error ("%s", ctx.error);
+    return Q_FALSE;
+  }
+
+  return Q_TRUE;
+}
@@ -0,0 +1,377 @@
+/*
+  qcache.c: Content-addressed on-disk cache of circuit operators
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "qcache.h"
+
+/* Bump whenever the key derivation or the operator layout changes */
+#define QCACHE_KEY_TAG "qcache-1"
+
+qcache_t *
+qcache_new (const char *path)
+{
+  qcache_t *new = NULL;
+
+  if (mkdir (path, 0755) == -1 && errno != EEXIST)
+  {
+    q_set_last_error ("qcache_new: cannot create cache directory %s: %s",
+                      path, strerror (errno));
+    goto fail;
+  }
+
+  if ((new = calloc (1, sizeof (qcache_t))) == NULL)
+  {
+    q_set_last_error ("qcache_new: memory exhausted");
+    goto fail;
+  }
+
+  if ((new->path = strdup (path)) == NULL)
+  {
+    q_set_last_error ("qcache_new: memory exhausted");
+    goto fail;
+  }
+
+  return new;
+
+fail:
+  if (new != NULL)
+    qcache_destroy (new);
+
+  return NULL;
+}
+
+void
+qcache_destroy (qcache_t *cache)
+{
+  if (cache->path != NULL)
+    free (cache->path);
+
+  free (cache);
+}
+
+static void
+qgate_hash (const qgate_t *gate, qhash_t *hash)
+{
+  unsigned int i, length;
+
+  length = 1 << (gate->order << 1);
+
+  qhash_update_uint32_t (hash, gate->order);
+
+  if (gate->kind == QGATE_KIND_CONTROLLED)
+  {
+    qhash_update_uint32_t (hash, gate->kind);
+    qhash_update_uint32_t (hash, (uint32_t) gate->pattern);
+    qhash_update_uint32_t (hash, (uint32_t) (gate->pattern >> 32));
+    qgate_hash (gate->target, hash);
+
+    return;
+  }
+  else if (gate->kind == QGATE_KIND_ORACLE)
+  {
+    qhash_update_uint32_t (hash, gate->kind);
+
+    for (i = 0; i < 1 << gate->order; ++i)
+      qhash_update_uint32_t (hash, gate->table[i]);
+
+    return;
+  }
+
+  for (i = 0; i < length; ++i)
+    qhash_update_complex (hash, gate->coef[i]);
+}
+
+/* The key depends only on what determines U: the circuit order and the
+ * sequence of gate contents and remaps. Gate and circuit names are left
+ * out on purpose, so identical subcircuits share their entry.
+ */
+void
+qcircuit_get_key (const qcircuit_t *circuit, uint8_t *key)
+{
+  qhash_t hash;
+  const qwiring_t *this;
+  unsigned int i;
+
+  qhash_init (&hash);
+
+  qhash_update (&hash, QCACHE_KEY_TAG, sizeof (QCACHE_KEY_TAG));
+  qhash_update_uint32_t (&hash, circuit->order);
+
+  for (this = qcircuit_get_wiring_head (circuit);
+       this != NULL;
+       this = qwiring_next (this))
+  {
+    qgate_hash (this->gate, &hash);
+
+    for (i = 0; i < this->gate->order; ++i)
+      qhash_update_uint32_t (&hash, this->remap[i]);
+  }
+
+  qhash_final (&hash, key);
+}
+
+static char *
+qcache_get_path (const qcache_t *cache, const uint8_t *key, QBOOL dir_only)
+{
+  char hex[(QHASH_LENGTH << 1) + 1];
+  char *path;
+  size_t size;
+
+  qhash_to_string (key, hex);
+
+  size = strlen (cache->path) + sizeof (hex) + sizeof (QCACHE_FILE_SUFFIX) + 2;
+
+  if ((path = malloc (size)) == NULL)
+  {
+    q_set_last_error ("qcache: memory exhausted");
+    return NULL;
+  }
+
+  if (dir_only)
+    snprintf (path, size, "%s/%.2s", cache->path, hex);
+  else
+    snprintf (path, size, "%s/%.2s/%s" QCACHE_FILE_SUFFIX, cache->path, hex, hex + 2);
+
+  return path;
+}
+
+static void *
+qcache_read_file (const char *path, uint32_t *size)
+{
+  int fd;
+  struct stat sbuf;
+  void *buffer = NULL;
+  ssize_t got;
+  size_t p = 0;
+
+  if ((fd = open (path, O_RDONLY)) == -1)
+    return NULL;
+
+  if (fstat (fd, &sbuf) == -1 || sbuf.st_size == 0 || sbuf.st_size > UINT32_MAX)
+    goto fail;
+
+  if ((buffer = malloc (sbuf.st_size)) == NULL)
+    goto fail;
+
+  while (p < sbuf.st_size)
+  {
+    if ((got = read (fd, (uint8_t *) buffer + p, sbuf.st_size - p)) <= 0)
+    {
+      if (got == -1 && errno == EINTR)
+        continue;
+
+      goto fail;
+    }
+
+    p += got;
+  }
+
+  close (fd);
+
+  *size = sbuf.st_size;
+
+  return buffer;
+
+fail:
+  if (buffer != NULL)
+    free (buffer);
+
+  close (fd);
+
+  return NULL;
+}
+
+/* Missing, truncated or corrupt entries are all reported as misses */
+qsparse_t *
+qcache_lookup (qcache_t *cache, const uint8_t *key, unsigned int order)
+{
+  char *path;
+  void *buffer = NULL;
+  uint32_t size;
+  qsparse_t *sparse = NULL;
+
+  if ((path = qcache_get_path (cache, key, Q_FALSE)) == NULL)
+    return NULL;
+
+  if ((buffer = qcache_read_file (path, &size)) != NULL)
+    if ((sparse = qsparse_deserialize (buffer, size)) != NULL)
+      if (sparse->order != order)
+      {
+        qsparse_destroy (sparse);
+        sparse = NULL;
+      }
+
+  if (sparse != NULL)
+    ++cache->hits;
+  else
+    ++cache->misses;
+
+  if (buffer != NULL)
+    free (buffer);
+
+  free (path);
+
+  return sparse;
+}
+
+QBOOL
+qcache_store (qcache_t *cache, const uint8_t *key, const qsparse_t *sparse)
+{
+  char *dir = NULL;
+  char *path = NULL;
+  char *tmp = NULL;
+  void *buffer = NULL;
+  uint32_t size, p = 0;
+  ssize_t written;
+  int fd = -1;
+
+  QBOOL ok = Q_FALSE;
+
+  if ((dir = qcache_get_path (cache, key, Q_TRUE)) == NULL ||
+      (path = qcache_get_path (cache, key, Q_FALSE)) == NULL)
+    goto done;
+
+  if ((tmp = malloc (strlen (dir) + sizeof ("/tmp.XXXXXX"))) == NULL)
+  {
+    q_set_last_error ("qcache_store: memory exhausted");
+    goto done;
+  }
+
+  sprintf (tmp, "%s/tmp.XXXXXX", dir);
+
+  if (mkdir (dir, 0755) == -1 && errno != EEXIST)
+  {
+    q_set_last_error ("qcache_store: cannot create %s: %s", dir, strerror (errno));
+    goto done;
+  }
+
+  size = qsparse_serialize (sparse, NULL, 0);
+
+  if ((buffer = malloc (size)) == NULL)
+  {
+    q_set_last_error ("qcache_store: memory exhausted");
+    goto done;
+  }
+
+  (void) qsparse_serialize (sparse, buffer, size);
+
+  if ((fd = mkstemp (tmp)) == -1)
+  {
+    q_set_last_error ("qcache_store: cannot create temporary file: %s", strerror (errno));
+    goto done;
+  }
+
+  while (p < size)
+  {
+    if ((written = write (fd, (uint8_t *) buffer + p, size - p)) == -1)
+    {
+      if (errno == EINTR)
+        continue;
+
+      q_set_last_error ("qcache_store: write failed: %s", strerror (errno));
+      goto done;
+    }
+
+    p += written;
+  }
+
+  if (close (fd) == -1)
+  {
+    fd = -1;
+    q_set_last_error ("qcache_store: close failed: %s", strerror (errno));
+    goto done;
+  }
+
+  fd = -1;
+
+  /* Atomic replace: concurrent writers of the same key store identical
+   * contents, so the last one simply wins. */
+  if (rename (tmp, path) == -1)
+  {
+    q_set_last_error ("qcache_store: cannot rename to %s: %s", path, strerror (errno));
+    goto done;
+  }
+
+  ok = Q_TRUE;
+
+done:
+  if (fd != -1)
+    close (fd);
+
+  if (!ok && tmp != NULL)
+    (void) unlink (tmp);
+
+  if (buffer != NULL)
+    free (buffer);
+
+  if (tmp != NULL)
+    free (tmp);
+
+  if (path != NULL)
+    free (path);
+
+  if (dir != NULL)
+    free (dir);
+
+  return ok;
+}
+
+/* Like qcircuit_update, but tries the cache first. A failure to store the
+ * computed operator is not an error: the cache is only an accelerator.
+ */
+QBOOL
+qcircuit_update_cached (qcircuit_t *circuit, qcache_t *cache)
+{
+  uint8_t key[QCACHE_KEY_LENGTH];
+  qsparse_t *u;
+
+  if (cache == NULL)
+    return qcircuit_update (circuit);
+
+  /* The key depends on the bound parameters, so do the wiring serials */
+  qcircuit_check_params (circuit);
+
+  qcircuit_get_key (circuit, key);
+
+  if ((u = qcache_lookup (cache, key, circuit->order)) != NULL)
+  {
+    if (circuit->u != NULL)
+      qsparse_destroy (circuit->u);
+
+    circuit->u = u;
+    circuit->updated = Q_TRUE;
+
+    return Q_TRUE;
+  }
+
+  if (!qcircuit_update (circuit))
+    return Q_FALSE;
+
+  (void) qcache_store (cache, key, circuit->u);
+
+  return Q_TRUE;
+}
@@ -0,0 +1,56 @@
+/*
+  qcache.h: Content-addressed on-disk cache of circuit operators
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _LIBQCIRCUIT_QCACHE_H
+#define _LIBQCIRCUIT_QCACHE_H
+
+#include <qhash.h>
+
+#include "qcircuit.h"
+
+#define QCACHE_KEY_LENGTH QHASH_LENGTH
+#define QCACHE_FILE_SUFFIX ".qsp"
+
+/* Cached operators live in <path>/<first key byte>/<rest of key>.qsp
+ * and are written through a temporary file plus rename (2), so several
+ * assemblers may share the same cache directory.
+ */
+struct qcache
+{
+  char *path;
+
+  unsigned int hits;
+  unsigned int misses;
+};
+
+typedef struct qcache qcache_t;
+
+qcache_t *qcache_new (const char *);
+void qcache_destroy (qcache_t *);
+
+void qcircuit_get_key (const qcircuit_t *, uint8_t *);
+
+qsparse_t *qcache_lookup (qcache_t *, const uint8_t *, unsigned int);
+QBOOL qcache_store (qcache_t *, const uint8_t *, const qsparse_t *);
+
+QBOOL qcircuit_update_cached (qcircuit_t *, qcache_t *);
+
+#endif /* _LIBQCIRCUIT_QCACHE_H */
@@ -22,131 +22,150 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
 #include "qcircuit.h"
+#include "qstab.h"
+#include "qmps.h"
+#include "qmeasure.h"
+#include "qparam.h"
+
+static unsigned long qgate_last_serial = 0;
 
-struct qstate_info
+void
+qgate_destroy (qgate_t *gate)
 {
-  unsigned int i;
-  double p; /* Density function */
-  double d; /* Distribution function */
-};
+  if (gate->name != NULL)
+    free (gate->name);
 
+  if (gate->description != NULL)
+    free (gate->description);
 
-/* The following PRNG has been taken from Paul Hsieh's website at
- * http://www.azillionmonkeys.com/qed/random.html
- */
+  if (gate->coef != NULL)
+    free (gate->coef);
 
-#define RS_SCALE (1.0 / (1.0 + RAND_MAX))
+  if (gate->table != NULL)
+    free (gate->table);
 
-/* A non-overflowing average function */
-#define average2scomplement(x,y) ((x) & (y)) + (((x) ^ (y))/2)
+  if (gate->sparse != NULL)
+    qsparse_destroy (gate->sparse);
 
-int
-randbiased (double x)
-{
-  double p;
+  if (gate->clifford != NULL)
+    qclifford_destroy (gate->clifford);
 
-  for (;;)
-  {
-    p = rand () * RS_SCALE;
+  free (gate);
+}
 
-    if (p >= x)
-      return 0;
+/* Identity outside the subspace selected by the controls, target inside.
+ * Only nonzeros are visited: the dense matrix is never built. */
+static QBOOL
+qgate_init_controlled_sparse (qgate_t *gate)
+{
+  qsparse_iterator_t it;
+  unsigned int i, length, base;
 
-    if (p + RS_SCALE <= x)
-      return 1;
-    /* p < x < p+RS_SCALE */
-    x = (x - p) * (1.0 + RAND_MAX);
-  }
+  length = 1 << gate->order;
+  base   = (unsigned int) gate->pattern << gate->target->order;
 
-  return 0; /* We will never get here */
-}
+  if ((gate->sparse = qsparse_new (gate->order)) == NULL)
+    return Q_FALSE;
 
-unsigned int
-randslot (const struct qstate_info *slots, unsigned int n)
-{
-  double xhi;
+  for (i = 0; i < length; ++i)
+    if ((i >> gate->target->order) != gate->pattern)
+      if (!qsparse_set (gate->sparse, i, i, 1.))
+        goto fail;
+
+  for (
+      qsparse_iterator_init (gate->target->sparse, &it);
+      !qsparse_iterator_end (&it);
+      qsparse_iterator_next (&it))
+    if (!qsparse_set (
+        gate->sparse,
+        base | qsparse_iterator_row (&it),
+        base | qsparse_iterator_col (&it),
+        qsparse_get_from_iterator (gate->target->sparse, &it)))
+      goto fail;
 
-  /* Select a random range [x,x+RS_SCALE) */
-  double x = rand () * RS_SCALE;
+  if (!qsparse_compact (gate->sparse))
+    goto fail;
 
-  /* Perform binary search to find the intersecting slot */
-  unsigned int hi = n - 2, lo = 0, mi, li;
-  while (hi > lo)
-  {
-    mi = average2scomplement (lo, hi);
+  return Q_TRUE;
 
-    if (x >= slots[mi].d)
-      lo = mi + 1;
-    else
-      hi = mi;
-  }
+fail:
+  qsparse_destroy (gate->sparse);
 
-  /* Taking slots[-1]=0.0, this is now true: slots[lo-1] <= x < slots[lo] */
+  gate->sparse = NULL;
 
-  /* If slots[lo-1] <= x < x+RS_SCALE <= slots[lo] then
-     any point in [x,x+RS_SCALE) is in [slots[lo-1],slots[lo]) */
+  return Q_FALSE;
+}
 
-  if ((xhi = x + RS_SCALE) <= slots[lo].d)
-    return lo;
+/* Check that the table is a permutation, and build the sparse matrix
+ * of small oracles: column i has a single 1 at row table[i]. */
+static QBOOL
+qgate_init_oracle_sparse (qgate_t *gate)
+{
+  uint64_t *seen;
+  unsigned int i, length;
 
-  /* Otherwise x < slots[lo] < x+RS_SCALE */
+  length = 1 << gate->order;
 
-  for (;;)
+  if ((seen = calloc ((length + 63) >> 6, sizeof (uint64_t))) == NULL)
   {
-    /* x < slots[lo] < xhi */
-    if (randbiased ((slots[lo].d - x) / (xhi - x)))
-      return lo;
+    q_set_last_error ("memory exhausted");
+    return Q_FALSE;
+  }
 
-    x = slots[lo].d;
+  for (i = 0; i < length; ++i)
+  {
+    if (BITMAP_HAS_BIT (seen[gate->table[i] >> 6], gate->table[i] & 63))
+    {
+      q_set_last_error (
+          "oracle `%s' is not reversible (state %u reached twice)",
+          gate->name,
+          gate->table[i]);
+      free (seen);
+      return Q_FALSE;
+    }
 
-    lo++;
+    seen[gate->table[i] >> 6] |= 1ull << (gate->table[i] & 63);
+  }
 
-    if (lo >= n - 1)
-      return n - 1;
+  free (seen);
 
-    /* slots[lo-1] = x <= xhi <= slots[lo] */
-    if (xhi <= slots[lo].d)
-        return lo;
-  }
+  if (gate->order > QSPARSE_ORDER_MAX)
+    return Q_TRUE;
 
-  /* We will never get here */
-  return 0;
-}
+  if ((gate->sparse = qsparse_new (gate->order)) == NULL)
+    return Q_FALSE;
 
-void
-qgate_destroy (qgate_t *gate)
-{
-  if (gate->name != NULL)
-    free (gate->name);
+  for (i = 0; i < length; ++i)
+    if (!qsparse_set (gate->sparse, gate->table[i], i, 1.))
+      goto fail;
 
-  if (gate->description != NULL)
-    free (gate->description);
+  if (!qsparse_compact (gate->sparse))
+    goto fail;
 
-  if (gate->coef != NULL)
-    free (gate->coef);
+  return Q_TRUE;
 
-  if (gate->sparse != NULL)
-    qsparse_destroy (gate->sparse);
+fail:
+  qsparse_destroy (gate->sparse);
 
-  free (gate);
+  gate->sparse = NULL;
+
+  return Q_FALSE;
 }
 
-QBOOL
-qgate_init_sparse (qgate_t *gate)
+static QBOOL
+qgate_init_matrix_sparse (qgate_t *gate)
 {
   unsigned int i, j;
   unsigned int length;
 
   length = 1 << gate->order;
 
-  if (gate->sparse != NULL)
-  {
-    q_set_last_error ("gate sparse matrix already initialized");
-
-    return Q_FALSE;
-  }
-
   if ((gate->sparse = qsparse_new (gate->order)) == NULL)
     return Q_FALSE;
 
@@ -162,9 +181,69 @@ qgate_init_sparse (qgate_t *gate)
           return Q_FALSE;
         }
 
+  /* Permutations and phases get the cheap storage class */
+  if (!qsparse_compact (gate->sparse))
+  {
+    qsparse_destroy (gate->sparse);
+
+    gate->sparse = NULL;
+
+    return Q_FALSE;
+  }
+
+  return Q_TRUE;
+}
+
+QBOOL
+qgate_init_sparse (qgate_t *gate)
+{
+  if (gate->sparse != NULL)
+  {
+    q_set_last_error ("gate sparse matrix already initialized");
+
+    return Q_FALSE;
+  }
+
+  if (gate->kind == QGATE_KIND_CONTROLLED)
+  {
+    /* Big controlled gates are only usable by the simulator */
+    if (gate->order <= QSPARSE_ORDER_MAX)
+      if (!qgate_init_controlled_sparse (gate))
+        return Q_FALSE;
+  }
+  else if (gate->kind == QGATE_KIND_ORACLE)
+  {
+    if (!qgate_init_oracle_sparse (gate))
+      return Q_FALSE;
+  }
+  else if (!qgate_init_matrix_sparse (gate))
+    return Q_FALSE;
+
+  /* Small Clifford gates can also run on a stabilizer tableau */
+  if (gate->sparse != NULL)
+    gate->clifford = qclifford_new (gate->sparse, gate->order);
+
+  gate->serial = __sync_add_and_fetch (&qgate_last_serial, 1);
+
   return Q_TRUE;
 }
 
+qsparse_t *
+qgate_expand (const qgate_t *gate, unsigned int order, const unsigned int *remap)
+{
+  if (gate->sparse == NULL)
+  {
+    if (gate->kind != QGATE_KIND_MATRIX)
+      q_set_last_error ("gate `%s' too big to be expanded", gate->name);
+    else
+      q_set_last_error ("cannot expand uninitialized gate");
+
+    return NULL;
+  }
+
+  return qsparse_expand (gate->sparse, order, (unsigned int *) remap);
+}
+
 qgate_t *
 qgate_new (unsigned int order, const char *name, const char *desc, const QCOMPLEX *coef)
 {
@@ -189,7 +268,7 @@ qgate_new (unsigned int order, const char *name, const char *desc, const QCOMPLE
 
   if (coef != NULL)
   {
-    memcpy (new->coef, coef, length);
+    memcpy (new->coef, coef, length * sizeof (QCOMPLEX));
 
     if (!qgate_init_sparse (new))
       goto fail;
@@ -204,12 +283,172 @@ fail:
   return NULL;
 }
 
+/* Gate applying TARGET to its qubits when the CONTROLS extra qubits
+ * (placed after the target ones) are in the state given by PATTERN.
+ * Controlled gates of controlled gates are flattened.
+ */
+qgate_t *
+qgate_controlled_new (
+    const char *name,
+    const char *desc,
+    const qgate_t *target,
+    unsigned int controls,
+    uint64_t pattern)
+{
+  qgate_t *new = NULL;
+
+  if (target->kind == QGATE_KIND_CONTROLLED)
+  {
+    pattern   = target->pattern | (pattern << target->controls);
+    controls += target->controls;
+    target    = target->target;
+  }
+
+  if (controls == 0 || target->order + controls > 64)
+  {
+    q_set_last_error ("invalid number of controls (%d)", controls);
+    return NULL;
+  }
+
+  if (controls < 64 && (pattern >> controls) != 0)
+  {
+    q_set_last_error ("control pattern does not fit in %d controls", controls);
+    return NULL;
+  }
+
+  if (target->sparse == NULL)
+  {
+    q_set_last_error ("target gate `%s' not initialized", target->name);
+    return NULL;
+  }
+
+  /* The controlled matrix would not follow later bindings */
+  if (qgate_is_parametric (target))
+  {
+    q_set_last_error ("target gate `%s' is parametric", target->name);
+    return NULL;
+  }
+
+  if ((new = calloc (1, sizeof (qgate_t))) == NULL ||
+      (new->name = strdup (name)) == NULL ||
+      (new->description = strdup (desc)) == NULL)
+  {
+    q_set_last_error ("memory exhausted");
+    goto fail;
+  }
+
+  new->order    = target->order + controls;
+  new->kind     = QGATE_KIND_CONTROLLED;
+  new->target   = target;
+  new->controls = controls;
+  new->pattern  = pattern;
+
+  if (!qgate_init_sparse (new))
+    goto fail;
+
+  return new;
+
+fail:
+  if (new != NULL)
+    qgate_destroy (new);
+
+  return NULL;
+}
+
+/* Gate permuting the basis states: state i becomes state table[i]. If
+ * table is NULL, the gate starts as the identity and must be finished
+ * with qgate_oracle_map and qgate_init_sparse.
+ */
+qgate_t *
+qgate_oracle_new (unsigned int order, const char *name, const char *desc, const uint32_t *table)
+{
+  qgate_t *new = NULL;
+  unsigned int i, length;
+
+  if (order == 0 || order > QGATE_ORACLE_ORDER_MAX)
+  {
+    q_set_last_error ("invalid oracle order (%d)", order);
+    return NULL;
+  }
+
+  length = 1 << order;
+
+  if ((new = calloc (1, sizeof (qgate_t))) == NULL ||
+      (new->name = strdup (name)) == NULL ||
+      (new->description = strdup (desc)) == NULL ||
+      (new->table = malloc (length * sizeof (uint32_t))) == NULL)
+  {
+    q_set_last_error ("memory exhausted");
+    goto fail;
+  }
+
+  new->order = order;
+  new->kind  = QGATE_KIND_ORACLE;
+
+  for (i = 0; i < length; ++i)
+    new->table[i] = table != NULL ? table[i] : i;
+
+  if (table != NULL)
+    for (i = 0; i < length; ++i)
+      if (table[i] >= length)
+      {
+        q_set_last_error ("oracle state %u out of range", table[i]);
+        goto fail;
+      }
+
+  if (table != NULL)
+    if (!qgate_init_sparse (new))
+      goto fail;
+
+  return new;
+
+fail:
+  if (new != NULL)
+    qgate_destroy (new);
+
+  return NULL;
+}
+
+QBOOL
+qgate_oracle_map (qgate_t *gate, uint32_t in, uint32_t out)
+{
+  if (gate->kind != QGATE_KIND_ORACLE)
+  {
+    q_set_last_error ("gate `%s' is not an oracle", gate->name);
+    return Q_FALSE;
+  }
+
+  if (gate->sparse != NULL || gate->serial != 0)
+  {
+    q_set_last_error ("oracle `%s' already initialized", gate->name);
+    return Q_FALSE;
+  }
+
+  if (in >= (1u << gate->order) || out >= (1u << gate->order))
+  {
+    q_set_last_error ("oracle state out of range (%u -> %u)", in, out);
+    return Q_FALSE;
+  }
+
+  gate->table[in] = out;
+
+  return Q_TRUE;
+}
+
 void
 qgate_debug (const qgate_t *gate)
 {
   unsigned int length, i, j;
   length = 1 << gate->order;
 
+  if (gate->coef == NULL)
+  {
+    printf ("(%s gate on %d qubits)\n",
+            gate->kind == QGATE_KIND_CONTROLLED ? "controlled" : "oracle",
+            gate->order);
+    return;
+  }
+
   for (j = 0; j < length; ++j)
   {
     for (i = 0; i < length; ++i)
@@ -227,6 +466,13 @@ qgate_set_coef (qgate_t *gate, const QCOMPLEX *coef)
   unsigned int length;
   length = 1 << (gate->order << 1);
 
+  if (gate->coef == NULL)
+  {
+    q_set_last_error ("gate `%s' has no coefficient matrix", gate->name);
+
+    return Q_FALSE;
+  }
+
   if (gate->sparse != NULL)
   {
     q_set_last_error ("cannot set gate coefficients twice");
@@ -234,67 +480,236 @@ qgate_set_coef (qgate_t *gate, const QCOMPLEX *coef)
     return Q_FALSE;
   }
 
-  memcpy (gate->coef, coef, length);
+  memcpy (gate->coef, coef, length * sizeof (QCOMPLEX));
 
   return qgate_init_sparse (gate);
 }
 
-static unsigned int *
-__remap_dup (const unsigned int *remap, unsigned int order)
+/* Gate of the given family (see qparam.h), bound to params */
+qgate_t *
+qgate_param_new (
+    const char *family,
+    const char *name,
+    const char *desc,
+    const double *params)
 {
-  unsigned int *dup;
-  unsigned int i;
+  const struct qgate_family *fam;
+  qgate_t *new;
 
-  if ((dup = malloc (order * sizeof (unsigned int))) == NULL)
+  if ((fam = qgate_family_lookup (family)) == NULL)
+  {
+    q_set_last_error ("unknown parametric gate family `%s'", family);
     return NULL;
+  }
 
-  for (i = 0; i < order; ++i)
-    dup[i] = remap[i];
-
-  return dup;
-}
-
-qwiring_t *
-qwiring_new (const qgate_t *gate, const unsigned int *remap)
-{
-  qwiring_t *new;
-
-  if ((new = malloc (sizeof (qgate_t))) == NULL)
+  if ((new = qgate_new (fam->order, name, desc, NULL)) == NULL)
+  {
+    q_set_last_error ("memory exhausted");
     return NULL;
+  }
 
-  new->prev = new->next = NULL;
+  new->family = fam;
 
-  new->gate  = gate;
+  memcpy (new->params, params, fam->params * sizeof (double));
 
-  new->__cached = NULL;
+  (fam->fill) (new->params, new->coef);
 
-  if (remap != NULL)
-  {
-    if ((new->remap = __remap_dup (remap, gate->order)) == NULL)
-    {
-      free (new);
-      return NULL;
-    }
-  }
-  else if ((new->remap = calloc (gate->order, sizeof (unsigned int))) == NULL)
+  if (!qgate_init_sparse (new))
   {
-    free (new);
+    qgate_destroy (new);
     return NULL;
   }
 
   return new;
 }
 
-void
+/* Recompute the coefficients of a parametric gate in place. Nonzeros of
+ * the sparse matrix are overwritten, so its storage is only touched if
+ * the pattern of zeros changes. Anything derived from the old values
+ * (expanded matrices, circuit operators) is identified by the serial,
+ * which is renewed. Circuits using the gate must be rebound or marked
+ * dirty (see qcircuit_bind). */
+QBOOL
+qgate_bind (qgate_t *gate, const double *params)
+{
+  unsigned int i, j, length;
+  QCOMPLEX value;
+
+  if (!qgate_is_parametric (gate))
+  {
+    q_set_last_error ("gate `%s' is not parametric", gate->name);
+    return Q_FALSE;
+  }
+
+  memcpy (gate->params, params, gate->family->params * sizeof (double));
+
+  (gate->family->fill) (gate->params, gate->coef);
+
+  length = 1 << gate->order;
+
+  for (j = 0; j < length; ++j)
+    for (i = 0; i < length; ++i)
+    {
+      value = gate->coef[i + length * j];
+
+      if (!QSPARSE_IS_ZERO (value) ||
+          !QSPARSE_IS_ZERO (qsparse_get (gate->sparse, j, i)))
+        if (!qsparse_set (gate->sparse, j, i, value))
+          return Q_FALSE;
+    }
+
+  if (gate->clifford != NULL)
+    qclifford_destroy (gate->clifford);
+
+  gate->clifford = qclifford_new (gate->sparse, gate->order);
+
+  gate->serial = __sync_add_and_fetch (&qgate_last_serial, 1);
+
+  return Q_TRUE;
+}
+
+static unsigned int *
+__remap_dup (const unsigned int *remap, unsigned int order)
+{
+  unsigned int *dup;
+  unsigned int i;
+
+  if ((dup = malloc (order * sizeof (unsigned int))) == NULL)
+    return NULL;
+
+  for (i = 0; i < order; ++i)
+    dup[i] = remap[i];
+
+  return dup;
+}
+
+qwiring_t *
+qwiring_new (const qgate_t *gate, const unsigned int *remap)
+{
+  qwiring_t *new;
+
+  if ((new = calloc (1, sizeof (qwiring_t))) == NULL)
+    return NULL;
+
+  new->gate   = gate;
+  new->dirty  = Q_TRUE;
+  new->serial = gate->serial;
+
+  if (remap != NULL)
+  {
+    if ((new->remap = __remap_dup (remap, gate->order)) == NULL)
+    {
+      free (new);
+      return NULL;
+    }
+  }
+  else if ((new->remap = calloc (gate->order, sizeof (unsigned int))) == NULL)
+  {
+    free (new);
+    return NULL;
+  }
+
+  return new;
+}
+
+void
 qwiring_destroy (qwiring_t *wiring)
 {
-  if (wiring->__cached != NULL)
-    qsparse_destroy (wiring->__cached);
+  if (wiring->product != NULL)
+    qsparse_destroy (wiring->product);
 
   free (wiring->remap);
   free (wiring);
 }
 
+/* Out-of-core state vectors. Each vector is a file, unlinked right
+ * after creation so that it goes away with the mapping, and mapped
+ * shared so that pages are written back instead of swapped. A new file
+ * reads as zeroes, like calloc. Simulation kernels walk these vectors
+ * in sequential passes (see qcircuit_simulate_blocked), which is what
+ * the readahead hint is for. */
+static QCOMPLEX *
+qcircuit_map_vector (const qcircuit_t *circuit, uint64_t length)
+{
+  char *path;
+  void *map = MAP_FAILED;
+  int fd = -1;
+
+  if ((path = malloc (strlen (circuit->storage) + sizeof ("/qcircuit-XXXXXX"))) == NULL)
+  {
+    q_set_last_error ("qcircuit_alloc_state: memory exhausted");
+    return NULL;
+  }
+
+  sprintf (path, "%s/qcircuit-XXXXXX", circuit->storage);
+
+  if ((fd = mkstemp (path)) == -1)
+  {
+    q_set_last_error (
+        "qcircuit_alloc_state: cannot create file in %s: %s",
+        circuit->storage,
+        strerror (errno));
+    goto done;
+  }
+
+  (void) unlink (path);
+
+  if (ftruncate (fd, length * sizeof (QCOMPLEX)) == -1)
+  {
+    q_set_last_error (
+        "qcircuit_alloc_state: cannot grow state file: %s",
+        strerror (errno));
+    goto done;
+  }
+
+  if ((map = mmap (
+      NULL,
+      length * sizeof (QCOMPLEX),
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED,
+      fd,
+      0)) == MAP_FAILED)
+  {
+    q_set_last_error (
+        "qcircuit_alloc_state: cannot map state file: %s",
+        strerror (errno));
+    goto done;
+  }
+
+  (void) madvise (map, length * sizeof (QCOMPLEX), MADV_SEQUENTIAL);
+
+done:
+  if (fd != -1)
+    close (fd);
+
+  free (path);
+
+  return map == MAP_FAILED ? NULL : (QCOMPLEX *) map;
+}
+
+static void
+qcircuit_free_vector (const qcircuit_t *circuit, QCOMPLEX *vector)
+{
+  if (vector == NULL)
+    return;
+
+  if (circuit->mapped)
+    munmap (vector, (1ull << circuit->order) * sizeof (QCOMPLEX));
+  else
+    free (vector);
+}
+
+/* Release the state vectors themselves */
+static void
+qcircuit_free_state (qcircuit_t *circuit)
+{
+  qcircuit_free_vector (circuit, circuit->state);
+
+  circuit->state     = NULL;
+  circuit->mapped    = Q_FALSE;
+  circuit->has_state = Q_FALSE;
+}
+
 void
 qcircuit_destroy (qcircuit_t *circuit)
 {
@@ -303,15 +718,19 @@ qcircuit_destroy (qcircuit_t *circuit)
   if (circuit->u != NULL)
     qsparse_destroy (circuit->u);
 
-  if (circuit->state != NULL)
-    free (circuit->state);
+  qcircuit_free_state (circuit);
 
-  if (circuit->collapsed != NULL)
-    free (circuit->collapsed);
+  qcircuit_discard_state (circuit);
 
   if (circuit->name != NULL)
     free (circuit->name);
 
+  if (circuit->storage != NULL)
+    free (circuit->storage);
+
+  if (circuit->layout != NULL)
+    free (circuit->layout);
+
   this = circuit->wiring_head;
 
   while (this != NULL)
@@ -330,7 +749,6 @@ qcircuit_t *
 qcircuit_new (unsigned int order, const char *name)
 {
   qcircuit_t *new;
-  unsigned int length;
 
   if ((new = calloc (1, sizeof (qcircuit_t))) == NULL)
     return NULL;
@@ -338,222 +756,1038 @@ qcircuit_new (unsigned int order, const char *name)
   if ((new->name = strdup (name)) == NULL)
     goto fail;
 
-  new->updated = Q_FALSE;
-  new->order   = order;
+  new->updated   = Q_FALSE;
+  new->order     = order;
+  new->tree_seed = 0x9e3779b9;
+
+  return new;
+
+fail:
+  qcircuit_destroy (new);
+
+  return NULL;
+}
+
+void
+qcircuit_set_expcache (qcircuit_t *circuit, struct qexpcache *cache)
+{
+  circuit->expcache = cache;
+}
+
+/* Drop the tableau or MPS state, if any. The state vector (if already
+ * allocated) is kept for later use. */
+void
+qcircuit_discard_state (qcircuit_t *circuit)
+{
+  if (circuit->tableau != NULL)
+    qstab_destroy (circuit->tableau);
+
+  if (circuit->collapsed_tableau != NULL)
+    qstab_destroy (circuit->collapsed_tableau);
+
+  if (circuit->mps != NULL)
+    qmps_destroy (circuit->mps);
+
+  if (circuit->collapsed_mps != NULL)
+    qmps_destroy (circuit->collapsed_mps);
+
+  circuit->tableau           = NULL;
+  circuit->collapsed_tableau = NULL;
+  circuit->mps               = NULL;
+  circuit->collapsed_mps     = NULL;
+  circuit->has_state         = Q_FALSE;
+}
+
+/* Keep state vectors in files under dir (which must exist), or in
+ * memory again if dir is NULL. This allows state vectors of up to
+ * QCIRCUIT_MAPPED_ORDER_MAX qubits, at the cost of disk I/O. Any
+ * computed state is discarded. */
+QBOOL
+qcircuit_set_storage (qcircuit_t *circuit, const char *dir)
+{
+  char *dup = NULL;
+
+  if (dir != NULL)
+    if ((dup = strdup (dir)) == NULL)
+    {
+      q_set_last_error ("qcircuit_set_storage: memory exhausted");
+      return Q_FALSE;
+    }
+
+  qcircuit_free_state (circuit);
+  qcircuit_discard_state (circuit);
+
+  if (circuit->storage != NULL)
+    free (circuit->storage);
+
+  circuit->storage = dup;
+
+  return Q_TRUE;
+}
+
+/* Get the state vector ready for a new state. Vectors are allocated
+ * the first time they are needed, so that big circuits that never use
+ * them (see qcircuit_simulate_tableau) can still be built. Any tableau
+ * or MPS state is discarded.
+ */
+QBOOL
+qcircuit_alloc_state (qcircuit_t *circuit)
+{
+  uint64_t length;
+
+  if (circuit->tableau != NULL || circuit->mps != NULL)
+    qcircuit_discard_state (circuit);
+
+  if (circuit->state != NULL)
+    return Q_TRUE;
+
+  if (circuit->order > qcircuit_state_order_max (circuit))
+  {
+    q_set_last_error (
+        "circuit `%s' too big for a state vector (%d qubits)",
+        circuit->name,
+        circuit->order);
+
+    return Q_FALSE;
+  }
+
+  length = 1ull << circuit->order;
+
+  if (circuit->storage != NULL)
+  {
+    circuit->mapped = Q_TRUE;
+
+    if ((circuit->state = qcircuit_map_vector (circuit, length)) == NULL)
+      goto fail;
+
+    return Q_TRUE;
+  }
+
+  if ((circuit->state = calloc (length, sizeof (QCOMPLEX))) == NULL)
+    goto nomem;
+
+  return Q_TRUE;
+
+nomem:
+  q_set_last_error ("qcircuit_alloc_state: memory exhausted");
+
+fail:
+  qcircuit_free_state (circuit);
+
+  return Q_FALSE;
+}
+
+QBOOL
+qcircuit_measure_reset (qcircuit_t *circuit)
+{
+  circuit->collapsed_mask  = 0;
+  circuit->measure_result = 0;
+
+  if (circuit->tableau != NULL)
+    qstab_copy (circuit->collapsed_tableau, circuit->tableau);
+  else if (circuit->mps != NULL)
+    return qmps_copy (circuit->collapsed_mps, circuit->mps);
+  else
+    circuit->collapsed_norm = 1;
+
+  return Q_TRUE;
+}
+
+static QBOOL
+qcircuit_check_wiring (const qcircuit_t *circuit, const qwiring_t *wiring)
+{
+  unsigned int i;
+
+  for (i = 0; i < wiring->gate->order; ++i)
+    if (wiring->remap[i] >= circuit->order)
+      return Q_FALSE;
+
+  return Q_TRUE;
+}
+
+/* Treap priorities come from a private xorshift generator, so building
+ * circuits never disturbs the rand () sequence used by measurements.
+ */
+static uint32_t
+qcircuit_next_priority (qcircuit_t *circuit)
+{
+  uint32_t x = circuit->tree_seed;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+
+  return circuit->tree_seed = x;
+}
+
+/* Products of a node and all its ancestors must be recomputed */
+void
+qwiring_mark_dirty (qwiring_t *wiring)
+{
+  while (wiring != NULL)
+  {
+    wiring->dirty = Q_TRUE;
+    wiring = wiring->parent;
+  }
+}
+
+static void
+qcircuit_tree_replace_child (qcircuit_t *circuit, qwiring_t *parent, qwiring_t *old, qwiring_t *new)
+{
+  if (parent == NULL)
+    circuit->tree_root = new;
+  else if (parent->left == old)
+    parent->left = new;
+  else
+    parent->right = new;
+
+  if (new != NULL)
+    new->parent = parent;
+}
+
+/* Move node one level up, keeping the in-order sequence */
+static void
+qcircuit_tree_rotate_up (qcircuit_t *circuit, qwiring_t *node)
+{
+  qwiring_t *parent = node->parent;
+
+  qcircuit_tree_replace_child (circuit, parent->parent, parent, node);
+
+  if (parent->left == node)
+  {
+    parent->left = node->right;
+
+    if (node->right != NULL)
+      node->right->parent = parent;
+
+    node->right = parent;
+  }
+  else
+  {
+    parent->right = node->left;
+
+    if (node->left != NULL)
+      node->left->parent = parent;
+
+    node->left = parent;
+  }
+
+  parent->parent = node;
+
+  /* Both subtrees changed */
+  parent->dirty = Q_TRUE;
+  node->dirty   = Q_TRUE;
+}
+
+static void
+qcircuit_tree_insert (qcircuit_t *circuit, qwiring_t *after, qwiring_t *wiring)
+{
+  wiring->left = wiring->right = NULL;
+  wiring->priority = qcircuit_next_priority (circuit);
+
+  /* Attach as a leaf right after `after' in the in-order sequence */
+  if (circuit->tree_root == NULL)
+  {
+    circuit->tree_root = wiring;
+    wiring->parent = NULL;
+  }
+  else if (after == NULL)
+  {
+    circuit->wiring_head->left = wiring;
+    wiring->parent = circuit->wiring_head;
+  }
+  else if (after->right == NULL)
+  {
+    after->right = wiring;
+    wiring->parent = after;
+  }
+  else
+  {
+    /* after->next is the leftmost node of after->right */
+    after->next->left = wiring;
+    wiring->parent = after->next;
+  }
+
+  qwiring_mark_dirty (wiring);
+
+  while (wiring->parent != NULL && wiring->priority > wiring->parent->priority)
+    qcircuit_tree_rotate_up (circuit, wiring);
+}
+
+static void
+qcircuit_tree_remove (qcircuit_t *circuit, qwiring_t *wiring)
+{
+  qwiring_t *child;
+
+  qwiring_mark_dirty (wiring);
+
+  /* Sink the node until it becomes a leaf */
+  while (wiring->left != NULL || wiring->right != NULL)
+  {
+    if (wiring->left == NULL)
+      child = wiring->right;
+    else if (wiring->right == NULL)
+      child = wiring->left;
+    else
+      child = wiring->left->priority > wiring->right->priority ?
+          wiring->left : wiring->right;
+
+    qcircuit_tree_rotate_up (circuit, child);
+  }
+
+  qcircuit_tree_replace_child (circuit, wiring->parent, wiring, NULL);
+
+  wiring->parent = NULL;
+
+  if (wiring->product != NULL)
+  {
+    qsparse_destroy (wiring->product);
+    wiring->product = NULL;
+  }
+
+  wiring->dirty = Q_TRUE;
+}
+
+/* Insert wiring right after `after'. If after is NULL, the wiring is
+ * prepended.
+ */
+QBOOL
+qcircuit_insert_wiring (qcircuit_t *circuit, qwiring_t *after, qwiring_t *wiring)
+{
+  if (!qcircuit_check_wiring (circuit, wiring))
+  {
+    q_set_last_error ("qcircuit_insert_wiring: bad remap");
+    return Q_FALSE;
+  }
+
+  qcircuit_tree_insert (circuit, after, wiring);
+
+  if (after == NULL)
+  {
+    wiring->prev = NULL;
+    wiring->next = circuit->wiring_head;
+  }
+  else
+  {
+    wiring->prev = after;
+    wiring->next = after->next;
+  }
+
+  if (wiring->prev != NULL)
+    wiring->prev->next = wiring;
+  else
+    circuit->wiring_head = wiring;
+
+  if (wiring->next != NULL)
+    wiring->next->prev = wiring;
+  else
+    circuit->wiring_tail = wiring;
+
+  circuit->updated = Q_FALSE;
+
+  return Q_TRUE;
+}
+
+QBOOL
+qcircuit_append_wiring (qcircuit_t *circuit, qwiring_t *wiring)
+{
+  return qcircuit_insert_wiring (circuit, circuit->wiring_tail, wiring);
+}
+
+QBOOL
+qcircuit_prepend_wiring (qcircuit_t *circuit, qwiring_t *wiring)
+{
+  return qcircuit_insert_wiring (circuit, NULL, wiring);
+}
+
+/* Detaches wiring from the circuit. The caller must destroy it. */
+void
+qcircuit_remove_wiring (qcircuit_t *circuit, qwiring_t *wiring)
+{
+  qcircuit_tree_remove (circuit, wiring);
+
+  if (wiring->prev != NULL)
+    wiring->prev->next = wiring->next;
+  else
+    circuit->wiring_head = wiring->next;
+
+  if (wiring->next != NULL)
+    wiring->next->prev = wiring->prev;
+  else
+    circuit->wiring_tail = wiring->prev;
+
+  wiring->prev = wiring->next = NULL;
+
+  circuit->updated = Q_FALSE;
+}
+
+/* Puts new in the place of old, which is detached and must be destroyed
+ * by the caller.
+ */
+QBOOL
+qcircuit_replace_wiring (qcircuit_t *circuit, qwiring_t *old, qwiring_t *new)
+{
+  if (!qcircuit_check_wiring (circuit, new))
+  {
+    q_set_last_error ("qcircuit_replace_wiring: bad remap");
+    return Q_FALSE;
+  }
+
+  /* Tree */
+  new->left     = old->left;
+  new->right    = old->right;
+  new->priority = old->priority;
+
+  if (new->left != NULL)
+    new->left->parent = new;
+
+  if (new->right != NULL)
+    new->right->parent = new;
+
+  qcircuit_tree_replace_child (circuit, old->parent, old, new);
+
+  qwiring_mark_dirty (new);
+
+  /* List */
+  new->prev = old->prev;
+  new->next = old->next;
+
+  if (new->prev != NULL)
+    new->prev->next = new;
+  else
+    circuit->wiring_head = new;
+
+  if (new->next != NULL)
+    new->next->prev = new;
+  else
+    circuit->wiring_tail = new;
+
+  old->parent = old->left = old->right = NULL;
+  old->prev   = old->next = NULL;
+
+  if (old->product != NULL)
+  {
+    qsparse_destroy (old->product);
+    old->product = NULL;
+  }
+
+  old->dirty = Q_TRUE;
+
+  circuit->updated = Q_FALSE;
+
+  return Q_TRUE;
+}
+
+/* Remap is given in logical qubits */
+QBOOL
+qcircuit_wire (qcircuit_t *circuit, const qgate_t *gate, const unsigned int *remap)
+{
+  qwiring_t *wiring = NULL;
+  unsigned int physical[64];
+  unsigned int i;
+
+  if (circuit->layout != NULL && gate->order <= 64)
+  {
+    for (i = 0; i < gate->order; ++i)
+      physical[i] = remap[i] < circuit->order ?
+          circuit->layout[remap[i]] : remap[i];
+
+    remap = physical;
+  }
+
+  if ((wiring = qwiring_new (gate, remap)) == NULL)
+    goto fail;
+
+  if (!qcircuit_append_wiring (circuit, wiring))
+    goto fail;
+
+  return Q_TRUE;
+
+fail:
+  if (wiring != NULL)
+    qwiring_destroy (wiring);
+
+  return Q_FALSE;
+}
+
+/* Translate a set of logical qubits (or a basis state) to physical */
+uint64_t
+qcircuit_to_physical (const qcircuit_t *circuit, uint64_t bits)
+{
+  uint64_t result = 0;
+  unsigned int i;
+
+  if (circuit->layout == NULL)
+    return bits;
+
+  for (i = 0; i < circuit->order; ++i)
+    if (bits & (1ull << i))
+      result |= 1ull << circuit->layout[i];
+
+  return result;
+}
+
+uint64_t
+qcircuit_to_logical (const qcircuit_t *circuit, uint64_t bits)
+{
+  uint64_t result = 0;
+  unsigned int i;
+
+  if (circuit->layout == NULL)
+    return bits;
+
+  for (i = 0; i < circuit->order; ++i)
+    if (bits & (1ull << circuit->layout[i]))
+      result |= 1ull << i;
+
+  return result;
+}
+
+/* Reorder a state given in logical qubits to physical qubits */
+void
+qcircuit_import_state (const qcircuit_t *circuit, const QCOMPLEX *psi, QCOMPLEX *state)
+{
+  uint64_t i, length;
+
+  length = 1ull << circuit->order;
+
+  if (circuit->layout == NULL)
+    memcpy (state, psi, length * sizeof (QCOMPLEX));
+  else
+    for (i = 0; i < length; ++i)
+      state[qcircuit_to_physical (circuit, i)] = psi[i];
+}
+
+/* Move physical qubit i to perm[i]. Wirings are rewritten and the
+ * layout is updated, so nothing changes from the user point of view.
+ * Any computed state is discarded.
+ */
+QBOOL
+qcircuit_permute_qubits (qcircuit_t *circuit, const unsigned int *perm)
+{
+  qwiring_t *this;
+  uint64_t used = 0;
+  unsigned int i;
+
+  if (circuit->order > 64)
+  {
+    q_set_last_error ("qcircuit_permute_qubits: circuit too big");
+    return Q_FALSE;
+  }
+
+  for (i = 0; i < circuit->order; ++i)
+  {
+    if (perm[i] >= circuit->order || (used & (1ull << perm[i])))
+    {
+      q_set_last_error ("qcircuit_permute_qubits: not a permutation");
+      return Q_FALSE;
+    }
+
+    used |= 1ull << perm[i];
+  }
+
+  if (circuit->layout == NULL)
+  {
+    if ((circuit->layout = malloc (circuit->order * sizeof (unsigned int))) == NULL)
+    {
+      q_set_last_error ("qcircuit_permute_qubits: memory exhausted");
+      return Q_FALSE;
+    }
+
+    for (i = 0; i < circuit->order; ++i)
+      circuit->layout[i] = i;
+  }
+
+  for (i = 0; i < circuit->order; ++i)
+    circuit->layout[i] = perm[circuit->layout[i]];
+
+  for (this = circuit->wiring_head; this != NULL; this = this->next)
+  {
+    for (i = 0; i < this->gate->order; ++i)
+      this->remap[i] = perm[this->remap[i]];
+
+    qwiring_mark_dirty (this);
+  }
+
+  circuit->updated   = Q_FALSE;
+  circuit->has_state = Q_FALSE;
+
+  return Q_TRUE;
+}
+
+/* Expanded wirings come from the shared expansion cache when the circuit
+ * has one. Otherwise they are computed on the fly and *entry is left
+ * to NULL, meaning the caller owns the returned matrix.
+ */
+static const qsparse_t *
+qwiring_acquire_sparse (
+    const qcircuit_t *circuit,
+    const qwiring_t *wiring,
+    struct qexpcache_entry **entry)
+{
+  *entry = NULL;
+
+  if (circuit->expcache != NULL)
+    return qexpcache_acquire (
+        circuit->expcache,
+        wiring->gate,
+        circuit->order,
+        wiring->remap,
+        entry);
+
+  return qgate_expand (wiring->gate, circuit->order, wiring->remap);
+}
+
+static void
+qwiring_release_sparse (
+    const qcircuit_t *circuit,
+    const qsparse_t *sparse,
+    struct qexpcache_entry *entry)
+{
+  if (entry != NULL)
+    qexpcache_release (circuit->expcache, entry);
+  else
+    qsparse_destroy ((qsparse_t *) sparse);
+}
+
+/* Partial products are recomputed bottom-up, one tree level at a time.
+ * Nodes of the same level are independent and are distributed among
+ * threads. When a level has too few nodes to keep the threads busy,
+ * its products are computed one after another, splitting each of them
+ * by rows instead.
+ */
+struct qwiring_job
+{
+  qwiring_t *node;
+  const qsparse_t *expanded;
+  struct qexpcache_entry *entry;
+  unsigned int height;
+};
+
+struct qcircuit_refresh
+{
+  const qcircuit_t *circuit;
+  struct qwiring_job *jobs;
+  unsigned int count;
+  unsigned int alloc;
+  QBOOL parallel_mul;
+};
+
+static QBOOL
+qwiring_is_dirty (const qwiring_t *wiring)
+{
+  return wiring->dirty || wiring->product == NULL;
+}
+
+/* Expanded matrices are acquired here, as the cache cannot be accessed
+ * from several threads. Returns the height of the node in the tree
+ * of dirty nodes, 0 on failure.
+ */
+static unsigned int
+qcircuit_refresh_collect (struct qcircuit_refresh *refresh, qwiring_t *node)
+{
+  struct qwiring_job *tmp;
+  unsigned int height = 0, child;
+
+  if (node->left != NULL && qwiring_is_dirty (node->left))
+  {
+    if ((height = qcircuit_refresh_collect (refresh, node->left)) == 0)
+      return 0;
+  }
+
+  if (node->right != NULL && qwiring_is_dirty (node->right))
+  {
+    if ((child = qcircuit_refresh_collect (refresh, node->right)) == 0)
+      return 0;
+
+    if (child > height)
+      height = child;
+  }
+
+  if (refresh->count == refresh->alloc)
+  {
+    refresh->alloc = refresh->alloc == 0 ? 16 : refresh->alloc << 1;
+
+    if ((tmp = realloc (
+        refresh->jobs,
+        refresh->alloc * sizeof (struct qwiring_job))) == NULL)
+    {
+      q_set_last_error ("qcircuit_update: memory exhausted while planning update");
+      return 0;
+    }
 
-  length = 1 << order;
+    refresh->jobs = tmp;
+  }
 
-  if ((new->state = calloc (length, sizeof (QCOMPLEX))) == NULL)
-    goto fail;
+  tmp = &refresh->jobs[refresh->count];
 
-  if ((new->collapsed = calloc (length, sizeof (QCOMPLEX))) == NULL)
-      goto fail;
+  if ((tmp->expanded = qwiring_acquire_sparse (
+      refresh->circuit,
+      node,
+      &tmp->entry)) == NULL)
+    return 0;
 
-  return new;
+  tmp->node   = node;
+  tmp->height = height + 1;
 
-fail:
-  qcircuit_destroy (new);
+  ++refresh->count;
 
-  return NULL;
+  return tmp->height;
 }
 
-void
-qcircuit_measure_reset (qcircuit_t *circuit)
+static int
+qwiring_job_cmp (const void *a, const void *b)
 {
-  circuit->collapsed_mask  = 0;
-  circuit->measure_result = 0;
+  const struct qwiring_job *ja = (const struct qwiring_job *) a;
+  const struct qwiring_job *jb = (const struct qwiring_job *) b;
 
-  memcpy (circuit->collapsed, circuit->state, (1 << circuit->order) * sizeof (QCOMPLEX));
+  return (int) ja->height - (int) jb->height;
 }
 
+/* Later gates multiply leftwards: right * this * left */
 static QBOOL
-qcircuit_check_wiring (const qcircuit_t *circuit, const qwiring_t *wiring)
+qwiring_job_run (unsigned int index, void *priv)
 {
-  unsigned int i;
+  struct qcircuit_refresh *refresh = (struct qcircuit_refresh *) priv;
+  struct qwiring_job *job = &refresh->jobs[index];
+  qsparse_t *(*mul) (const qsparse_t *, const qsparse_t *);
+  const qsparse_t *left = NULL, *right = NULL;
+  qsparse_t *product, *tmp = NULL;
 
-  for (i = 0; i < wiring->gate->order; ++i)
-    if (wiring->remap[i] >= circuit->order)
-      return Q_FALSE;
+  mul = refresh->parallel_mul ? qsparse_mul_parallel : qsparse_mul;
 
-  return Q_TRUE;
-}
+  if (job->node->left != NULL)
+    left = job->node->left->product;
 
-QBOOL
-qcircuit_append_wiring (qcircuit_t *circuit, qwiring_t *wiring)
-{
-  if (!qcircuit_check_wiring (circuit, wiring))
-  {
-    q_set_last_error ("qcircuit_append_wiring: bad remap");
-    return Q_FALSE;
-  }
+  if (job->node->right != NULL)
+    right = job->node->right->product;
 
-  if (circuit->wiring_head == NULL)
+  if (left != NULL && right != NULL)
   {
-    circuit->wiring_head = circuit->wiring_tail = wiring;
-    wiring->next = wiring->prev = NULL;
+    if (qsparse_mul3_left_first (right, job->expanded, left))
+    {
+      if ((tmp = (mul) (right, job->expanded)) == NULL)
+        return Q_FALSE;
+
+      product = (mul) (tmp, left);
+    }
+    else
+    {
+      if ((tmp = (mul) (job->expanded, left)) == NULL)
+        return Q_FALSE;
+
+      product = (mul) (right, tmp);
+    }
+
+    qsparse_destroy (tmp);
   }
+  else if (left != NULL)
+    product = (mul) (job->expanded, left);
+  else if (right != NULL)
+    product = (mul) (right, job->expanded);
   else
-  {
-    wiring->prev = circuit->wiring_tail;
-    wiring->next = NULL;
+    product = qsparse_copy (job->expanded);
 
-    circuit->wiring_tail->next = wiring;
-    circuit->wiring_tail = wiring;
-  }
+  if (product == NULL)
+    return Q_FALSE;
+
+  if (job->node->product != NULL)
+    qsparse_destroy (job->node->product);
+
+  job->node->product = product;
+  job->node->dirty   = Q_FALSE;
 
   return Q_TRUE;
 }
 
-QBOOL
-qcircuit_prepend_wiring (qcircuit_t *circuit, qwiring_t *wiring)
+/* Recompute the products of all dirty nodes below (and including) node */
+static QBOOL
+qwiring_refresh (const qcircuit_t *circuit, qwiring_t *node)
 {
-  if (!qcircuit_check_wiring (circuit, wiring))
-  {
-    q_set_last_error ("qcircuit_prepend_wiring: bad remap");
-    return Q_FALSE;
-  }
+  struct qcircuit_refresh refresh, level;
+  unsigned int i, first, threads;
+  QBOOL ok = Q_TRUE;
+
+  if (!qwiring_is_dirty (node))
+    return Q_TRUE;
+
+  memset (&refresh, 0, sizeof (struct qcircuit_refresh));
 
-  if (circuit->wiring_head == NULL)
+  refresh.circuit = circuit;
+
+  if (qcircuit_refresh_collect (&refresh, node) == 0)
   {
-    circuit->wiring_head = circuit->wiring_tail = wiring;
-    wiring->next = wiring->prev = NULL;
+    ok = Q_FALSE;
+    goto done;
   }
-  else
+
+  qsort (refresh.jobs, refresh.count, sizeof (struct qwiring_job), qwiring_job_cmp);
+
+  threads = q_get_thread_count ();
+
+  for (first = 0; ok && first < refresh.count; first = i)
   {
-    wiring->next = circuit->wiring_head;
-    wiring->prev = NULL;
+    for (i = first; i < refresh.count; ++i)
+      if (refresh.jobs[i].height != refresh.jobs[first].height)
+        break;
 
-    circuit->wiring_head->prev = wiring;
-    circuit->wiring_head = wiring;
+    if (threads > 1 && 2 * (i - first) >= threads)
+    {
+      /* q_parallel_for works with indices starting from zero */
+      level = refresh;
+
+      level.jobs += first;
+      level.count = i - first;
+
+      ok = q_parallel_for (level.count, qwiring_job_run, &level);
+    }
+    else
+    {
+      refresh.parallel_mul = threads > 1 &&
+          circuit->order >= QCIRCUIT_PARALLEL_MUL_ORDER_MIN;
+
+      for (; ok && first < i; ++first)
+        ok = qwiring_job_run (first, &refresh);
+    }
   }
 
-  return Q_TRUE;
+done:
+  for (i = 0; i < refresh.count; ++i)
+    qwiring_release_sparse (
+        circuit,
+        refresh.jobs[i].expanded,
+        refresh.jobs[i].entry);
+
+  if (refresh.jobs != NULL)
+    free (refresh.jobs);
+
+  return ok;
 }
 
+/* Nothing is done if the circuit has not changed since the last update.
+ * Otherwise, only the partial products on the paths from the edited
+ * wirings to the root of the tree are recomputed.
+ */
 QBOOL
-qcircuit_wire (qcircuit_t *circuit, const qgate_t *gate, const unsigned int *remap)
+qcircuit_update (qcircuit_t *circuit)
 {
-  qwiring_t *wiring = NULL;
+  qwiring_t *root;
+  qsparse_t *u;
 
-  if ((wiring = qwiring_new (gate, remap)) == NULL)
-    goto fail;
+  qcircuit_check_params (circuit);
 
-  if (!qcircuit_append_wiring (circuit, wiring))
-    goto fail;
+  if (circuit->updated && circuit->u != NULL)
+    return Q_TRUE;
 
-  return Q_TRUE;
+  if ((root = circuit->tree_root) == NULL)
+  {
+    if ((u = qsparse_eye_new (circuit->order)) == NULL)
+      return Q_FALSE;
+  }
+  else
+  {
+    if (!qwiring_refresh (circuit, root))
+      return Q_FALSE;
 
-fail:
-  if (wiring != NULL)
-    qwiring_destroy (wiring);
+    /* The root product is handed over to the circuit. Any later edit
+     * marks the root dirty, so it will never be needed again. */
+    u = root->product;
 
-  return Q_FALSE;
-}
+    root->product = NULL;
+    root->dirty   = Q_TRUE;
+  }
 
-static QBOOL
-qwiring_assert_sparse (qcircuit_t *circuit, qwiring_t *wiring)
-{
-  if (wiring->gate->sparse == NULL)
-  {
-    q_set_last_error ("cannot assert sparse matrix on uninitialized gate");
+  if (circuit->u != NULL)
+    qsparse_destroy (circuit->u);
 
-    return Q_FALSE;
-  }
+  circuit->u = u;
 
-  if (wiring->__cached == NULL)
-    if ((wiring->__cached = qsparse_expand (wiring->gate->sparse, circuit->order, wiring->remap)) == NULL)
-      return Q_FALSE;
+  circuit->updated = Q_TRUE;
 
   return Q_TRUE;
 }
 
-QBOOL
-qcircuit_update (qcircuit_t *circuit)
+/* U^k (on the same qubits as U), by repeated squaring of the updated
+ * operator: at most 2 log2 k products instead of k copies of the
+ * wirings. The result belongs to the caller. */
+qsparse_t *
+qcircuit_power (qcircuit_t *circuit, uint64_t k)
 {
-  qwiring_t *this;
-  qsparse_t *u = NULL, *result = NULL;
+  qsparse_t *result = NULL, *base = NULL, *tmp;
 
-  if (circuit->u != NULL)
+  if (circuit->order > QSPARSE_ORDER_MAX)
   {
-    qsparse_destroy (circuit->u);
-    circuit->u = NULL;
-    circuit->updated = Q_FALSE;
+    q_set_last_error (
+        "qcircuit_power: circuit `%s' too big for an operator",
+        circuit->name);
+    return NULL;
   }
 
-  if ((u = qsparse_eye_new (circuit->order)) == NULL)
-    goto fail;
+  if (!qcircuit_update (circuit))
+    return NULL;
 
-  this = qcircuit_get_wiring_head (circuit);
+  if (k == 0)
+    return qsparse_eye_new (circuit->order);
 
-  while (this != NULL)
-  {
-    if (!qwiring_assert_sparse (circuit, this))
-      goto fail;
+  if ((base = qsparse_copy (circuit->u)) == NULL)
+    goto fail;
 
-    /* Applying a new gate is equivalent to multiply the gate
-     * operator leftwards.
-     */
-    if ((result = qsparse_mul (this->__cached, u)) == NULL)
-      goto fail;
+  for (;;)
+  {
+    if (k & 1)
+    {
+      if (result == NULL)
+      {
+        if ((result = qsparse_copy (base)) == NULL)
+          goto fail;
+      }
+      else
+      {
+        if ((tmp = qsparse_mul (result, base)) == NULL)
+          goto fail;
+
+        qsparse_destroy (result);
+        result = tmp;
+      }
+    }
 
-    qsparse_destroy (u);
+    if ((k >>= 1) == 0)
+      break;
 
-    u = result;
+    if ((tmp = qsparse_mul (base, base)) == NULL)
+      goto fail;
 
-    this = qwiring_next (this);
+    qsparse_destroy (base);
+    base = tmp;
   }
 
-  circuit->u = u;
-
-  circuit->updated = Q_TRUE;
+  qsparse_destroy (base);
 
-  return Q_TRUE;
+  return result;
 
 fail:
-  if (u != NULL)
-    qsparse_destroy (u);
+  q_set_last_error ("qcircuit_power: memory exhausted");
+
+  if (base != NULL)
+    qsparse_destroy (base);
 
   if (result != NULL)
     qsparse_destroy (result);
 
-  return Q_FALSE;
+  return NULL;
 }
 
 QBOOL
 qcircuit_apply_state (qcircuit_t *circuit, const QCOMPLEX *psi)
 {
+  QCOMPLEX *in = NULL;
+
+  qcircuit_check_params (circuit);
+
   if (!circuit->updated)
   {
     q_set_last_error ("qcircuit_apply_state: circuit operator not updated");
     return Q_FALSE;
   }
 
-  qsparse_mul_vec (circuit->u, psi, circuit->state);
+  if (!qcircuit_alloc_state (circuit))
+    return Q_FALSE;
+
+  /* U works on physical qubits */
+  if (circuit->layout != NULL)
+  {
+    if ((in = malloc ((1ull << circuit->order) * sizeof (QCOMPLEX))) == NULL)
+    {
+      q_set_last_error ("qcircuit_apply_state: memory exhausted");
+      return Q_FALSE;
+    }
+
+    qcircuit_import_state (circuit, psi, in);
+  }
+
+  qsparse_mul_vec (circuit->u, in != NULL ? in : psi, circuit->state);
   qcircuit_measure_reset (circuit);
 
+  if (in != NULL)
+    free (in);
+
+  circuit->has_state = Q_TRUE;
+
+  return Q_TRUE;
+}
+
+static QBOOL
+qcircuit_get_compact_state (const qcircuit_t *circuit, QCOMPLEX *psi)
+{
+  QBOOL ok;
+  QCOMPLEX *state;
+  uint64_t i, length;
+
+  if (circuit->order > QCIRCUIT_STATE_ORDER_MAX)
+  {
+    q_set_last_error (
+        "qcircuit_get_state: circuit `%s' too big for a state vector",
+        circuit->name);
+    return Q_FALSE;
+  }
+
+  length = 1ull << circuit->order;
+
+  if ((state = malloc (length * sizeof (QCOMPLEX))) == NULL)
+  {
+    q_set_last_error ("qcircuit_get_state: memory exhausted");
+    return Q_FALSE;
+  }
+
+  if (circuit->tableau != NULL)
+    ok = qstab_get_state (circuit->collapsed_tableau, state);
+  else
+    ok = qmps_get_state (circuit->collapsed_mps, state);
+
+  if (!ok)
+  {
+    free (state);
+    return Q_FALSE;
+  }
+
+  /* MPS sites already follow the logical qubits */
+  for (i = 0; i < length; ++i)
+    psi[i] = circuit->tableau != NULL ? state[qcircuit_to_physical (circuit, i)] : state[i];
+
+  free (state);
+
   return Q_TRUE;
 }
 
 QBOOL
 qcircuit_get_state (const qcircuit_t *circuit, QCOMPLEX *psi)
 {
-  unsigned int i;
-  unsigned int length;
+  uint64_t p;
+  uint64_t i;
+  uint64_t length;
 
-  if (!circuit->updated)
+  if (!circuit->has_state)
   {
-    q_set_last_error ("qcircuit_apply_state: circuit operator not updated");
+    q_set_last_error ("qcircuit_get_state: no state has been computed");
     return Q_FALSE;
   }
 
-  length = 1 << circuit->order;
+  /* Measured qubits are already collapsed in the tableau or MPS */
+  if (circuit->tableau != NULL || circuit->mps != NULL)
+    return qcircuit_get_compact_state (circuit, psi);
+
+  length = 1ull << circuit->order;
 
   for (i = 0; i < length; ++i)
+  {
+    p = qcircuit_to_physical (circuit, i);
+
     if (!circuit->collapsed_mask ||
-        (circuit->collapsed_mask & i) == circuit->measure_result)
-      psi[i] = circuit->collapsed[i];
+        (circuit->collapsed_mask & p) == circuit->measure_result)
+      psi[i] = circuit->state[p] * circuit->collapsed_norm;
     else
       psi[i] = 0.0;
+  }
 
   return Q_TRUE;
 }
@@ -561,80 +1795,74 @@ qcircuit_get_state (const qcircuit_t *circuit, QCOMPLEX *psi)
 uint64_t
 qcircuit_get_measure_bits (const qcircuit_t *circuit)
 {
-  return circuit->measure_result;
-}
-
-static int
-qstate_info_compare (const void *a, const void *b)
-{
-  const struct qstate_info *qa, *qb;
-
-  qa = (const struct qstate_info *) a;
-  qb = (const struct qstate_info *) b;
-
-  if (qa->d < qb->d)
-    return -1;
-  else if (qa->d > qb->d)
-    return 1;
-
-  return 0;
+  return qcircuit_to_logical (circuit, circuit->measure_result);
 }
 
 void
 qcircuit_debug_state (const qcircuit_t *circuit)
 {
-  unsigned int i;
-  unsigned int length;
+  uint64_t p;
+  uint64_t i;
+  uint64_t length;
 
-  length = 1 << circuit->order;
+  length = 1ull << circuit->order;
 
   printf ("SYSTEM SUMMARY:\n");
   printf ("---------------------------\n");
   printf ("  Collapsed mask: 0x%x\n", circuit->collapsed_mask);
   printf ("  Measure result: 0x%x\n", circuit->measure_result);
-  printf ("  State vector:\n");
 
-  for (i = 0; i < length; ++i)
-    if (!circuit->collapsed_mask ||
-        (circuit->collapsed_mask & i) == circuit->measure_result)
-      printf ("    <%d|psi> = %lg + %lgi\n",
-              i,
-              creal (circuit->collapsed[i]),
-              cimag (circuit->collapsed[i]));
+  if (circuit->tableau != NULL)
+  {
+    printf ("  Stabilizers (physical qubits):\n");
+    qstab_debug (circuit->collapsed_tableau);
+    printf ("---------------------------\n");
 
-  printf ("---------------------------\n");
+    return;
+  }
 
-}
+  if (circuit->mps != NULL)
+  {
+    printf ("  Matrix product state:\n");
+    printf ("    Largest bond: %d\n", qmps_get_bond_max (circuit->collapsed_mps));
+    printf ("    Truncation error: %lg\n", circuit->collapsed_mps->error);
+    printf ("---------------------------\n");
 
-QBOOL
-qcircuit_collapse (qcircuit_t *circuit, uint64_t mask, unsigned int *measure)
-{
-  unsigned int i, j, k;
-  unsigned int qubits;
-  unsigned int length;
+    return;
+  }
 
-  /* Measure order and length */
-  unsigned int m_order;
-  unsigned int m_length;
-  uint8_t m_indices[64];
+  printf ("  State vector:\n");
 
-  /* Uncollapsed qubits */
-  unsigned int u_order;
-  unsigned int u_length;
-  uint8_t u_indices[64];
+  for (i = 0; i < length; ++i)
+  {
+    p = qcircuit_to_physical (circuit, i);
 
-  unsigned int index_full;
+    if (!circuit->collapsed_mask ||
+        (circuit->collapsed_mask & p) == circuit->measure_result)
+      printf ("    <%llu|psi> = %lg + %lgi\n",
+              (unsigned long long) i,
+              creal (circuit->state[p] * circuit->collapsed_norm),
+              cimag (circuit->state[p] * circuit->collapsed_norm));
+  }
 
-  unsigned int state;
+  printf ("---------------------------\n");
 
-  struct qstate_info *qinfo;
+}
 
+/* Mask and measure are in physical qubits */
+static QBOOL
+__qcircuit_collapse (qcircuit_t *circuit, uint64_t mask, uint64_t *measure)
+{
+  qmeasure_plan_t *plan;
+  uint64_t chunk;
+  unsigned int i, k, n;
+  QBOOL ok;
 
   uint64_t saved_mask = mask;
 
-  if (!circuit->updated)
+  if (!circuit->has_state)
   {
-    q_set_last_error ("qcircuit_collapse: circuit operator not updated");
+    q_set_last_error ("qcircuit_collapse: no state has been computed");
     return Q_FALSE;
   }
 
@@ -642,8 +1870,6 @@ qcircuit_collapse (qcircuit_t *circuit, uint64_t mask, unsigned int *measure)
   if (mask == 0)
     return Q_TRUE;
 
-  length = 1 << circuit->order;
-
   /* If we have bits that have already been measured, we can skip them and
    * update *measure with the previous calculation.
    */
@@ -657,107 +1883,123 @@ qcircuit_collapse (qcircuit_t *circuit, uint64_t mask, unsigned int *measure)
     return Q_TRUE;
   }
 
+  /* Tableaus and MPS are measured qubit by qubit */
+  if (circuit->tableau != NULL)
+  {
+    for (i = 0; i < circuit->order && i < 64; ++i)
+      if (BITMAP_HAS_BIT (mask, i))
+        if (qstab_measure (circuit->collapsed_tableau, i))
+          circuit->measure_result |= 1ull << i;
 
-  /* Setup of qubits to measure */
-  m_order = 0;
+    circuit->collapsed_mask |= mask;
 
-  for (i = 0; i < circuit->order; ++i)
-    if (BITMAP_HAS_BIT (mask, i))
-      m_indices[m_order++] = i;
+    *measure = circuit->measure_result & saved_mask;
 
-  m_length = 1 << m_order;
+    return Q_TRUE;
+  }
 
-  /* Setup of non-collapsed qubits */
-  u_order = 0;
+  if (circuit->mps != NULL)
+  {
+    for (i = 0; i < circuit->order && i < 64; ++i)
+      if (BITMAP_HAS_BIT (mask, i))
+      {
+        if (!qmps_measure (circuit->collapsed_mps, qcircuit_mps_site (circuit, i), &k))
+          return Q_FALSE;
 
-  for (i = 0; i < circuit->order; ++i)
-    if (!BITMAP_HAS_BIT (circuit->collapsed_mask | mask, i))
-      u_indices[u_order++] = i;
+        if (k)
+          circuit->measure_result |= 1ull << i;
 
-  u_length = 1 << u_order;
+        circuit->collapsed_mask |= 1ull << i;
+      }
 
-  if ((qinfo = malloc (m_length * sizeof (struct qstate_info))) == NULL)
-  {
-    q_set_last_error ("qcircuit_collapse: memory exhausted");
-    return Q_FALSE;
-  }
+    *measure = circuit->measure_result & saved_mask;
 
+    return Q_TRUE;
+  }
 
-  double total_p = 0.0;
 
-  /* First: setup all bins */
-  for (i = 0; i < m_length; ++i)
+  /* State vectors are measured with a plan for (at most)
+   * QMEASURE_ORDER_MAX qubits at a time */
+  while (mask != 0)
   {
-    qubits = 0;
+    chunk = 0;
+
+    for (i = 0, n = 0; i < 64 && n < QMEASURE_ORDER_MAX; ++i)
+      if (BITMAP_HAS_BIT (mask, i))
+      {
+        chunk |= 1ull << i;
+        ++n;
+      }
+
+    if ((plan = qmeasure_plan_new (
+        circuit,
+        qcircuit_to_logical (circuit, chunk))) == NULL)
+      return Q_FALSE;
 
-    for (j = 0; j < m_order; ++j)
-      if (BITMAP_HAS_BIT (i, j))
-        qubits |= 1 << m_indices[j];
+    ok = qmeasure_plan_apply (plan, circuit);
 
-    /* @qubits: enabled bits for this set of states */
+    qmeasure_plan_destroy (plan);
 
-    /* Compute probability for this configuration of qubits */
-    /* First: setup all qubits shared by this computation */
+    if (!ok)
+      return Q_FALSE;
 
-    qinfo[i].i = circuit->measure_result | qubits;
-    qinfo[i].p = 0.0;
+    mask &= ~chunk;
+  }
 
-    /* Second: iterate through all states having this set of qubits */
-    for (j = 0; j < u_length; ++j)
-    {
-      index_full = qinfo[i].i;
+  *measure = circuit->measure_result & saved_mask;
 
-      for (k = 0; k < u_order; ++k)
-        if (BITMAP_HAS_BIT (j, k))
-          index_full |= 1 << u_indices[k];
+  return Q_TRUE;
+}
 
-      qinfo[i].p += creal (circuit->collapsed[index_full] *
-                          conj (circuit->collapsed[index_full]));
-    }
+QBOOL
+qcircuit_collapse (qcircuit_t *circuit, uint64_t mask, unsigned int *measure)
+{
+  uint64_t physical = 0;
 
-    total_p += qinfo[i].p;
-  }
+  if (!__qcircuit_collapse (
+      circuit,
+      qcircuit_to_physical (circuit, mask),
+      &physical))
+    return Q_FALSE;
 
-  /* Normalize probabilities */
-  for (i = 0; i < m_length; ++i)
-  {
-    qinfo[i].p /= total_p;
-    qinfo[i].d  = qinfo[i].p;
+  *measure = qcircuit_to_logical (circuit, physical);
 
-    if (i > 0)
-      qinfo[i].d += qinfo[i - 1].d;
-  }
+  return Q_TRUE;
+}
 
-  /* Third: sort */
-  qsort (qinfo, m_length, sizeof (struct qstate_info), qstate_info_compare);
+/* Measure a single (logical) qubit. Unlike qcircuit_collapse, this
+ * works for qubits beyond the 64th one in big tableau or MPS circuits. */
+QBOOL
+qcircuit_measure_qubit (qcircuit_t *circuit, unsigned int qubit, unsigned int *bit)
+{
+  unsigned int physical;
+  uint64_t measure;
 
-  /* Fourth: collapse */
-  state = randslot (qinfo, m_length);
-  circuit->measure_result  = qinfo[state].i;
-  circuit->collapsed_mask |= mask;
+  if (!circuit->has_state)
+  {
+    q_set_last_error ("qcircuit_measure_qubit: no state has been computed");
+    return Q_FALSE;
+  }
 
-  /* Fifth: update probabilities */
-  /* We modify the probability of this state here, so we don't use
-   * extra variables or compute the sqrt several times
-   */
+  if (qubit >= circuit->order)
+  {
+    q_set_last_error ("qcircuit_measure_qubit: invalid qubit %d", qubit);
+    return Q_FALSE;
+  }
 
-  qinfo[state].p = sqrt (qinfo[state].p);
+  physical = circuit->layout != NULL ? circuit->layout[qubit] : qubit;
 
-  for (j = 0; j < u_length; ++j)
+  if (physical < 64)
   {
-    index_full = qinfo[state].i;
-
-    for (k = 0; k < u_order; ++k)
-      if (BITMAP_HAS_BIT (j, k))
-        index_full |= 1 << u_indices[k];
+    if (!__qcircuit_collapse (circuit, 1ull << physical, &measure))
+      return Q_FALSE;
 
-    circuit->collapsed[index_full] /= qinfo[state].p;
+    *bit = (circuit->measure_result >> physical) & 1;
   }
-
-  *measure = circuit->measure_result & saved_mask;
+  else if (circuit->mps != NULL)
+    return qmps_measure (circuit->collapsed_mps, qcircuit_mps_site (circuit, physical), bit);
+  else
+    *bit = qstab_measure (circuit->collapsed_tableau, physical);
 
   return Q_TRUE;
-
-fail:
-  return Q_FALSE;
 }
@@ -26,8 +26,48 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "qexpcache.h"
+
 #define QCIRCUIT_LAST_ERROR_MAX 256
 
+/* Below this order, splitting a single product among threads costs
+ * more than it saves */
+#define QCIRCUIT_PARALLEL_MUL_ORDER_MIN 6
+
+/* State vector simulation: at most this many qubits are gathered in
+ * each pass over the state vector, and passes are split among threads
+ * only for states of at least QCIRCUIT_PARALLEL_SWEEP_ORDER_MIN qubits */
+#define QCIRCUIT_SWEEP_ORDER_MAX 10
+#define QCIRCUIT_PARALLEL_SWEEP_ORDER_MIN 14
+
+/* States bigger than this (in qubits) are simulated in blocks of
+ * 1 << QCIRCUIT_BLOCK_ORDER amplitudes (256 KiB, about the size of L2).
+ * Qubits above the block are relabeled, looking this many wirings
+ * ahead to decide which low qubit to give away */
+#define QCIRCUIT_BLOCK_ORDER 14
+#define QCIRCUIT_RELABEL_LOOKAHEAD 256
+
+/* State vectors are allocated on first use, and only up to this order.
+ * Clifford circuits can be bigger: they are simulated on a stabilizer
+ * tableau (see qstab.h) */
+#define QCIRCUIT_STATE_ORDER_MAX 30
+
+/* Same, for state vectors kept in files (see qcircuit_set_storage) */
+#define QCIRCUIT_MAPPED_ORDER_MAX 36
+
+/* Oracle gates keep a table of 1 << order basis states */
+#define QGATE_ORACLE_ORDER_MAX 20
+
+/* Parametric gates take at most this many parameters (see qparam.h) */
+#define QGATE_PARAMS_MAX 3
+
+enum qgate_kind
+{
+  QGATE_KIND_MATRIX,     /* Explicit 2^n x 2^n matrix (coef) */
+  QGATE_KIND_CONTROLLED, /* Target gate applied if the controls match */
+  QGATE_KIND_ORACLE      /* Reversible classical function (table) */
+};
+
 struct qgate
 {
   unsigned int order;
@@ -35,13 +75,53 @@ struct qgate
   char *name;
   char *description;
 
-  QCOMPLEX *coef;
+  enum qgate_kind kind;
+
+  QCOMPLEX *coef; /* NULL unless kind == QGATE_KIND_MATRIX */
 
+  /* QGATE_KIND_CONTROLLED: the lower target->order bits of the gate are
+   * the target qubits, the remaining ones are the controls. The target
+   * is applied when control k is in state (pattern >> k) & 1, and the
+   * identity otherwise. Target is owned by the database. */
+  const struct qgate *target;
+  unsigned int controls;
+  uint64_t pattern;
+
+  /* QGATE_KIND_ORACLE: basis state i is mapped to basis state table[i] */
+  uint32_t *table;
+
+  /* NULL for gates too big for qsparse */
   qsparse_t *sparse;
+
+  /* Conjugation table, if the gate is a (small) Clifford gate */
+  struct qclifford *clifford;
+
+  /* Parametric gates: coef is computed by the family from params, and
+   * recomputed in place by qgate_bind. NULL for fixed gates. */
+  const struct qgate_family *family;
+  double params[QGATE_PARAMS_MAX];
+
+  /* Identifies the current contents of the gate. Renewed every time the
+   * sparse representation is (re)built. */
+  unsigned long serial;
 };
 
 typedef struct qgate qgate_t;
 
+static inline QBOOL
+qgate_is_parametric (const qgate_t *gate)
+{
+  return gate->family != NULL;
+}
+
+/* Number of gate bits acted upon. Control qubits only select which
+ * amplitudes are affected, and never need to be gathered. */
+static inline unsigned int
+qgate_target_order (const qgate_t *gate)
+{
+  return gate->kind == QGATE_KIND_CONTROLLED ? gate->target->order : gate->order;
+}
+
 struct qwiring
 {
   struct qwiring *prev;
@@ -51,8 +131,23 @@ struct qwiring
 
   unsigned int *remap; /* This has order gate->order */
 
-  /* Cached QSPARSE representation */
-  qsparse_t *__cached;
+  /* Partial product tree. Wirings are also the nodes of a treap whose
+   * in-order traversal is the wiring sequence. Each node keeps the
+   * product of its subtree, so editing a wiring only recomputes the
+   * products on the path to the root. */
+  struct qwiring *parent;
+  struct qwiring *left;  /* Applied earlier */
+  struct qwiring *right; /* Applied later */
+
+  uint32_t priority;
+  QBOOL dirty;
+
+  /* Gate serial the products were computed for. Parametric gates are
+   * shared by every circuit of the database, and may be rebound through
+   * any of them (see qcircuit_check_params). */
+  unsigned long serial;
+
+  qsparse_t *product; /* right * this * left */
 };
 
 typedef struct qwiring qwiring_t;
@@ -63,6 +158,7 @@ struct qcircuit
   char *name;
 
   QBOOL updated; /* U is not updated */
+  QBOOL has_state; /* State has been computed */
 
   qsparse_t *u;
 
@@ -70,30 +166,102 @@ struct qcircuit
   uint64_t collapsed_mask;
   uint64_t measure_result;
 
-  QCOMPLEX *state;     /* Wave function */
-  QCOMPLEX *collapsed; /* Collapsed wave function */
+  QCOMPLEX *state; /* Wave function (NULL until first used) */
+
+  /* The collapsed wave function is not stored: it is state restricted
+   * to the amplitudes matching the previous measures, times this */
+  double collapsed_norm;
+
+  /* Out-of-core mode: if storage is not NULL, the state vector is a
+   * memory-mapped (unlinked) file created in that directory */
+  char *storage;
+  QBOOL mapped; /* state is a mapping */
+
+  /* Stabilizer tableaus replacing the state vector after
+   * qcircuit_simulate_basis on a Clifford circuit */
+  struct qstab *tableau;
+  struct qstab *collapsed_tableau;
+
+  /* Same for matrix product states (qcircuit_simulate_mps). Their
+   * sites follow the logical qubits (see qcircuit_mps_site) */
+  struct qmps *mps;
+  struct qmps *collapsed_mps;
 
   qwiring_t *wiring_head;
   qwiring_t *wiring_tail;
+
+  qwiring_t *tree_root;
+  uint32_t tree_seed;
+
+  /* Qubit relabeling. Wirings, U and the state vector use physical
+   * qubits: logical qubit i (the one seen by the user) is physical qubit
+   * layout[i]. NULL means no relabeling. */
+  unsigned int *layout;
+
+  /* Shared cache of wiring expansions (optional, not owned) */
+  struct qexpcache *expcache;
 };
 
 typedef struct qcircuit qcircuit_t;
 
+static inline unsigned int
+qcircuit_state_order_max (const qcircuit_t *circuit)
+{
+  return circuit->storage != NULL ? QCIRCUIT_MAPPED_ORDER_MAX : QCIRCUIT_STATE_ORDER_MAX;
+}
+
+/* Wirings of a layer act on disjoint sets of qubits, so they commute
+ * and can be applied in the same pass. */
+struct qlayer
+{
+  uint64_t support; /* Qubits touched by the layer */
+
+  unsigned int count;
+  const qwiring_t **wirings;
+};
+
+struct qschedule
+{
+  unsigned int count;
+  struct qlayer *layers;
+
+  const qwiring_t **wirings; /* Storage of all layers */
+};
+
+typedef struct qschedule qschedule_t;
+
 void qgate_destroy (qgate_t *);
 qgate_t *qgate_new (unsigned int, const char *, const char *, const QCOMPLEX *);
+qgate_t *qgate_controlled_new (const char *, const char *, const qgate_t *, unsigned int, uint64_t);
+qgate_t *qgate_oracle_new (unsigned int, const char *, const char *, const uint32_t *);
+QBOOL qgate_oracle_map (qgate_t *, uint32_t, uint32_t);
 QBOOL qgate_set_coef (qgate_t *, const QCOMPLEX *);
+qgate_t *qgate_param_new (const char *, const char *, const char *, const double *);
+QBOOL qgate_bind (qgate_t *, const double *);
+qsparse_t *qgate_expand (const qgate_t *, unsigned int, const unsigned int *);
 
 qwiring_t *qwiring_new (const qgate_t *, const unsigned int *);
 void qwiring_destroy (qwiring_t *);
+void qwiring_mark_dirty (qwiring_t *);
 
 qcircuit_t *qcircuit_new (unsigned int, const char *);
+void qcircuit_set_expcache (qcircuit_t *, struct qexpcache *);
+QBOOL qcircuit_set_storage (qcircuit_t *, const char *);
 
-void qcircuit_measure_reset (qcircuit_t *circuit);
+QBOOL qcircuit_measure_reset (qcircuit_t *circuit);
 
 QBOOL qcircuit_append_wiring (qcircuit_t *, qwiring_t *);
 QBOOL qcircuit_prepend_wiring (qcircuit_t *, qwiring_t *);
+QBOOL qcircuit_insert_wiring (qcircuit_t *, qwiring_t *, qwiring_t *);
+void qcircuit_remove_wiring (qcircuit_t *, qwiring_t *);
+QBOOL qcircuit_replace_wiring (qcircuit_t *, qwiring_t *, qwiring_t *);
 QBOOL qcircuit_wire (qcircuit_t *, const qgate_t *, const unsigned int *);
 
+uint64_t qcircuit_to_physical (const qcircuit_t *, uint64_t);
+uint64_t qcircuit_to_logical (const qcircuit_t *, uint64_t);
+void qcircuit_import_state (const qcircuit_t *, const QCOMPLEX *, QCOMPLEX *);
+QBOOL qcircuit_permute_qubits (qcircuit_t *, const unsigned int *);
+
 static inline qwiring_t *
 qcircuit_get_wiring_head(const qcircuit_t *circuit)
 {
@@ -119,15 +287,44 @@ qwiring_prev (const qwiring_t *wiring)
 }
 
 QBOOL qcircuit_update (qcircuit_t *);
+qsparse_t *qcircuit_power (qcircuit_t *, uint64_t);
 QBOOL qgate_init_sparse (qgate_t *);
 
 /* These functions may fail if U is not updated*/
 QBOOL qcircuit_apply_state (qcircuit_t *, const QCOMPLEX *);
 QBOOL qcircuit_get_state (const qcircuit_t *, QCOMPLEX *);
 QBOOL qcircuit_collapse (qcircuit_t *, uint64_t, unsigned int *);
+QBOOL qcircuit_measure_qubit (qcircuit_t *, unsigned int, unsigned int *);
 
 uint64_t qcircuit_get_measure_bits (const qcircuit_t *);
 
+/* Exact outcome probabilities (qmeasure.c) */
+QBOOL qcircuit_get_probabilities (const qcircuit_t *, uint64_t, double *);
+QBOOL qcircuit_get_marginals (const qcircuit_t *, double *);
+
+/* State vector simulation (simulate.c). This does not need U. */
+qschedule_t *qcircuit_schedule (const qcircuit_t *);
+void qschedule_destroy (qschedule_t *);
+QBOOL qcircuit_alloc_state (qcircuit_t *);
+void qcircuit_discard_state (qcircuit_t *);
+QBOOL qcircuit_simulate (qcircuit_t *, const QCOMPLEX *);
+QBOOL qcircuit_simulate_basis (qcircuit_t *, uint64_t);
+QBOOL qcircuit_simulate_basis_state (qcircuit_t *, uint64_t);
+
+/* Stabilizer simulation (qstab.c) */
+QBOOL qcircuit_is_clifford (const qcircuit_t *);
+QBOOL qcircuit_simulate_tableau (qcircuit_t *, uint64_t);
+
+/* Parametric circuits (qparam.c) */
+unsigned int qcircuit_get_param_count (const qcircuit_t *);
+QBOOL qcircuit_bind (qcircuit_t *, const double *);
+void qcircuit_check_params (qcircuit_t *);
+
+/* Matrix product state simulation (qmps.c) */
+QBOOL qcircuit_simulate_mps (qcircuit_t *, uint64_t, unsigned int, double);
+double qcircuit_get_truncation_error (const qcircuit_t *);
+unsigned int qcircuit_mps_site (const qcircuit_t *, unsigned int);
+
 void qcircuit_debug_state (const qcircuit_t *);
 void qcircuit_destroy (qcircuit_t *);
 
@@ -135,7 +332,7 @@ void qcircuit_destroy (qcircuit_t *);
 
 /* Serialize / deserialize functions */
 uint32_t qgate_serialize (const qgate_t *, void *, uint32_t);
-qgate_t *qgate_deserialize (const void *, uint32_t);
+qgate_t *qgate_deserialize (const qdb_t *, const void *, uint32_t);
 
 uint32_t qwiring_serialize (const qwiring_t *, void *, uint32_t);
 qwiring_t *qwiring_deserialize (const qdb_t *, const void *, uint32_t);
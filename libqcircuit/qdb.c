@@ -20,6 +20,7 @@
 */
 
 #include "qcircuit.h"
+#include "qcache.h"
 
 static void *
 __qgate_destroy_cb (void *gate, void *priv)
@@ -43,12 +44,18 @@ qdb_destroy (qdb_t *db, QBOOL deep)
   unsigned int i;
   unsigned int size;
 
-  (void) fastlist_walk (&db->qgates, __qgate_destroy_cb, NULL);
   (void) fastlist_walk (&db->qcircuits, __qcircuit_destroy_cb, NULL);
+  (void) fastlist_walk (&db->qgates, __qgate_destroy_cb, NULL);
 
   fastlist_free (&db->qgates);
   fastlist_free (&db->qcircuits);
 
+  if (db->cache != NULL)
+    qcache_destroy (db->cache);
+
+  if (db->expcache != NULL)
+    qexpcache_destroy (db->expcache);
+
   free (db);
 }
 
@@ -57,7 +64,14 @@ qdb_new (void)
 {
   qdb_t *new;
 
-  new = calloc (1, sizeof (qdb_t));
+  if ((new = calloc (1, sizeof (qdb_t))) == NULL)
+    return NULL;
+
+  if ((new->expcache = qexpcache_new (QEXPCACHE_DEFAULT_BUDGET)) == NULL)
+  {
+    free (new);
+    return NULL;
+  }
 
   return new;
 }
@@ -108,9 +122,20 @@ qdb_register_qgate (qdb_t *db, qgate_t *gate)
 QBOOL
 qdb_register_qcircuit (qdb_t *db, qcircuit_t *qcircuit)
 {
+  if (qcircuit->expcache == NULL)
+    qcircuit_set_expcache (qcircuit, db->expcache);
+
   if (fastlist_append (&db->qcircuits, qcircuit) == FASTLIST_INVALID_REF)
     return Q_FALSE;
 
   return Q_TRUE;
 }
 
+void
+qdb_set_cache (qdb_t *db, struct qcache *cache)
+{
+  if (db->cache != NULL)
+    qcache_destroy (db->cache);
+
+  db->cache = cache;
+}
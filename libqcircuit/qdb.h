@@ -24,10 +24,16 @@
 
 #include "fastlist.h"
 
+struct qcache;
+
 struct qdb
 {
   fastlist_t qgates;
   fastlist_t qcircuits;
+
+  struct qcache *cache; /* On-disk operator cache (optional, owned) */
+
+  qexpcache_t *expcache; /* Expanded wirings shared by all circuits */
 };
 
 typedef struct qdb qdb_t;
@@ -37,6 +43,7 @@ qgate_t *qdb_lookup_qgate (const qdb_t *, const char *);
 qcircuit_t *qdb_lookup_qcircuit (const qdb_t *, const char *);
 QBOOL qdb_register_qgate (qdb_t *, qgate_t *);
 QBOOL qdb_register_qcircuit (qdb_t *, qcircuit_t *);
+void qdb_set_cache (qdb_t *, struct qcache *);
 void qdb_destroy (qdb_t *, QBOOL);
 
 #endif /* _LIBQCIRCUIT_QDB_H */
@@ -0,0 +1,799 @@
+/*
+  qdd.c: Decision diagram (QMDD) representation of circuit operators
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "qdd.h"
+
+#define QDD_FAILED ((qdd_edge_t) {0, NULL})
+
+static inline qdd_edge_t
+qdd_zero (const qdd_t *dd)
+{
+  return (qdd_edge_t) {0, (qdd_node_t *) &dd->terminal};
+}
+
+static inline double
+qdd_round (double x)
+{
+  return round (x / QDD_EPSILON) * QDD_EPSILON;
+}
+
+static inline QCOMPLEX
+qdd_round_complex (QCOMPLEX w)
+{
+  return qdd_round (creal (w)) + I * qdd_round (cimag (w));
+}
+
+static inline uint32_t
+qdd_mix (uint32_t h, uint64_t x)
+{
+  h ^= (uint32_t) x + 0x9e3779b9 + (h << 6) + (h >> 2);
+  h ^= (uint32_t) (x >> 32) + 0x9e3779b9 + (h << 6) + (h >> 2);
+
+  return h;
+}
+
+static inline uint32_t
+qdd_hash_weight (uint32_t h, QCOMPLEX w)
+{
+  h = qdd_mix (h, (uint64_t) llround (creal (w) / QDD_EPSILON));
+  h = qdd_mix (h, (uint64_t) llround (cimag (w) / QDD_EPSILON));
+
+  return h;
+}
+
+static inline uint32_t
+qdd_hash_ptr (uint32_t h, const void *ptr)
+{
+  return qdd_mix (h, (uint64_t) (uintptr_t) ptr);
+}
+
+/****************************** Unique table ******************************/
+void
+qdd_destroy (qdd_t *dd)
+{
+  qdd_node_t *this, *next;
+  unsigned int i;
+
+  if (dd->buckets != NULL)
+  {
+    for (i = 0; i < dd->bucket_count; ++i)
+      for (this = dd->buckets[i]; this != NULL; this = next)
+      {
+        next = this->next;
+        free (this);
+      }
+
+    free (dd->buckets);
+  }
+
+  if (dd->mul_cache != NULL)
+    free (dd->mul_cache);
+
+  if (dd->add_cache != NULL)
+    free (dd->add_cache);
+
+  free (dd);
+}
+
+qdd_t *
+qdd_new (unsigned int order)
+{
+  qdd_t *new;
+
+  if ((new = calloc (1, sizeof (qdd_t))) == NULL)
+    goto fail;
+
+  new->order          = order;
+  new->terminal.level = -1;
+  new->bucket_count   = QDD_UNIQUE_BUCKETS_MIN;
+  new->gc_limit       = QDD_GC_NODES_MIN;
+
+  if ((new->buckets = calloc (new->bucket_count, sizeof (qdd_node_t *))) == NULL)
+    goto fail;
+
+  if ((new->mul_cache = calloc (QDD_CACHE_SIZE, sizeof (struct qdd_mul_entry))) == NULL)
+    goto fail;
+
+  if ((new->add_cache = calloc (QDD_CACHE_SIZE, sizeof (struct qdd_add_entry))) == NULL)
+    goto fail;
+
+  return new;
+
+fail:
+  if (new != NULL)
+    qdd_destroy (new);
+
+  q_set_last_error ("qdd_new: memory exhausted");
+
+  return NULL;
+}
+
+/* Keep chains short. A failure here is not fatal: chains just grow. */
+static void
+qdd_unique_grow (qdd_t *dd)
+{
+  qdd_node_t **buckets, *this, *next;
+  unsigned int i, count;
+
+  count = dd->bucket_count << 1;
+
+  if ((buckets = calloc (count, sizeof (qdd_node_t *))) == NULL)
+    return;
+
+  for (i = 0; i < dd->bucket_count; ++i)
+    for (this = dd->buckets[i]; this != NULL; this = next)
+    {
+      next = this->next;
+
+      this->next = buckets[this->hash & (count - 1)];
+      buckets[this->hash & (count - 1)] = this;
+    }
+
+  free (dd->buckets);
+
+  dd->buckets      = buckets;
+  dd->bucket_count = count;
+}
+
+/* Normalize the children and return the unique node for them */
+static qdd_edge_t
+qdd_make_node (qdd_t *dd, int level, const qdd_edge_t *e)
+{
+  qdd_node_t *this;
+  qdd_edge_t child[4];
+  QCOMPLEX norm;
+  double mag, max = 0;
+  unsigned int i, top = 0;
+  uint32_t hash;
+
+  for (i = 0; i < 4; ++i)
+  {
+    if (e[i].n == NULL)
+      return QDD_FAILED;
+
+    child[i] = e[i];
+
+    if ((mag = cabs (child[i].w)) < QDD_EPSILON)
+      child[i] = qdd_zero (dd);
+    else if (mag > max + QDD_EPSILON)
+    {
+      max = mag;
+      top = i;
+    }
+  }
+
+  if (max == 0)
+    return qdd_zero (dd);
+
+  norm = child[top].w;
+  hash = level;
+
+  for (i = 0; i < 4; ++i)
+  {
+    if (i == top)
+      child[i].w = 1;
+    else if (child[i].w != 0)
+      child[i].w = qdd_round_complex (child[i].w / norm);
+
+    if (child[i].w == 0)
+      child[i] = qdd_zero (dd);
+
+    hash = qdd_hash_ptr (hash, child[i].n);
+    hash = qdd_hash_weight (hash, child[i].w);
+  }
+
+  for (this = dd->buckets[hash & (dd->bucket_count - 1)]; this != NULL; this = this->next)
+    if (this->hash == hash && this->level == level &&
+        memcmp (this->e, child, sizeof (child)) == 0)
+      return (qdd_edge_t) {norm, this};
+
+  if ((this = calloc (1, sizeof (qdd_node_t))) == NULL)
+  {
+    q_set_last_error ("qdd_make_node: memory exhausted");
+    return QDD_FAILED;
+  }
+
+  this->level = level;
+  this->hash  = hash;
+
+  memcpy (this->e, child, sizeof (child));
+
+  this->next = dd->buckets[hash & (dd->bucket_count - 1)];
+  dd->buckets[hash & (dd->bucket_count - 1)] = this;
+
+  if (++dd->node_count > 2 * dd->bucket_count)
+    qdd_unique_grow (dd);
+
+  return (qdd_edge_t) {norm, this};
+}
+
+/* The terminal node is not in the table and is never collected */
+void
+qdd_ref (qdd_t *dd, qdd_edge_t e)
+{
+  if (e.n != NULL && e.n != &dd->terminal)
+    ++e.n->ref;
+}
+
+void
+qdd_unref (qdd_t *dd, qdd_edge_t e)
+{
+  if (e.n != NULL && e.n != &dd->terminal)
+    --e.n->ref;
+}
+
+static void
+__qdd_mark (qdd_node_t *this, unsigned long epoch)
+{
+  unsigned int i;
+
+  if (this->level < 0 || this->mark == epoch)
+    return;
+
+  this->mark = epoch;
+
+  for (i = 0; i < 4; ++i)
+    __qdd_mark (this->e[i].n, epoch);
+}
+
+/* Mark and sweep. Cache entries may point to freed nodes (or to new
+ * nodes reusing their addresses), so both caches are cleared. */
+void
+qdd_gc (qdd_t *dd)
+{
+  qdd_node_t **prev, *this;
+  unsigned int i;
+
+  ++dd->epoch;
+
+  for (i = 0; i < dd->bucket_count; ++i)
+    for (this = dd->buckets[i]; this != NULL; this = this->next)
+      if (this->ref > 0)
+        __qdd_mark (this, dd->epoch);
+
+  for (i = 0; i < dd->bucket_count; ++i)
+  {
+    prev = dd->buckets + i;
+
+    while ((this = *prev) != NULL)
+      if (this->mark != dd->epoch)
+      {
+        *prev = this->next;
+        free (this);
+
+        --dd->node_count;
+      }
+      else
+        prev = &this->next;
+  }
+
+  memset (dd->mul_cache, 0, QDD_CACHE_SIZE * sizeof (struct qdd_mul_entry));
+  memset (dd->add_cache, 0, QDD_CACHE_SIZE * sizeof (struct qdd_add_entry));
+
+  dd->gc_limit = 2 * dd->node_count;
+
+  if (dd->gc_limit < QDD_GC_NODES_MIN)
+    dd->gc_limit = QDD_GC_NODES_MIN;
+}
+
+/******************************** Operations ******************************/
+static qdd_edge_t
+__qdd_add (qdd_t *dd, qdd_edge_t a, qdd_edge_t b)
+{
+  struct qdd_add_entry *entry;
+  qdd_edge_t e[4], ea, eb, r;
+  QCOMPLEX ratio, w;
+  unsigned int i;
+
+  if (a.n == NULL || b.n == NULL)
+    return QDD_FAILED;
+
+  if (a.w == 0)
+    return b;
+
+  if (b.w == 0)
+    return a;
+
+  if (a.n == b.n)
+  {
+    w = a.w + b.w;
+
+    return cabs (w) < QDD_EPSILON ? qdd_zero (dd) : (qdd_edge_t) {w, a.n};
+  }
+
+  /* a + b = a.w (A + ratio B) */
+  ratio = qdd_round_complex (b.w / a.w);
+  entry = dd->add_cache
+    + (qdd_hash_weight (qdd_hash_ptr (qdd_hash_ptr (0, a.n), b.n), ratio)
+       & (QDD_CACHE_SIZE - 1));
+
+  if (entry->a == a.n && entry->b == b.n && entry->ratio == ratio)
+    return (qdd_edge_t) {entry->result.w * a.w, entry->result.n};
+
+  for (i = 0; i < 4; ++i)
+  {
+    ea = a.n->e[i];
+    eb = b.n->e[i];
+
+    eb.w *= ratio;
+
+    e[i] = __qdd_add (dd, ea, eb);
+  }
+
+  r = qdd_make_node (dd, a.n->level, e);
+
+  if (r.n == NULL)
+    return QDD_FAILED;
+
+  entry->a      = a.n;
+  entry->b      = b.n;
+  entry->ratio  = ratio;
+  entry->result = r;
+
+  return (qdd_edge_t) {r.w * a.w, r.n};
+}
+
+static qdd_edge_t
+__qdd_mul (qdd_t *dd, qdd_edge_t a, qdd_edge_t b)
+{
+  struct qdd_mul_entry *entry;
+  qdd_edge_t e[4], ea, eb, sum, r;
+  unsigned int row, col, k;
+
+  if (a.n == NULL || b.n == NULL)
+    return QDD_FAILED;
+
+  if (a.w == 0 || b.w == 0)
+    return qdd_zero (dd);
+
+  if (a.n->level < 0)
+    return (qdd_edge_t) {a.w * b.w, a.n};
+
+  entry = dd->mul_cache
+    + (qdd_hash_ptr (qdd_hash_ptr (1, a.n), b.n) & (QDD_CACHE_SIZE - 1));
+
+  if (entry->a == a.n && entry->b == b.n)
+    return (qdd_edge_t) {entry->result.w * a.w * b.w, entry->result.n};
+
+  for (row = 0; row < 2; ++row)
+    for (col = 0; col < 2; ++col)
+    {
+      sum = qdd_zero (dd);
+
+      for (k = 0; k < 2; ++k)
+      {
+        ea = a.n->e[(row << 1) | k];
+        eb = b.n->e[(k << 1) | col];
+
+        sum = __qdd_add (dd, sum, __qdd_mul (dd, ea, eb));
+      }
+
+      e[(row << 1) | col] = sum;
+    }
+
+  r = qdd_make_node (dd, a.n->level, e);
+
+  if (r.n == NULL)
+    return QDD_FAILED;
+
+  entry->a      = a.n;
+  entry->b      = b.n;
+  entry->result = r;
+
+  return (qdd_edge_t) {r.w * a.w * b.w, r.n};
+}
+
+QBOOL
+qdd_add (qdd_t *dd, qdd_edge_t a, qdd_edge_t b, qdd_edge_t *result)
+{
+  *result = __qdd_add (dd, a, b);
+
+  return result->n != NULL;
+}
+
+QBOOL
+qdd_mul (qdd_t *dd, qdd_edge_t a, qdd_edge_t b, qdd_edge_t *result)
+{
+  *result = __qdd_mul (dd, a, b);
+
+  return result->n != NULL;
+}
+
+/* Build the expansion of a gate over the whole register, top to bottom.
+ * Levels not touched by the gate are identities. local[q] is the gate
+ * bit on qubit q, or -1. */
+static qdd_edge_t
+qdd_build_gate (
+    qdd_t *dd,
+    const qgate_t *gate,
+    const int *local,
+    int level,
+    unsigned int row,
+    unsigned int col)
+{
+  qdd_edge_t e[4], sub;
+  QCOMPLEX w;
+  unsigned int r, c;
+
+  if (level < 0)
+  {
+    w = qsparse_get (gate->sparse, row, col);
+
+    return w == 0 ? qdd_zero (dd) : (qdd_edge_t) {w, &dd->terminal};
+  }
+
+  if (local[level] < 0)
+  {
+    sub = qdd_build_gate (dd, gate, local, level - 1, row, col);
+
+    e[0] = e[3] = sub;
+    e[1] = e[2] = qdd_zero (dd);
+  }
+  else
+    for (r = 0; r < 2; ++r)
+      for (c = 0; c < 2; ++c)
+        e[(r << 1) | c] = qdd_build_gate (
+            dd,
+            gate,
+            local,
+            level - 1,
+            row | (r << local[level]),
+            col | (c << local[level]));
+
+  return qdd_make_node (dd, level, e);
+}
+
+QBOOL
+qdd_from_gate (
+    qdd_t *dd,
+    const qgate_t *gate,
+    const unsigned int *remap,
+    qdd_edge_t *result)
+{
+  int *local;
+  unsigned int i;
+
+  if (gate->sparse == NULL)
+  {
+    q_set_last_error ("qdd_from_gate: gate `%s' has no matrix", gate->name);
+    return Q_FALSE;
+  }
+
+  if ((local = malloc (dd->order * sizeof (int))) == NULL)
+  {
+    q_set_last_error ("qdd_from_gate: memory exhausted");
+    return Q_FALSE;
+  }
+
+  for (i = 0; i < dd->order; ++i)
+    local[i] = -1;
+
+  for (i = 0; i < gate->order; ++i)
+    local[remap[i]] = i;
+
+  *result = qdd_build_gate (dd, gate, local, dd->order - 1, 0, 0);
+
+  free (local);
+
+  return result->n != NULL;
+}
+
+QBOOL
+qdd_identity (qdd_t *dd, qdd_edge_t *result)
+{
+  qdd_edge_t e[4];
+  unsigned int i;
+
+  *result = (qdd_edge_t) {1, &dd->terminal};
+
+  for (i = 0; i < dd->order; ++i)
+  {
+    e[0] = e[3] = *result;
+    e[1] = e[2] = qdd_zero (dd);
+
+    if ((*result = qdd_make_node (dd, i, e)).n == NULL)
+      return Q_FALSE;
+  }
+
+  return Q_TRUE;
+}
+
+/********************************* Queries ********************************/
+QCOMPLEX
+qdd_get (const qdd_t *dd, qdd_edge_t e, uint64_t row, uint64_t col)
+{
+  QCOMPLEX w = e.w;
+  const qdd_node_t *this = e.n;
+  unsigned int i;
+
+  while (this->level >= 0 && w != 0)
+  {
+    i = (((row >> this->level) & 1) << 1) | ((col >> this->level) & 1);
+
+    w   *= this->e[i].w;
+    this = this->e[i].n;
+  }
+
+  return w;
+}
+
+/* Every nonzero of the matrix is a path with nonzero weights */
+static void
+__qdd_mul_vec (
+    const qdd_node_t *this,
+    QCOMPLEX w,
+    const QCOMPLEX *x,
+    QCOMPLEX *y,
+    uint64_t row,
+    uint64_t col)
+{
+  unsigned int r, c;
+
+  if (this->level < 0)
+  {
+    y[row] += w * x[col];
+    return;
+  }
+
+  for (r = 0; r < 2; ++r)
+    for (c = 0; c < 2; ++c)
+      if (this->e[(r << 1) | c].w != 0)
+        __qdd_mul_vec (
+            this->e[(r << 1) | c].n,
+            w * this->e[(r << 1) | c].w,
+            x,
+            y,
+            row | ((uint64_t) r << this->level),
+            col | ((uint64_t) c << this->level));
+}
+
+/* y = M x */
+void
+qdd_mul_vec (const qdd_t *dd, qdd_edge_t e, const QCOMPLEX *x, QCOMPLEX *y)
+{
+  memset (y, 0, (1ull << dd->order) * sizeof (QCOMPLEX));
+
+  if (e.w != 0)
+    __qdd_mul_vec (e.n, e.w, x, y, 0, 0);
+}
+
+static QBOOL
+__qdd_to_sparse (
+    const qdd_node_t *this,
+    QCOMPLEX w,
+    qsparse_t *sparse,
+    unsigned int row,
+    unsigned int col)
+{
+  unsigned int r, c;
+
+  if (this->level < 0)
+    return qsparse_set (sparse, row, col, w);
+
+  for (r = 0; r < 2; ++r)
+    for (c = 0; c < 2; ++c)
+      if (this->e[(r << 1) | c].w != 0)
+        if (!__qdd_to_sparse (
+            this->e[(r << 1) | c].n,
+            w * this->e[(r << 1) | c].w,
+            sparse,
+            row | (r << this->level),
+            col | (c << this->level)))
+          return Q_FALSE;
+
+  return Q_TRUE;
+}
+
+qsparse_t *
+qdd_to_sparse (const qdd_t *dd, qdd_edge_t e)
+{
+  qsparse_t *sparse;
+
+  if ((sparse = qsparse_new (dd->order)) == NULL)
+    return NULL;
+
+  if (e.w != 0)
+    if (!__qdd_to_sparse (e.n, e.w, sparse, 0, 0))
+    {
+      qsparse_destroy (sparse);
+      return NULL;
+    }
+
+  return sparse;
+}
+
+static unsigned int
+__qdd_count_nodes (qdd_node_t *this, unsigned long epoch)
+{
+  unsigned int i, count = 1;
+
+  if (this->level < 0 || this->mark == epoch)
+    return 0;
+
+  this->mark = epoch;
+
+  for (i = 0; i < 4; ++i)
+    count += __qdd_count_nodes (this->e[i].n, epoch);
+
+  return count;
+}
+
+/* Non-terminal nodes reachable from e */
+unsigned int
+qdd_count_nodes (qdd_t *dd, qdd_edge_t e)
+{
+  return __qdd_count_nodes (e.n, ++dd->epoch);
+}
+
+size_t
+qdd_get_footprint (const qdd_t *dd)
+{
+  return dd->node_count * sizeof (qdd_node_t)
+    + dd->bucket_count * sizeof (qdd_node_t *)
+    + QDD_CACHE_SIZE * (sizeof (struct qdd_mul_entry) + sizeof (struct qdd_add_entry));
+}
+
+/**************************** Circuit operators ***************************/
+/* Like qcircuit_update, but U is built as a decision diagram: wirings
+ * are expanded and multiplied in order, U = W_n ... W_2 W_1. Only the
+ * running product is referenced, so intermediate products are collected
+ * as the table grows. The result is referenced, and must be released
+ * with qdd_unref. */
+QBOOL
+qcircuit_build_dd (const qcircuit_t *circuit, qdd_t *dd, qdd_edge_t *result)
+{
+  const qwiring_t *this;
+  qdd_edge_t u, w, prod;
+
+  if (dd->order != circuit->order)
+  {
+    q_set_last_error ("qcircuit_build_dd: diagram order mismatch");
+    return Q_FALSE;
+  }
+
+  if (!qdd_identity (dd, &u))
+    return Q_FALSE;
+
+  qdd_ref (dd, u);
+
+  for (this = circuit->wiring_head; this != NULL; this = this->next)
+  {
+    if (!qdd_from_gate (dd, this->gate, this->remap, &w))
+      goto fail;
+
+    if (!qdd_mul (dd, w, u, &prod))
+      goto fail;
+
+    qdd_ref (dd, prod);
+    qdd_unref (dd, u);
+
+    u = prod;
+
+    if (dd->node_count > dd->gc_limit)
+      qdd_gc (dd);
+  }
+
+  *result = u;
+
+  return Q_TRUE;
+
+fail:
+  qdd_unref (dd, u);
+
+  return Q_FALSE;
+}
+
+/* Operator backend for qcircuit_update: U is computed as a decision
+ * diagram and then expanded to its sparse form. Circuits with a lot of
+ * repeated structure (e.g. many identical layers) give small diagrams
+ * where the partial products of the wiring tree would be dense. */
+QBOOL
+qcircuit_update_dd (qcircuit_t *circuit)
+{
+  qdd_t *dd = NULL;
+  qdd_edge_t e;
+  qsparse_t *u;
+
+  if (circuit->order > QSPARSE_ORDER_MAX)
+  {
+    q_set_last_error (
+        "qcircuit_update_dd: circuit `%s' too big for an operator",
+        circuit->name);
+    return Q_FALSE;
+  }
+
+  qcircuit_check_params (circuit);
+
+  if (circuit->updated && circuit->u != NULL)
+    return Q_TRUE;
+
+  if ((dd = qdd_new (circuit->order)) == NULL)
+    return Q_FALSE;
+
+  if (!qcircuit_build_dd (circuit, dd, &e))
+    goto fail;
+
+  u = qdd_to_sparse (dd, e);
+
+  qdd_destroy (dd);
+
+  if (u == NULL)
+    return Q_FALSE;
+
+  if (circuit->u != NULL)
+    qsparse_destroy (circuit->u);
+
+  circuit->u = u;
+
+  circuit->updated = Q_TRUE;
+
+  return Q_TRUE;
+
+fail:
+  qdd_destroy (dd);
+
+  return Q_FALSE;
+}
+
+/* Like qcircuit_apply_state, with an operator built by qcircuit_build_dd */
+QBOOL
+qcircuit_apply_dd (qcircuit_t *circuit, const qdd_t *dd, qdd_edge_t u, const QCOMPLEX *psi)
+{
+  QCOMPLEX *in = NULL;
+
+  if (dd->order != circuit->order)
+  {
+    q_set_last_error ("qcircuit_apply_dd: diagram order mismatch");
+    return Q_FALSE;
+  }
+
+  if (!qcircuit_alloc_state (circuit))
+    return Q_FALSE;
+
+  /* The diagram works on physical qubits */
+  if (circuit->layout != NULL)
+  {
+    if ((in = malloc ((1ull << circuit->order) * sizeof (QCOMPLEX))) == NULL)
+    {
+      q_set_last_error ("qcircuit_apply_dd: memory exhausted");
+      return Q_FALSE;
+    }
+
+    qcircuit_import_state (circuit, psi, in);
+  }
+
+  qdd_mul_vec (dd, u, in != NULL ? in : psi, circuit->state);
+
+  if (in != NULL)
+    free (in);
+
+  if (!qcircuit_measure_reset (circuit))
+    return Q_FALSE;
+
+  circuit->has_state = Q_TRUE;
+
+  return Q_TRUE;
+}
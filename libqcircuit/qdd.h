@@ -0,0 +1,137 @@
+/*
+  qdd.h: Decision diagram (QMDD) representation of circuit operators
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _LIBQCIRCUIT_QDD_H
+#define _LIBQCIRCUIT_QDD_H
+
+#include <qsparse.h>
+#include <stdint.h>
+
+#include "qcircuit.h"
+
+/* Edge weights are rounded to multiples of this, so that equal
+ * subdiagrams (up to rounding) get the same node */
+#define QDD_EPSILON 1e-12
+
+#define QDD_UNIQUE_BUCKETS_MIN 4096
+#define QDD_CACHE_SIZE         (1 << 16)
+
+/* Garbage is collected when the unique table grows past twice the nodes
+ * that survived the last collection, and never below this */
+#define QDD_GC_NODES_MIN (1 << 14)
+
+struct qdd_node;
+
+/* A 2^n x 2^n matrix is weight times the matrix of the node */
+struct qdd_edge
+{
+  QCOMPLEX w;
+  struct qdd_node *n; /* NULL only as an error result */
+};
+
+typedef struct qdd_edge qdd_edge_t;
+
+/* Node of qubit level: e[(r << 1) | c] is the quadrant of rows with bit
+ * level = r and columns with bit level = c. Nodes are normalized (the
+ * first child of largest weight has weight 1) and unique, so equal
+ * submatrices are shared. The terminal node has level -1. */
+struct qdd_node
+{
+  int level;
+  struct qdd_edge e[4];
+
+  uint32_t hash;
+  unsigned long mark;
+  unsigned int ref; /* References from outside the package (qdd_ref) */
+
+  struct qdd_node *next; /* Unique table chain */
+};
+
+typedef struct qdd_node qdd_node_t;
+
+struct qdd_mul_entry
+{
+  const qdd_node_t *a;
+  const qdd_node_t *b;
+  qdd_edge_t result;
+};
+
+struct qdd_add_entry
+{
+  const qdd_node_t *a;
+  const qdd_node_t *b;
+  QCOMPLEX ratio;
+  qdd_edge_t result;
+};
+
+/* Diagrams of a given number of qubits. Nodes belong to the package.
+ * Those not reachable from a referenced edge are freed by qdd_gc, which
+ * also invalidates every unreferenced edge. */
+struct qdd
+{
+  unsigned int order;
+
+  qdd_node_t terminal;
+
+  qdd_node_t **buckets;
+  unsigned int bucket_count;
+  unsigned int node_count;
+  unsigned int gc_limit;
+
+  struct qdd_mul_entry *mul_cache;
+  struct qdd_add_entry *add_cache;
+
+  unsigned long epoch; /* For graph traversals */
+};
+
+typedef struct qdd qdd_t;
+
+static inline QBOOL
+qdd_edge_is_zero (qdd_edge_t e)
+{
+  return e.w == 0;
+}
+
+qdd_t *qdd_new (unsigned int);
+void qdd_destroy (qdd_t *);
+
+void qdd_ref (qdd_t *, qdd_edge_t);
+void qdd_unref (qdd_t *, qdd_edge_t);
+void qdd_gc (qdd_t *);
+
+QBOOL qdd_identity (qdd_t *, qdd_edge_t *);
+QBOOL qdd_from_gate (qdd_t *, const qgate_t *, const unsigned int *, qdd_edge_t *);
+QBOOL qdd_add (qdd_t *, qdd_edge_t, qdd_edge_t, qdd_edge_t *);
+QBOOL qdd_mul (qdd_t *, qdd_edge_t, qdd_edge_t, qdd_edge_t *);
+
+QCOMPLEX qdd_get (const qdd_t *, qdd_edge_t, uint64_t, uint64_t);
+void qdd_mul_vec (const qdd_t *, qdd_edge_t, const QCOMPLEX *, QCOMPLEX *);
+qsparse_t *qdd_to_sparse (const qdd_t *, qdd_edge_t);
+
+unsigned int qdd_count_nodes (qdd_t *, qdd_edge_t);
+size_t qdd_get_footprint (const qdd_t *);
+
+/* Circuit operators as decision diagrams */
+QBOOL qcircuit_build_dd (const qcircuit_t *, qdd_t *, qdd_edge_t *);
+QBOOL qcircuit_update_dd (qcircuit_t *);
+QBOOL qcircuit_apply_dd (qcircuit_t *, const qdd_t *, qdd_edge_t, const QCOMPLEX *);
+
+#endif /* _LIBQCIRCUIT_QDD_H */
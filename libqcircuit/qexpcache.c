@@ -0,0 +1,246 @@
+/*
+  qexpcache.c: Shared cache of expanded wiring matrices
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include "qcircuit.h"
+#include "qexpcache.h"
+
+static void
+qexpcache_entry_destroy (struct qexpcache_entry *entry)
+{
+  if (entry->sparse != NULL)
+    qsparse_destroy (entry->sparse);
+
+  if (entry->remap != NULL)
+    free (entry->remap);
+
+  free (entry);
+}
+
+qexpcache_t *
+qexpcache_new (size_t budget)
+{
+  qexpcache_t *new;
+
+  if ((new = calloc (1, sizeof (qexpcache_t))) == NULL)
+    return NULL;
+
+  new->budget = budget;
+
+  return new;
+}
+
+void
+qexpcache_destroy (qexpcache_t *cache)
+{
+  struct qexpcache_entry *this, *next;
+  unsigned int i;
+
+  for (i = 0; i < QEXPCACHE_BUCKETS; ++i)
+    for (this = cache->buckets[i]; this != NULL; this = next)
+    {
+      next = this->next;
+      qexpcache_entry_destroy (this);
+    }
+
+  free (cache);
+}
+
+/* FNV-1a over the key fields */
+static uint32_t
+qexpcache_hash (unsigned long serial, unsigned int order, unsigned int gate_order, const unsigned int *remap)
+{
+  uint32_t hash = 2166136261u;
+  unsigned int i;
+
+#define QEXPCACHE_MIX(x)    \
+  hash ^= (uint32_t) (x);   \
+  hash *= 16777619u;
+
+  QEXPCACHE_MIX (serial);
+  QEXPCACHE_MIX (serial >> 16 >> 16);
+  QEXPCACHE_MIX (order);
+
+  for (i = 0; i < gate_order; ++i)
+  {
+    QEXPCACHE_MIX (remap[i]);
+  }
+
+#undef QEXPCACHE_MIX
+
+  return hash;
+}
+
+static void
+qexpcache_lru_remove (qexpcache_t *cache, struct qexpcache_entry *entry)
+{
+  if (entry->lru_prev != NULL)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    cache->lru_head = entry->lru_next;
+
+  if (entry->lru_next != NULL)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    cache->lru_tail = entry->lru_prev;
+
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void
+qexpcache_lru_push (qexpcache_t *cache, struct qexpcache_entry *entry)
+{
+  entry->lru_prev = NULL;
+  entry->lru_next = cache->lru_head;
+
+  if (cache->lru_head != NULL)
+    cache->lru_head->lru_prev = entry;
+  else
+    cache->lru_tail = entry;
+
+  cache->lru_head = entry;
+}
+
+static void
+qexpcache_unlink (qexpcache_t *cache, struct qexpcache_entry *entry)
+{
+  struct qexpcache_entry **pp;
+
+  for (pp = &cache->buckets[entry->hash % QEXPCACHE_BUCKETS];
+       *pp != NULL;
+       pp = &(*pp)->next)
+    if (*pp == entry)
+    {
+      *pp = entry->next;
+      break;
+    }
+
+  cache->bytes -= entry->bytes;
+  --cache->entries;
+}
+
+static void
+qexpcache_trim (qexpcache_t *cache)
+{
+  struct qexpcache_entry *victim;
+
+  while (cache->bytes > cache->budget && (victim = cache->lru_tail) != NULL)
+  {
+    qexpcache_lru_remove (cache, victim);
+    qexpcache_unlink (cache, victim);
+    qexpcache_entry_destroy (victim);
+  }
+}
+
+void
+qexpcache_set_budget (qexpcache_t *cache, size_t budget)
+{
+  cache->budget = budget;
+
+  qexpcache_trim (cache);
+}
+
+/* Returns the expansion of gate to order through remap, creating it if
+ * needed. The returned matrix is valid until the entry is released.
+ */
+const qsparse_t *
+qexpcache_acquire (
+    qexpcache_t *cache,
+    const qgate_t *gate,
+    unsigned int order,
+    const unsigned int *remap,
+    struct qexpcache_entry **entryp)
+{
+  struct qexpcache_entry *entry;
+  uint32_t hash;
+  unsigned int i;
+
+  hash = qexpcache_hash (gate->serial, order, gate->order, remap);
+
+  for (entry = cache->buckets[hash % QEXPCACHE_BUCKETS];
+       entry != NULL;
+       entry = entry->next)
+    if (entry->hash       == hash          &&
+        entry->serial     == gate->serial  &&
+        entry->order      == order         &&
+        entry->gate_order == gate->order   &&
+        memcmp (entry->remap, remap, gate->order * sizeof (unsigned int)) == 0)
+    {
+      if (entry->refcount++ == 0)
+        qexpcache_lru_remove (cache, entry);
+
+      ++cache->hits;
+
+      *entryp = entry;
+
+      return entry->sparse;
+    }
+
+  ++cache->misses;
+
+  if ((entry = calloc (1, sizeof (struct qexpcache_entry))) == NULL ||
+      (entry->remap = malloc (gate->order * sizeof (unsigned int))) == NULL)
+  {
+    q_set_last_error ("qexpcache_acquire: memory exhausted");
+    goto fail;
+  }
+
+  for (i = 0; i < gate->order; ++i)
+    entry->remap[i] = remap[i];
+
+  if ((entry->sparse = qgate_expand (gate, order, remap)) == NULL)
+    goto fail;
+
+  entry->serial     = gate->serial;
+  entry->order      = order;
+  entry->gate_order = gate->order;
+  entry->hash       = hash;
+  entry->bytes      = qsparse_get_footprint (entry->sparse);
+  entry->refcount   = 1;
+
+  entry->next = cache->buckets[hash % QEXPCACHE_BUCKETS];
+  cache->buckets[hash % QEXPCACHE_BUCKETS] = entry;
+
+  cache->bytes += entry->bytes;
+  ++cache->entries;
+
+  /* Make room for the new entry */
+  qexpcache_trim (cache);
+
+  *entryp = entry;
+
+  return entry->sparse;
+
+fail:
+  if (entry != NULL)
+    qexpcache_entry_destroy (entry);
+
+  return NULL;
+}
+
+void
+qexpcache_release (qexpcache_t *cache, struct qexpcache_entry *entry)
+{
+  if (--entry->refcount == 0)
+  {
+    qexpcache_lru_push (cache, entry);
+    qexpcache_trim (cache);
+  }
+}
@@ -0,0 +1,83 @@
+/*
+  qexpcache.h: Shared cache of expanded wiring matrices
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _LIBQCIRCUIT_QEXPCACHE_H
+#define _LIBQCIRCUIT_QEXPCACHE_H
+
+#include <qsparse.h>
+
+#define QEXPCACHE_DEFAULT_BUDGET (64ul << 20) /* 64 MiB */
+#define QEXPCACHE_BUCKETS 1024
+
+struct qgate;
+
+/* An expansion of a gate (identified by its serial, so changing the
+ * coefficients of a gate never hits stale entries) to a circuit of a
+ * given order through a given remap.
+ */
+struct qexpcache_entry
+{
+  unsigned long serial;
+  unsigned int  order;
+  unsigned int  gate_order;
+  unsigned int *remap;
+  uint32_t      hash;
+
+  qsparse_t *sparse;
+  size_t     bytes;
+
+  unsigned int refcount;
+
+  struct qexpcache_entry *next; /* Bucket chain */
+
+  /* Entries with refcount == 0 are kept in the LRU list */
+  struct qexpcache_entry *lru_prev;
+  struct qexpcache_entry *lru_next;
+};
+
+/* Entries in use are never evicted. Unused entries are evicted in LRU
+ * order as soon as the total size exceeds the budget. Not thread safe.
+ */
+struct qexpcache
+{
+  struct qexpcache_entry *buckets[QEXPCACHE_BUCKETS];
+
+  size_t budget;
+  size_t bytes;
+
+  struct qexpcache_entry *lru_head; /* Most recently released */
+  struct qexpcache_entry *lru_tail;
+
+  unsigned int entries;
+  unsigned int hits;
+  unsigned int misses;
+};
+
+typedef struct qexpcache qexpcache_t;
+
+qexpcache_t *qexpcache_new (size_t);
+void qexpcache_destroy (qexpcache_t *);
+void qexpcache_set_budget (qexpcache_t *, size_t);
+
+const qsparse_t *qexpcache_acquire (qexpcache_t *, const struct qgate *, unsigned int, const unsigned int *, struct qexpcache_entry **);
+void qexpcache_release (qexpcache_t *, struct qexpcache_entry *);
+
+#endif /* _LIBQCIRCUIT_QEXPCACHE_H */
@@ -0,0 +1,364 @@
+/*
+  qexpect.c: Exact expectation values of observables
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "qexpect.h"
+#include "qmeasure.h"
+
+/* The state an expectation value is computed on: either the state
+ * vector of the circuit (physical qubits, only amplitudes compatible
+ * with the measured qubits count) or an expanded tableau or MPS state
+ * (logical qubits, already collapsed). */
+struct qexpect_source
+{
+  const QCOMPLEX *state;
+  QCOMPLEX *expanded;
+
+  uint64_t length;
+  uint64_t collapsed_mask;
+  uint64_t measure_result;
+  double norm; /* Of <psi|psi> */
+};
+
+struct qexpect_entry
+{
+  unsigned int row;
+  unsigned int col;
+  QCOMPLEX value;
+};
+
+static QBOOL
+qexpect_source_init (
+    struct qexpect_source *src,
+    const qcircuit_t *circuit,
+    const char *caller)
+{
+  if (!circuit->has_state)
+  {
+    q_set_last_error ("%s: no state has been computed", caller);
+    return Q_FALSE;
+  }
+
+  src->length = 1ull << circuit->order;
+
+  if (circuit->tableau != NULL || circuit->mps != NULL)
+  {
+    if ((src->expanded = qmeasure_expand_state (circuit, caller)) == NULL)
+      return Q_FALSE;
+
+    src->state          = src->expanded;
+    src->collapsed_mask = 0;
+    src->measure_result = 0;
+    src->norm           = 1;
+  }
+  else
+  {
+    src->expanded       = NULL;
+    src->state          = circuit->state;
+    src->collapsed_mask = circuit->collapsed_mask;
+    src->measure_result = circuit->measure_result;
+    src->norm           = circuit->collapsed_norm * circuit->collapsed_norm;
+  }
+
+  return Q_TRUE;
+}
+
+static void
+qexpect_source_finalize (struct qexpect_source *src)
+{
+  if (src->expanded != NULL)
+    free (src->expanded);
+}
+
+/* Logical qubits to the qubits of the source */
+static inline uint64_t
+qexpect_source_bits (
+    const struct qexpect_source *src,
+    const qcircuit_t *circuit,
+    uint64_t bits)
+{
+  return src->expanded != NULL ? bits : qcircuit_to_physical (circuit, bits);
+}
+
+static int
+qpauli_term_compare (const void *a, const void *b)
+{
+  const qpauli_term_t *t1 = *(const qpauli_term_t **) a;
+  const qpauli_term_t *t2 = *(const qpauli_term_t **) b;
+
+  if (t1->x < t2->x)
+    return -1;
+  else if (t1->x > t2->x)
+    return 1;
+
+  return 0;
+}
+
+/* One pass for all terms sharing the same X mask. Each term adds
+ * (-1)^|j & z| conj (psi[j ^ x]) psi[j] for every j, so the product is
+ * computed once and only its sign changes from term to term. */
+static void
+qexpect_pauli_group (
+    const struct qexpect_source *src,
+    uint64_t x,
+    const uint64_t *z,
+    unsigned int count,
+    QCOMPLEX *acc)
+{
+  uint64_t j;
+  unsigned int t;
+  QCOMPLEX v;
+
+  for (t = 0; t < count; ++t)
+    acc[t] = 0;
+
+  /* Pairs of amplitudes differing on a measured qubit: only one of
+   * them survives the collapse */
+  if (x & src->collapsed_mask)
+    return;
+
+  for (j = 0; j < src->length; ++j)
+    if ((j & src->collapsed_mask) == src->measure_result)
+    {
+      v = conj (src->state[j ^ x]) * src->state[j];
+
+      for (t = 0; t < count; ++t)
+        if (__builtin_parityll (j & z[t]))
+          acc[t] -= v;
+        else
+          acc[t] += v;
+    }
+}
+
+/* <psi|H|psi> for H the sum of count Pauli terms. The state is read
+ * once per distinct X mask. */
+QBOOL
+qcircuit_expect_pauli (
+    const qcircuit_t *circuit,
+    const qpauli_term_t *terms,
+    unsigned int count,
+    double *result)
+{
+  struct qexpect_source src;
+  const qpauli_term_t **sorted = NULL;
+  uint64_t *z = NULL;
+  QCOMPLEX *acc = NULL;
+  uint64_t x, valid;
+  unsigned int i, t, first;
+  double total = 0;
+  QBOOL ok = Q_FALSE;
+
+  valid = circuit->order < 64 ? (1ull << circuit->order) - 1 : ~0ull;
+
+  for (i = 0; i < count; ++i)
+    if (((terms[i].x | terms[i].z) & ~valid) != 0)
+    {
+      q_set_last_error (
+          "qcircuit_expect_pauli: term %d acts on qubits not in circuit `%s'",
+          i,
+          circuit->name);
+      return Q_FALSE;
+    }
+
+  if (!qexpect_source_init (&src, circuit, "qcircuit_expect_pauli"))
+    return Q_FALSE;
+
+  if (count > 0)
+  {
+    if ((sorted = malloc (count * sizeof (qpauli_term_t *))) == NULL)
+      goto fail;
+
+    if ((z = malloc (count * sizeof (uint64_t))) == NULL)
+      goto fail;
+
+    if ((acc = malloc (count * sizeof (QCOMPLEX))) == NULL)
+      goto fail;
+  }
+
+  for (i = 0; i < count; ++i)
+    sorted[i] = terms + i;
+
+  qsort (sorted, count, sizeof (qpauli_term_t *), qpauli_term_compare);
+
+  for (first = 0; first < count; first = i)
+  {
+    for (i = first; i < count && sorted[i]->x == sorted[first]->x; ++i)
+      z[i - first] = qexpect_source_bits (&src, circuit, sorted[i]->z);
+
+    x = qexpect_source_bits (&src, circuit, sorted[first]->x);
+
+    qexpect_pauli_group (&src, x, z, i - first, acc);
+
+    /* Each Y contributes a factor of i */
+    for (t = first; t < i; ++t)
+      switch (__builtin_popcountll (sorted[t]->x & sorted[t]->z) & 3)
+      {
+        case 0:
+          total += sorted[t]->coef * creal (acc[t - first]);
+          break;
+
+        case 1:
+          total -= sorted[t]->coef * cimag (acc[t - first]);
+          break;
+
+        case 2:
+          total -= sorted[t]->coef * creal (acc[t - first]);
+          break;
+
+        case 3:
+          total += sorted[t]->coef * cimag (acc[t - first]);
+          break;
+      }
+  }
+
+  *result = total * src.norm;
+
+  ok = Q_TRUE;
+
+  goto done;
+
+fail:
+  q_set_last_error ("qcircuit_expect_pauli: memory exhausted");
+
+done:
+  if (sorted != NULL)
+    free (sorted);
+
+  if (z != NULL)
+    free (z);
+
+  if (acc != NULL)
+    free (acc);
+
+  qexpect_source_finalize (&src);
+
+  return ok;
+}
+
+/* <psi|O|psi> for O acting on qubits remap[0], remap[1]... (as in
+ * qcircuit_wire). For every assignment of the remaining qubits, the
+ * amplitudes O acts on are gathered and multiplied by its nonzero
+ * entries, as qsparse_mul_vec would. */
+QBOOL
+qcircuit_expect_sparse (
+    const qcircuit_t *circuit,
+    const qsparse_t *observable,
+    const unsigned int *remap,
+    QCOMPLEX *result)
+{
+  struct qexpect_source src;
+  struct qexpect_entry *entries = NULL;
+  qsparse_iterator_t it;
+  uint64_t offsets[1 << QSPARSE_ORDER_MAX];
+  QCOMPLEX x[1 << QSPARSE_ORDER_MAX];
+  QBOOL compatible[1 << QSPARSE_ORDER_MAX];
+  uint64_t j, base, mask = 0, bases;
+  unsigned int i, b, n, length, count = 0;
+  QCOMPLEX acc = 0;
+  QBOOL ok = Q_FALSE;
+
+  length = QSPARSE_LENGTH (observable);
+
+  for (b = 0; b < observable->order; ++b)
+    if (remap[b] >= circuit->order || BITMAP_HAS_BIT (mask, remap[b]))
+    {
+      q_set_last_error (
+          "qcircuit_expect_sparse: invalid qubit %d for circuit `%s'",
+          remap[b],
+          circuit->name);
+      return Q_FALSE;
+    }
+    else
+      mask |= 1ull << remap[b];
+
+  if (!qexpect_source_init (&src, circuit, "qcircuit_expect_sparse"))
+    return Q_FALSE;
+
+  for (
+        qsparse_iterator_init (observable, &it);
+        !qsparse_iterator_end (&it);
+        qsparse_iterator_next (&it)
+        )
+    ++count;
+
+  if (count > 0 &&
+      (entries = malloc (count * sizeof (struct qexpect_entry))) == NULL)
+  {
+    q_set_last_error ("qcircuit_expect_sparse: memory exhausted");
+    goto done;
+  }
+
+  n = 0;
+
+  for (
+        qsparse_iterator_init (observable, &it);
+        !qsparse_iterator_end (&it);
+        qsparse_iterator_next (&it)
+        )
+  {
+    entries[n].row   = qsparse_iterator_row (&it);
+    entries[n].col   = qsparse_iterator_col (&it);
+    entries[n].value = qsparse_get_from_iterator (observable, &it);
+    ++n;
+  }
+
+  mask = qexpect_source_bits (&src, circuit, mask);
+
+  for (i = 0; i < length; ++i)
+  {
+    offsets[i] = 0;
+
+    for (b = 0; b < observable->order; ++b)
+      if (i & (1u << b))
+        offsets[i] |= qexpect_source_bits (&src, circuit, 1ull << remap[b]);
+
+    compatible[i] = (offsets[i] & src.collapsed_mask) ==
+        (src.measure_result & mask);
+  }
+
+  bases = src.length >> observable->order;
+
+  /* Enumerate indices with the qubits of mask cleared */
+  for (j = 0, base = 0; j < bases; ++j, base = ((base | mask) + 1) & ~mask)
+    if ((base & src.collapsed_mask & ~mask) ==
+        (src.measure_result & ~mask))
+    {
+      for (i = 0; i < length; ++i)
+        x[i] = compatible[i] ? src.state[base | offsets[i]] : 0;
+
+      for (i = 0; i < count; ++i)
+        acc += conj (x[entries[i].row]) * entries[i].value * x[entries[i].col];
+    }
+
+  *result = acc * src.norm;
+
+  ok = Q_TRUE;
+
+done:
+  if (entries != NULL)
+    free (entries);
+
+  qexpect_source_finalize (&src);
+
+  return ok;
+}
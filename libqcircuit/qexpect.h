@@ -0,0 +1,53 @@
+/*
+  qexpect.h: Exact expectation values of observables
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _LIBQCIRCUIT_QEXPECT_H
+#define _LIBQCIRCUIT_QEXPECT_H
+
+#include <qsparse.h>
+#include <stdint.h>
+
+#include "qcircuit.h"
+
+/* coef times the Pauli string with X on the (logical) qubits of x and Z
+ * on those of z. Qubits in both masks get Y. */
+struct qpauli_term
+{
+  uint64_t x;
+  uint64_t z;
+  double coef;
+};
+
+typedef struct qpauli_term qpauli_term_t;
+
+QBOOL qcircuit_expect_pauli (
+    const qcircuit_t *,
+    const qpauli_term_t *,
+    unsigned int,
+    double *);
+
+QBOOL qcircuit_expect_sparse (
+    const qcircuit_t *,
+    const qsparse_t *,
+    const unsigned int *,
+    QCOMPLEX *);
+
+#endif /* _LIBQCIRCUIT_QEXPECT_H */
@@ -0,0 +1,634 @@
+/*
+  qmeasure.c: Reusable measurement plans
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#ifdef __BMI2__
+#  include <immintrin.h>
+#endif
+
+#include "qmeasure.h"
+
+/* The following PRNG has been taken from Paul Hsieh's website at
+ * http://www.azillionmonkeys.com/qed/random.html
+ */
+
+#define RS_SCALE (1.0 / (1.0 + RAND_MAX))
+
+/* A non-overflowing average function */
+#define average2scomplement(x,y) ((x) & (y)) + (((x) ^ (y))/2)
+
+int
+randbiased (double x)
+{
+  double p;
+
+  for (;;)
+  {
+    p = rand () * RS_SCALE;
+
+    if (p >= x)
+      return 0;
+
+    if (p + RS_SCALE <= x)
+      return 1;
+    /* p < x < p+RS_SCALE */
+    x = (x - p) * (1.0 + RAND_MAX);
+  }
+
+  return 0; /* We will never get here */
+}
+
+unsigned int
+randslot (const struct qstate_info *slots, unsigned int n)
+{
+  double xhi;
+
+  /* Select a random range [x,x+RS_SCALE) */
+  double x = rand () * RS_SCALE;
+
+  /* Perform binary search to find the intersecting slot */
+  unsigned int hi = n - 2, lo = 0, mi, li;
+  while (hi > lo)
+  {
+    mi = average2scomplement (lo, hi);
+
+    if (x >= slots[mi].d)
+      lo = mi + 1;
+    else
+      hi = mi;
+  }
+
+  /* Taking slots[-1]=0.0, this is now true: slots[lo-1] <= x < slots[lo] */
+
+  /* If slots[lo-1] <= x < x+RS_SCALE <= slots[lo] then
+     any point in [x,x+RS_SCALE) is in [slots[lo-1],slots[lo]) */
+
+  if ((xhi = x + RS_SCALE) <= slots[lo].d)
+    return lo;
+
+  /* Otherwise x < slots[lo] < x+RS_SCALE */
+
+  for (;;)
+  {
+    /* x < slots[lo] < xhi */
+    if (randbiased ((slots[lo].d - x) / (xhi - x)))
+      return lo;
+
+    x = slots[lo].d;
+
+    lo++;
+
+    if (lo >= n - 1)
+      return n - 1;
+
+    /* slots[lo-1] = x <= xhi <= slots[lo] */
+    if (xhi <= slots[lo].d)
+        return lo;
+  }
+
+  /* We will never get here */
+  return 0;
+}
+
+void
+qmeasure_plan_destroy (qmeasure_plan_t *plan)
+{
+  if (plan->slots != NULL)
+    free (plan->slots);
+
+  free (plan);
+}
+
+/* Plan for the physical qubits of mask, standing for logical */
+static qmeasure_plan_t *
+qmeasure_plan_build (unsigned int circuit_order, uint64_t logical, uint64_t mask)
+{
+  qmeasure_plan_t *new;
+  unsigned int i, k, b, n;
+
+  if ((new = calloc (1, sizeof (qmeasure_plan_t))) == NULL)
+    goto fail;
+
+  new->circuit_order = circuit_order;
+  new->logical       = logical;
+  new->mask          = mask;
+
+  for (b = 0; b < 64; ++b)
+    if (BITMAP_HAS_BIT (new->mask, b))
+    {
+      if (new->order == QMEASURE_ORDER_MAX)
+      {
+        q_set_last_error (
+            "qmeasure_plan_new: too many qubits (at most %d)",
+            QMEASURE_ORDER_MAX);
+        qmeasure_plan_destroy (new);
+        return NULL;
+      }
+
+      /* Outcome bit new->order comes from bit b of the amplitude index */
+      for (i = 0; i < 256; ++i)
+        if (i & (1 << (b & 7)))
+          new->gather[b >> 3][i] |= 1u << new->order;
+
+      new->bytes = (b >> 3) + 1;
+
+      ++new->order;
+    }
+
+  n = 1u << new->order;
+
+  if ((new->slots = calloc (n, sizeof (struct qstate_info))) == NULL)
+    goto fail;
+
+  for (i = 0; i < n; ++i)
+    for (b = 0, k = 0; b < 64; ++b)
+      if (BITMAP_HAS_BIT (new->mask, b))
+        if (BITMAP_HAS_BIT (i, k++))
+          new->slots[i].i |= 1ull << b;
+
+  return new;
+
+fail:
+  if (new != NULL)
+    qmeasure_plan_destroy (new);
+
+  q_set_last_error ("qmeasure_plan_new: memory exhausted");
+
+  return NULL;
+}
+
+/* Measure the (logical) qubits of mask. The plan stays valid as long as
+ * the circuit keeps its order and qubit layout. */
+qmeasure_plan_t *
+qmeasure_plan_new (const qcircuit_t *circuit, uint64_t mask)
+{
+  if (mask == 0 ||
+      (circuit->order < 64 && (mask >> circuit->order) != 0))
+  {
+    q_set_last_error ("qmeasure_plan_new: invalid qubit mask");
+    return NULL;
+  }
+
+  return qmeasure_plan_build (
+      circuit->order,
+      mask,
+      qcircuit_to_physical (circuit, mask));
+}
+
+static inline unsigned int
+qmeasure_plan_outcome (const qmeasure_plan_t *plan, uint64_t index)
+{
+#ifdef __BMI2__
+  return _pext_u64 (index, plan->mask);
+#else
+  unsigned int k, outcome = 0;
+
+  for (k = 0; k < plan->bytes; ++k)
+    outcome |= plan->gather[k][(index >> (k << 3)) & 0xff];
+
+  return outcome;
+#endif
+}
+
+/* Sum of |x[i]|^2. Independent partial sums over the real and
+ * imaginary parts let the compiler vectorize this. */
+static inline double
+qmeasure_norm (const QCOMPLEX *x, uint64_t n)
+{
+  const double *d = (const double *) x;
+  double acc[4] = {0, 0, 0, 0};
+  uint64_t i;
+
+  n <<= 1;
+
+  for (i = 0; i + 4 <= n; i += 4)
+  {
+    acc[0] += d[i] * d[i];
+    acc[1] += d[i + 1] * d[i + 1];
+    acc[2] += d[i + 2] * d[i + 2];
+    acc[3] += d[i + 3] * d[i + 3];
+  }
+
+  for (; i < n; ++i)
+    acc[0] += d[i] * d[i];
+
+  return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+/* Probability (not normalized) of each outcome of the plan, among the
+ * amplitudes of state compatible with the collapsed qubits. This is a
+ * single sequential pass: amplitudes come in runs of consecutive indices
+ * sharing their measured (and previously collapsed) qubits, and each run
+ * is added to the probability of its outcome. Returns the total. */
+static double
+qmeasure_plan_accumulate (
+    qmeasure_plan_t *plan,
+    const QCOMPLEX *state,
+    uint64_t collapsed_mask,
+    uint64_t measure_result)
+{
+  uint64_t j, k, length, fixed, run, low_mask, low_result;
+  unsigned int i, n, high;
+  double total = 0;
+
+  n      = 1u << plan->order;
+  length = 1ull << plan->circuit_order;
+
+  for (i = 0; i < n; ++i)
+    plan->slots[i].p = 0;
+
+  fixed = plan->mask | collapsed_mask;
+  run   = fixed & -fixed;
+
+  if (run >= QMEASURE_RUN_MIN)
+  {
+    for (j = 0; j < length; j += run)
+      if ((j & collapsed_mask) == measure_result)
+        plan->slots[qmeasure_plan_outcome (plan, j)].p +=
+            qmeasure_norm (state + j, run);
+  }
+  else
+  {
+    /* Low qubits are measured: outcomes change within each group of
+     * 256 amplitudes, but the bits above them only once per group */
+    low_mask   = collapsed_mask & 0xff;
+    low_result = measure_result & 0xff;
+
+    for (j = 0; j < length; j += 256)
+      if ((j & collapsed_mask) == (measure_result & ~0xffull))
+      {
+        high = qmeasure_plan_outcome (plan, j);
+
+        for (k = 0; k < 256 && j + k < length; ++k)
+          if ((k & low_mask) == low_result)
+            plan->slots[high | plan->gather[0][k]].p +=
+                creal (state[j + k]) * creal (state[j + k]) +
+                cimag (state[j + k]) * cimag (state[j + k]);
+      }
+  }
+
+  for (i = 0; i < n; ++i)
+    total += plan->slots[i].p;
+
+  return total;
+}
+
+/* Collapse the state vector of circuit on the qubits of the plan */
+QBOOL
+qmeasure_plan_apply (qmeasure_plan_t *plan, qcircuit_t *circuit)
+{
+  unsigned int i, n, slot;
+  double total;
+
+  n     = 1u << plan->order;
+  total = qmeasure_plan_accumulate (
+      plan,
+      circuit->state,
+      circuit->collapsed_mask,
+      circuit->measure_result);
+
+  if (!(total > 0))
+  {
+    q_set_last_error ("qcircuit_collapse: null state");
+    return Q_FALSE;
+  }
+
+  /* Normalize probabilities. The distribution is exactly 1 from the
+   * last possible outcome on. */
+  for (i = 0; i < n; ++i)
+  {
+    plan->slots[i].p /= total;
+    plan->slots[i].d  = plan->slots[i].p;
+
+    if (i > 0)
+      plan->slots[i].d += plan->slots[i - 1].d;
+  }
+
+  for (i = n; i-- > 0 && plan->slots[i].p == 0;)
+    plan->slots[i].d = 1;
+
+  if (i < n)
+    plan->slots[i].d = 1;
+
+  slot = randslot (plan->slots, n);
+
+  /* Rounding may still land on an impossible outcome */
+  while (plan->slots[slot].p == 0)
+    slot = slot > 0 ? slot - 1 : i;
+
+  circuit->measure_result  = (circuit->measure_result & ~plan->mask) |
+      plan->slots[slot].i;
+  circuit->collapsed_mask |= plan->mask;
+  circuit->collapsed_norm /= sqrt (plan->slots[slot].p);
+
+  return Q_TRUE;
+}
+
+/* Like qcircuit_collapse on the qubits of the plan */
+QBOOL
+qcircuit_collapse_plan (qcircuit_t *circuit, qmeasure_plan_t *plan, unsigned int *measure)
+{
+  if (!circuit->has_state)
+  {
+    q_set_last_error ("qcircuit_collapse: no state has been computed");
+    return Q_FALSE;
+  }
+
+  if (plan->circuit_order != circuit->order ||
+      qcircuit_to_physical (circuit, plan->logical) != plan->mask)
+  {
+    q_set_last_error (
+        "qcircuit_collapse: measurement plan out of date for circuit `%s'",
+        circuit->name);
+    return Q_FALSE;
+  }
+
+  if (circuit->tableau != NULL || circuit->mps != NULL)
+    return qcircuit_collapse (circuit, plan->logical, measure);
+
+  if (plan->mask & ~circuit->collapsed_mask)
+    if (!qmeasure_plan_apply (plan, circuit))
+      return Q_FALSE;
+
+  *measure = qcircuit_to_logical (circuit, circuit->measure_result & plan->mask);
+
+  return Q_TRUE;
+}
+
+/* Tableau and MPS states are expanded to a temporary (logical) state
+ * vector, where measured qubits are already collapsed */
+QCOMPLEX *
+qmeasure_expand_state (const qcircuit_t *circuit, const char *caller)
+{
+  QCOMPLEX *state;
+
+  if (circuit->order > QCIRCUIT_STATE_ORDER_MAX)
+  {
+    q_set_last_error (
+        "%s: circuit `%s' too big for a state vector",
+        caller,
+        circuit->name);
+    return NULL;
+  }
+
+  if ((state = malloc ((1ull << circuit->order) * sizeof (QCOMPLEX))) == NULL)
+  {
+    q_set_last_error ("%s: memory exhausted", caller);
+    return NULL;
+  }
+
+  if (!qcircuit_get_state (circuit, state))
+  {
+    free (state);
+    return NULL;
+  }
+
+  return state;
+}
+
+/* Exact probabilities of every outcome of the (logical) qubits of mask,
+ * given the qubits measured so far. Bit k of the index of out is the
+ * k-th qubit of mask, so out must hold 1 << popcount (mask) elements. The
+ * state is not collapsed and no random number is drawn. */
+QBOOL
+qcircuit_get_probabilities (
+    const qcircuit_t *circuit,
+    uint64_t mask,
+    double *out)
+{
+  qmeasure_plan_t *plan = NULL;
+  QCOMPLEX *expanded = NULL;
+  unsigned int perm[QMEASURE_ORDER_MAX];
+  unsigned int i, k, b, n, index;
+  double total;
+  QBOOL ok = Q_FALSE;
+
+  if (!circuit->has_state)
+  {
+    q_set_last_error ("qcircuit_get_probabilities: no state has been computed");
+    return Q_FALSE;
+  }
+
+  if (mask == 0 ||
+      (circuit->order < 64 && (mask >> circuit->order) != 0))
+  {
+    q_set_last_error ("qcircuit_get_probabilities: invalid qubit mask");
+    return Q_FALSE;
+  }
+
+  if (circuit->tableau != NULL || circuit->mps != NULL)
+  {
+    if ((expanded = qmeasure_expand_state (
+             circuit,
+             "qcircuit_get_probabilities")) == NULL)
+      goto done;
+
+    if ((plan = qmeasure_plan_build (circuit->order, mask, mask)) == NULL)
+      goto done;
+
+    total = qmeasure_plan_accumulate (plan, expanded, 0, 0);
+  }
+  else
+  {
+    if ((plan = qmeasure_plan_new (circuit, mask)) == NULL)
+      goto done;
+
+    total = qmeasure_plan_accumulate (
+        plan,
+        circuit->state,
+        circuit->collapsed_mask,
+        circuit->measure_result);
+  }
+
+  if (!(total > 0))
+  {
+    q_set_last_error ("qcircuit_get_probabilities: null state");
+    goto done;
+  }
+
+  n = 1u << plan->order;
+
+  /* The expanded state is already in logical order */
+  if (expanded != NULL || circuit->layout == NULL)
+  {
+    for (i = 0; i < n; ++i)
+      out[i] = plan->slots[i].p / total;
+  }
+  else
+  {
+    /* Outcome bits follow the physical qubits: perm[k] is the outcome
+     * bit of the k-th logical qubit of mask */
+    for (b = 0, k = 0; b < 64; ++b)
+      if (BITMAP_HAS_BIT (mask, b))
+      {
+        perm[k] = __builtin_popcountll (
+            plan->mask & (qcircuit_to_physical (circuit, 1ull << b) - 1));
+        ++k;
+      }
+
+    for (i = 0; i < n; ++i)
+    {
+      for (k = 0, index = 0; k < plan->order; ++k)
+        if (i & (1u << perm[k]))
+          index |= 1u << k;
+
+      out[index] = plan->slots[i].p / total;
+    }
+  }
+
+  ok = Q_TRUE;
+
+done:
+  if (plan != NULL)
+    qmeasure_plan_destroy (plan);
+
+  if (expanded != NULL)
+    free (expanded);
+
+  return ok;
+}
+
+/* Probability of each qubit being 1, in acc[physical qubit]. Amplitudes
+ * are summed in groups of 256: the low 8 qubits are kept per position
+ * within the group, and the rest are added once per group. */
+static double
+qmeasure_marginals (
+    const QCOMPLEX *state,
+    unsigned int order,
+    uint64_t collapsed_mask,
+    uint64_t measure_result,
+    double *acc)
+{
+  double low[256];
+  uint64_t j, k, bits, length, group, low_mask, low_result;
+  unsigned int b;
+  double w, sum, total = 0;
+
+  length = 1ull << order;
+  group  = length < 256 ? length : 256;
+
+  low_mask   = collapsed_mask & 0xff;
+  low_result = measure_result & 0xff;
+
+  for (k = 0; k < group; ++k)
+    low[k] = 0;
+
+  for (b = 0; b < order; ++b)
+    acc[b] = 0;
+
+  for (j = 0; j < length; j += group)
+    if ((j & collapsed_mask) == (measure_result & ~0xffull))
+    {
+      if (low_mask == 0)
+      {
+        for (k = 0; k < group; ++k)
+          low[k] += creal (state[j + k]) * creal (state[j + k]) +
+              cimag (state[j + k]) * cimag (state[j + k]);
+
+        sum = qmeasure_norm (state + j, group);
+      }
+      else
+      {
+        sum = 0;
+
+        for (k = 0; k < group; ++k)
+          if ((k & low_mask) == low_result)
+          {
+            w = creal (state[j + k]) * creal (state[j + k]) +
+                cimag (state[j + k]) * cimag (state[j + k]);
+            low[k] += w;
+            sum    += w;
+          }
+      }
+
+      total += sum;
+
+      for (bits = j >> 8, b = 8; bits != 0; bits >>= 1, ++b)
+        if (bits & 1)
+          acc[b] += sum;
+    }
+
+  for (k = 0; k < group; ++k)
+    for (b = 0; b < 8 && b < order; ++b)
+      if (k & (1u << b))
+        acc[b] += low[k];
+
+  return total;
+}
+
+/* Probability of measuring 1 on each logical qubit, given the qubits
+ * measured so far, in one pass. p1 must hold one element per qubit. */
+QBOOL
+qcircuit_get_marginals (const qcircuit_t *circuit, double *p1)
+{
+  QCOMPLEX *expanded = NULL;
+  double acc[64];
+  double total;
+  unsigned int i;
+  QBOOL ok = Q_FALSE;
+
+  if (!circuit->has_state)
+  {
+    q_set_last_error ("qcircuit_get_marginals: no state has been computed");
+    return Q_FALSE;
+  }
+
+  if (circuit->tableau != NULL || circuit->mps != NULL)
+  {
+    if ((expanded = qmeasure_expand_state (
+             circuit,
+             "qcircuit_get_marginals")) == NULL)
+      return Q_FALSE;
+
+    total = qmeasure_marginals (expanded, circuit->order, 0, 0, acc);
+  }
+  else
+    total = qmeasure_marginals (
+        circuit->state,
+        circuit->order,
+        circuit->collapsed_mask,
+        circuit->measure_result,
+        acc);
+
+  if (!(total > 0))
+  {
+    q_set_last_error ("qcircuit_get_marginals: null state");
+    goto done;
+  }
+
+  /* The expanded state is already in logical order */
+  for (i = 0; i < circuit->order; ++i)
+    if (expanded != NULL || circuit->layout == NULL)
+      p1[i] = acc[i] / total;
+    else
+      p1[i] = acc[circuit->layout[i]] / total;
+
+  ok = Q_TRUE;
+
+done:
+  if (expanded != NULL)
+    free (expanded);
+
+  return ok;
+}
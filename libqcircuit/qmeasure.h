@@ -0,0 +1,71 @@
+/*
+  qmeasure.h: Reusable measurement plans
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _LIBQCIRCUIT_QMEASURE_H
+#define _LIBQCIRCUIT_QMEASURE_H
+
+#include <stdint.h>
+
+#include "qcircuit.h"
+
+/* At most this many qubits per plan. Bigger masks are measured in
+ * groups of this size, one after the other. */
+#define QMEASURE_ORDER_MAX 20
+
+/* Runs of amplitudes sharing their outcome shorter than this (that is,
+ * qubits below the 4th are measured) are handled byte by byte */
+#define QMEASURE_RUN_MIN 16
+
+struct qstate_info
+{
+  uint64_t i;
+  double p; /* Density function */
+  double d; /* Distribution function */
+};
+
+/* Everything needed to measure a set of qubits of a state vector,
+ * computed once. The outcome of amplitude j is the concatenation of
+ * gather[k][byte k of j] (or pext (j, mask) on BMI2 hardware), and
+ * slots[outcome].i are the qubits it stands for. */
+struct qmeasure_plan
+{
+  unsigned int circuit_order;
+  uint64_t logical; /* Measured qubits, as requested */
+  uint64_t mask;    /* Same, in physical qubits */
+
+  unsigned int order; /* Number of measured qubits */
+  struct qstate_info *slots; /* 1 << order */
+
+  unsigned int bytes; /* Gather tables in use */
+  uint32_t gather[8][256];
+};
+
+typedef struct qmeasure_plan qmeasure_plan_t;
+
+qmeasure_plan_t *qmeasure_plan_new (const qcircuit_t *, uint64_t);
+void qmeasure_plan_destroy (qmeasure_plan_t *);
+QBOOL qmeasure_plan_apply (qmeasure_plan_t *, qcircuit_t *);
+
+QCOMPLEX *qmeasure_expand_state (const qcircuit_t *, const char *);
+
+QBOOL qcircuit_collapse_plan (qcircuit_t *, qmeasure_plan_t *, unsigned int *);
+
+#endif /* _LIBQCIRCUIT_QMEASURE_H */
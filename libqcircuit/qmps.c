@@ -0,0 +1,873 @@
+/*
+  qmps.c: Matrix product state simulation
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "qcircuit.h"
+#include "qmps.h"
+
+/************************************ SVD **********************************/
+struct qmps_sv
+{
+  unsigned int j;
+  double s;
+};
+
+static int
+qmps_sv_cmp (const void *a, const void *b)
+{
+  const struct qmps_sv *sa = (const struct qmps_sv *) a;
+  const struct qmps_sv *sb = (const struct qmps_sv *) b;
+
+  if (sa->s != sb->s)
+    return sa->s > sb->s ? -1 : 1;
+
+  return (int) sa->j - (int) sb->j;
+}
+
+/* m = u diag (s) v^dagger, where m is rows x cols (row major) and
+ * k = min (rows, cols). u is rows x k, v is cols x k and s is sorted in
+ * decreasing order. The columns of m are orthogonalized with complex
+ * Jacobi rotations (Hestenes' method), which are accumulated in v. */
+static QBOOL
+qmps_svd (
+    const QCOMPLEX *m,
+    unsigned int rows,
+    unsigned int cols,
+    QCOMPLEX *u,
+    double *s,
+    QCOMPLEX *v)
+{
+  QCOMPLEX *a = NULL, *w = NULL, *mh = NULL;
+  struct qmps_sv *sv = NULL;
+  QCOMPLEX gamma, phase, ap, bq;
+  double alpha, beta, g, zeta, t, c, sn;
+  unsigned int i, j, p, q, sweep;
+  QBOOL rotated, ok = Q_FALSE;
+
+  /* Work on the smaller side: m^dagger = v s u^dagger */
+  if (cols > rows)
+  {
+    if ((mh = malloc (rows * cols * sizeof (QCOMPLEX))) == NULL)
+      goto done;
+
+    for (i = 0; i < rows; ++i)
+      for (j = 0; j < cols; ++j)
+        mh[j * rows + i] = conj (m[i * cols + j]);
+
+    ok = qmps_svd (mh, cols, rows, v, s, u);
+
+    goto done;
+  }
+
+  if ((a = malloc (rows * cols * sizeof (QCOMPLEX))) == NULL)
+    goto done;
+
+  if ((w = calloc (cols * cols, sizeof (QCOMPLEX))) == NULL)
+    goto done;
+
+  if ((sv = malloc (cols * sizeof (struct qmps_sv))) == NULL)
+    goto done;
+
+  memcpy (a, m, rows * cols * sizeof (QCOMPLEX));
+
+  for (j = 0; j < cols; ++j)
+    w[j * cols + j] = 1;
+
+  for (sweep = 0; sweep < QMPS_SVD_SWEEPS_MAX; ++sweep)
+  {
+    rotated = Q_FALSE;
+
+    for (p = 0; p < cols; ++p)
+      for (q = p + 1; q < cols; ++q)
+      {
+        alpha = beta = 0;
+        gamma = 0;
+
+        for (i = 0; i < rows; ++i)
+        {
+          alpha += creal (a[i * cols + p] * conj (a[i * cols + p]));
+          beta  += creal (a[i * cols + q] * conj (a[i * cols + q]));
+          gamma += conj (a[i * cols + p]) * a[i * cols + q];
+        }
+
+        g = cabs (gamma);
+
+        if (g == 0 || g <= QMPS_SVD_EPSILON * sqrt (alpha * beta))
+          continue;
+
+        rotated = Q_TRUE;
+
+        /* Rephase column q so that the problem becomes real */
+        phase = gamma / g;
+        zeta  = (beta - alpha) / (2 * g);
+        t     = (zeta >= 0 ? 1 : -1) / (fabs (zeta) + sqrt (1 + zeta * zeta));
+        c     = 1 / sqrt (1 + t * t);
+        sn    = c * t;
+
+        for (i = 0; i < rows; ++i)
+        {
+          ap = a[i * cols + p];
+          bq = a[i * cols + q] * conj (phase);
+
+          a[i * cols + p] = c * ap - sn * bq;
+          a[i * cols + q] = (sn * ap + c * bq) * phase;
+        }
+
+        for (i = 0; i < cols; ++i)
+        {
+          ap = w[i * cols + p];
+          bq = w[i * cols + q] * conj (phase);
+
+          w[i * cols + p] = c * ap - sn * bq;
+          w[i * cols + q] = (sn * ap + c * bq) * phase;
+        }
+      }
+
+    if (!rotated)
+      break;
+  }
+
+  for (j = 0; j < cols; ++j)
+  {
+    sv[j].j = j;
+    sv[j].s = 0;
+
+    for (i = 0; i < rows; ++i)
+      sv[j].s += creal (a[i * cols + j] * conj (a[i * cols + j]));
+
+    sv[j].s = sqrt (sv[j].s);
+  }
+
+  qsort (sv, cols, sizeof (struct qmps_sv), qmps_sv_cmp);
+
+  for (j = 0; j < cols; ++j)
+  {
+    s[j] = sv[j].s;
+
+    for (i = 0; i < rows; ++i)
+      u[i * cols + j] = s[j] > 0 ? a[i * cols + sv[j].j] / s[j] : 0;
+
+    for (i = 0; i < cols; ++i)
+      v[i * cols + j] = w[i * cols + sv[j].j];
+  }
+
+  ok = Q_TRUE;
+
+done:
+  if (mh != NULL)
+    free (mh);
+
+  if (a != NULL)
+    free (a);
+
+  if (w != NULL)
+    free (w);
+
+  if (sv != NULL)
+    free (sv);
+
+  if (!ok)
+    q_set_last_error ("qmps_svd: memory exhausted");
+
+  return ok;
+}
+
+/****************************** State handling *****************************/
+void
+qmps_destroy (qmps_t *mps)
+{
+  unsigned int i;
+
+  if (mps->site != NULL)
+  {
+    for (i = 0; i < mps->order; ++i)
+      if (mps->site[i] != NULL)
+        free (mps->site[i]);
+
+    free (mps->site);
+  }
+
+  if (mps->bond != NULL)
+    free (mps->bond);
+
+  free (mps);
+}
+
+/* |0...0>, a product state: all bonds are 1 */
+qmps_t *
+qmps_new (unsigned int order, unsigned int bond_max, double threshold)
+{
+  qmps_t *new;
+  unsigned int i;
+
+  if ((new = calloc (1, sizeof (qmps_t))) == NULL)
+    goto fail;
+
+  new->order     = order;
+  new->bond_max  = bond_max > 0 ? bond_max : 1;
+  new->threshold = threshold;
+
+  if ((new->bond = malloc ((order + 1) * sizeof (unsigned int))) == NULL)
+    goto fail;
+
+  if ((new->site = calloc (order, sizeof (QCOMPLEX *))) == NULL)
+    goto fail;
+
+  for (i = 0; i <= order; ++i)
+    new->bond[i] = 1;
+
+  for (i = 0; i < order; ++i)
+  {
+    if ((new->site[i] = calloc (2, sizeof (QCOMPLEX))) == NULL)
+      goto fail;
+
+    new->site[i][0] = 1;
+  }
+
+  return new;
+
+fail:
+  if (new != NULL)
+    qmps_destroy (new);
+
+  q_set_last_error ("qmps_new: memory exhausted");
+
+  return NULL;
+}
+
+static inline unsigned int
+qmps_site_length (const qmps_t *mps, unsigned int i)
+{
+  return mps->bond[i] * 2 * mps->bond[i + 1];
+}
+
+/* Both states must have the same order */
+QBOOL
+qmps_copy (qmps_t *dest, const qmps_t *src)
+{
+  QCOMPLEX *site;
+  unsigned int i, length;
+
+  for (i = 0; i < src->order; ++i)
+  {
+    length = qmps_site_length (src, i);
+
+    if ((site = realloc (dest->site[i], length * sizeof (QCOMPLEX))) == NULL)
+    {
+      q_set_last_error ("qmps_copy: memory exhausted");
+      return Q_FALSE;
+    }
+
+    dest->site[i] = site;
+
+    memcpy (dest->site[i], src->site[i], length * sizeof (QCOMPLEX));
+  }
+
+  memcpy (dest->bond, src->bond, (src->order + 1) * sizeof (unsigned int));
+
+  dest->bond_max  = src->bond_max;
+  dest->threshold = src->threshold;
+  dest->error     = src->error;
+  dest->center    = src->center;
+
+  return Q_TRUE;
+}
+
+unsigned int
+qmps_get_bond_max (const qmps_t *mps)
+{
+  unsigned int i, max = 1;
+
+  for (i = 1; i < mps->order; ++i)
+    if (mps->bond[i] > max)
+      max = mps->bond[i];
+
+  return max;
+}
+
+/* Move the orthogonality center one site right: site[c] = u becomes
+ * left-canonical and s v^dagger is absorbed by site[c + 1] */
+static QBOOL
+qmps_move_right (qmps_t *mps)
+{
+  QCOMPLEX *u = NULL, *v = NULL, *next = NULL;
+  double *s = NULL;
+  unsigned int c, l, r, r2, k, j, m, x;
+  QBOOL ok = Q_FALSE;
+
+  c  = mps->center;
+  l  = mps->bond[c];
+  r  = mps->bond[c + 1];
+  r2 = mps->bond[c + 2];
+  k  = 2 * l < r ? 2 * l : r;
+
+  if ((u = malloc (2 * l * k * sizeof (QCOMPLEX))) == NULL ||
+      (v = malloc (r * k * sizeof (QCOMPLEX))) == NULL ||
+      (s = malloc (k * sizeof (double))) == NULL ||
+      (next = calloc (k * 2 * r2, sizeof (QCOMPLEX))) == NULL)
+  {
+    q_set_last_error ("qmps_move_right: memory exhausted");
+    goto done;
+  }
+
+  if (!qmps_svd (mps->site[c], 2 * l, r, u, s, v))
+    goto done;
+
+  /* next[j, x] = s_j sum_m conj (v[m, j]) site[c + 1][m, x] */
+  for (j = 0; j < k; ++j)
+    for (m = 0; m < r; ++m)
+      for (x = 0; x < 2 * r2; ++x)
+        next[j * 2 * r2 + x] +=
+          s[j] * conj (v[m * k + j]) * mps->site[c + 1][m * 2 * r2 + x];
+
+  free (mps->site[c]);
+  free (mps->site[c + 1]);
+
+  mps->site[c]     = u;
+  mps->site[c + 1] = next;
+  mps->bond[c + 1] = k;
+  mps->center      = c + 1;
+
+  u    = NULL;
+  next = NULL;
+
+  ok = Q_TRUE;
+
+done:
+  if (u != NULL)
+    free (u);
+
+  if (v != NULL)
+    free (v);
+
+  if (s != NULL)
+    free (s);
+
+  if (next != NULL)
+    free (next);
+
+  return ok;
+}
+
+/* Move the orthogonality center one site left: site[c] = v^dagger
+ * becomes right-canonical and u s is absorbed by site[c - 1] */
+static QBOOL
+qmps_move_left (qmps_t *mps)
+{
+  QCOMPLEX *u = NULL, *v = NULL, *this = NULL, *prev = NULL;
+  double *s = NULL;
+  unsigned int c, l, l2, r, k, j, m, x;
+  QBOOL ok = Q_FALSE;
+
+  c  = mps->center;
+  l2 = mps->bond[c - 1];
+  l  = mps->bond[c];
+  r  = mps->bond[c + 1];
+  k  = l < 2 * r ? l : 2 * r;
+
+  if ((u = malloc (l * k * sizeof (QCOMPLEX))) == NULL ||
+      (v = malloc (2 * r * k * sizeof (QCOMPLEX))) == NULL ||
+      (s = malloc (k * sizeof (double))) == NULL ||
+      (this = malloc (k * 2 * r * sizeof (QCOMPLEX))) == NULL ||
+      (prev = calloc (l2 * 2 * k, sizeof (QCOMPLEX))) == NULL)
+  {
+    q_set_last_error ("qmps_move_left: memory exhausted");
+    goto done;
+  }
+
+  if (!qmps_svd (mps->site[c], l, 2 * r, u, s, v))
+    goto done;
+
+  for (j = 0; j < k; ++j)
+    for (x = 0; x < 2 * r; ++x)
+      this[j * 2 * r + x] = conj (v[x * k + j]);
+
+  /* prev[x, j] = sum_m site[c - 1][x, m] u[m, j] s_j */
+  for (x = 0; x < 2 * l2; ++x)
+    for (m = 0; m < l; ++m)
+      for (j = 0; j < k; ++j)
+        prev[x * k + j] += mps->site[c - 1][x * l + m] * u[m * k + j] * s[j];
+
+  free (mps->site[c]);
+  free (mps->site[c - 1]);
+
+  mps->site[c]     = this;
+  mps->site[c - 1] = prev;
+  mps->bond[c]     = k;
+  mps->center      = c - 1;
+
+  this = NULL;
+  prev = NULL;
+
+  ok = Q_TRUE;
+
+done:
+  if (u != NULL)
+    free (u);
+
+  if (v != NULL)
+    free (v);
+
+  if (s != NULL)
+    free (s);
+
+  if (this != NULL)
+    free (this);
+
+  if (prev != NULL)
+    free (prev);
+
+  return ok;
+}
+
+static QBOOL
+qmps_move_center (qmps_t *mps, unsigned int site)
+{
+  while (mps->center < site)
+    if (!qmps_move_right (mps))
+      return Q_FALSE;
+
+  while (mps->center > site)
+    if (!qmps_move_left (mps))
+      return Q_FALSE;
+
+  return Q_TRUE;
+}
+
+/* Number of singular values to keep: at most bond_max, dropping the
+ * smallest ones while the discarded weight stays within the threshold.
+ * The kept ones are rescaled to preserve the norm. */
+static unsigned int
+qmps_truncate (qmps_t *mps, double *s, unsigned int k)
+{
+  double total = 0, discarded = 0, scale;
+  unsigned int j, keep;
+
+  for (j = 0; j < k; ++j)
+    total += s[j] * s[j];
+
+  keep = k < mps->bond_max ? k : mps->bond_max;
+
+  for (j = keep; j < k; ++j)
+    discarded += s[j] * s[j];
+
+  while (keep > 1 &&
+         (s[keep - 1] == 0 ||
+          discarded + s[keep - 1] * s[keep - 1] <= mps->threshold * total))
+  {
+    --keep;
+    discarded += s[keep] * s[keep];
+  }
+
+  if (total > 0 && discarded > 0)
+  {
+    mps->error += discarded / total;
+
+    scale = sqrt (total / (total - discarded));
+
+    for (j = 0; j < keep; ++j)
+      s[j] *= scale;
+  }
+
+  return keep;
+}
+
+/*********************************** Gates *********************************/
+void
+qmps_apply_x (qmps_t *mps, unsigned int qubit)
+{
+  unsigned int l, r, rr;
+  QCOMPLEX *site, tmp;
+
+  site = mps->site[qubit];
+  r    = mps->bond[qubit + 1];
+
+  for (l = 0; l < mps->bond[qubit]; ++l)
+    for (rr = 0; rr < r; ++rr)
+    {
+      tmp = site[(l * 2) * r + rr];
+
+      site[(l * 2) * r + rr]     = site[(l * 2 + 1) * r + rr];
+      site[(l * 2 + 1) * r + rr] = tmp;
+    }
+}
+
+/* Single qubit gates keep the canonical form */
+void
+qmps_apply_1 (qmps_t *mps, unsigned int qubit, const QCOMPLEX *u)
+{
+  unsigned int l, r, rr;
+  QCOMPLEX *site, v0, v1;
+
+  site = mps->site[qubit];
+  r    = mps->bond[qubit + 1];
+
+  for (l = 0; l < mps->bond[qubit]; ++l)
+    for (rr = 0; rr < r; ++rr)
+    {
+      v0 = site[(l * 2) * r + rr];
+      v1 = site[(l * 2 + 1) * r + rr];
+
+      site[(l * 2) * r + rr]     = u[0] * v0 + u[1] * v1;
+      site[(l * 2 + 1) * r + rr] = u[2] * v0 + u[3] * v1;
+    }
+}
+
+/* Gate on sites p (bit 0 of u) and p + 1 (bit 1). The two sites are
+ * contracted, the gate applied and the result split back by SVD,
+ * leaving the center on p + 1. */
+static QBOOL
+qmps_apply_pair (qmps_t *mps, unsigned int p, const QCOMPLEX *u)
+{
+  QCOMPLEX *theta = NULL, *gated = NULL, *left = NULL, *v = NULL, *right = NULL;
+  QCOMPLEX acc;
+  double *s = NULL;
+  unsigned int l, m, r, k, keep, a, b, j, x, y, t1, t2, s1, s2;
+  QBOOL ok = Q_FALSE;
+
+  if (!qmps_move_center (mps, p))
+    return Q_FALSE;
+
+  l = mps->bond[p];
+  m = mps->bond[p + 1];
+  r = mps->bond[p + 2];
+  k = l < r ? 2 * l : 2 * r;
+
+  if ((theta = calloc (4 * l * r, sizeof (QCOMPLEX))) == NULL ||
+      (gated = malloc (4 * l * r * sizeof (QCOMPLEX))) == NULL ||
+      (left = malloc (2 * l * k * sizeof (QCOMPLEX))) == NULL ||
+      (v = malloc (2 * r * k * sizeof (QCOMPLEX))) == NULL ||
+      (s = malloc (k * sizeof (double))) == NULL)
+  {
+    q_set_last_error ("qmps_apply_pair: memory exhausted");
+    goto done;
+  }
+
+  /* theta[(a * 2 + s1), (s2 * r + b)] */
+  for (x = 0; x < 2 * l; ++x)
+    for (j = 0; j < m; ++j)
+      for (y = 0; y < 2 * r; ++y)
+        theta[x * 2 * r + y] +=
+          mps->site[p][x * m + j] * mps->site[p + 1][j * 2 * r + y];
+
+  for (a = 0; a < l; ++a)
+    for (b = 0; b < r; ++b)
+      for (t1 = 0; t1 < 2; ++t1)
+        for (t2 = 0; t2 < 2; ++t2)
+        {
+          acc = 0;
+
+          for (s1 = 0; s1 < 2; ++s1)
+            for (s2 = 0; s2 < 2; ++s2)
+              acc += u[(t1 | t2 << 1) * 4 + (s1 | s2 << 1)]
+                * theta[(a * 2 + s1) * 2 * r + s2 * r + b];
+
+          gated[(a * 2 + t1) * 2 * r + t2 * r + b] = acc;
+        }
+
+  if (!qmps_svd (gated, 2 * l, 2 * r, left, s, v))
+    goto done;
+
+  keep = qmps_truncate (mps, s, k);
+
+  if ((right = malloc (keep * 2 * r * sizeof (QCOMPLEX))) == NULL)
+  {
+    q_set_last_error ("qmps_apply_pair: memory exhausted");
+    goto done;
+  }
+
+  /* left is 2l x k: keep its first columns in place */
+  for (x = 0; x < 2 * l; ++x)
+    for (j = 0; j < keep; ++j)
+      left[x * keep + j] = left[x * k + j];
+
+  for (j = 0; j < keep; ++j)
+    for (y = 0; y < 2 * r; ++y)
+      right[j * 2 * r + y] = s[j] * conj (v[y * k + j]);
+
+  free (mps->site[p]);
+  free (mps->site[p + 1]);
+
+  mps->site[p]     = left;
+  mps->site[p + 1] = right;
+  mps->bond[p + 1] = keep;
+  mps->center      = p + 1;
+
+  left  = NULL;
+  right = NULL;
+
+  ok = Q_TRUE;
+
+done:
+  if (theta != NULL)
+    free (theta);
+
+  if (gated != NULL)
+    free (gated);
+
+  if (left != NULL)
+    free (left);
+
+  if (v != NULL)
+    free (v);
+
+  if (s != NULL)
+    free (s);
+
+  if (right != NULL)
+    free (right);
+
+  return ok;
+}
+
+/* Swap bit 0 and bit 1 of a two-qubit index */
+#define QMPS_SWAP_BITS(i) ((((i) & 1) << 1) | (((i) >> 1) & 1))
+
+/* Two qubit gate, bit 0 on qubit q0 and bit 1 on q1. Distant qubits are
+ * brought together with swaps, and taken back afterwards. */
+QBOOL
+qmps_apply_2 (qmps_t *mps, unsigned int q0, unsigned int q1, const QCOMPLEX *u)
+{
+  QCOMPLEX swap[16] = {0};
+  QCOMPLEX local[16];
+  unsigned int lo, hi, i, j, p;
+
+  for (i = 0; i < 4; ++i)
+    swap[QMPS_SWAP_BITS (i) * 4 + i] = 1;
+
+  if (q0 < q1)
+  {
+    lo = q0;
+    hi = q1;
+
+    memcpy (local, u, sizeof (local));
+  }
+  else
+  {
+    lo = q1;
+    hi = q0;
+
+    for (i = 0; i < 4; ++i)
+      for (j = 0; j < 4; ++j)
+        local[QMPS_SWAP_BITS (i) * 4 + QMPS_SWAP_BITS (j)] = u[i * 4 + j];
+  }
+
+  for (p = hi - 1; p > lo; --p)
+    if (!qmps_apply_pair (mps, p, swap))
+      return Q_FALSE;
+
+  if (!qmps_apply_pair (mps, lo, local))
+    return Q_FALSE;
+
+  for (p = lo + 1; p < hi; ++p)
+    if (!qmps_apply_pair (mps, p, swap))
+      return Q_FALSE;
+
+  return Q_TRUE;
+}
+
+/******************************** Measurement ******************************/
+/* With the center on the qubit, the probability of each outcome is the
+ * weight of the corresponding half of its site */
+QBOOL
+qmps_measure (qmps_t *mps, unsigned int qubit, unsigned int *bit)
+{
+  QCOMPLEX *site;
+  double p[2] = {0, 0}, scale;
+  unsigned int l, r, rr, s;
+
+  if (!qmps_move_center (mps, qubit))
+    return Q_FALSE;
+
+  site = mps->site[qubit];
+  r    = mps->bond[qubit + 1];
+
+  for (l = 0; l < mps->bond[qubit]; ++l)
+    for (s = 0; s < 2; ++s)
+      for (rr = 0; rr < r; ++rr)
+        p[s] += creal (site[(l * 2 + s) * r + rr] * conj (site[(l * 2 + s) * r + rr]));
+
+  *bit  = rand () / (RAND_MAX + 1.0) < p[1] / (p[0] + p[1]);
+  scale = 1 / sqrt (p[*bit]);
+
+  for (l = 0; l < mps->bond[qubit]; ++l)
+    for (s = 0; s < 2; ++s)
+      for (rr = 0; rr < r; ++rr)
+        site[(l * 2 + s) * r + rr] *= s == *bit ? scale : 0;
+
+  return Q_TRUE;
+}
+
+/* Contract all sites, one qubit at a time */
+QBOOL
+qmps_get_state (const qmps_t *mps, QCOMPLEX *psi)
+{
+  QCOMPLEX *cur = NULL, *next = NULL;
+  uint64_t b, length;
+  unsigned int i, m, r, rr, s, l;
+  QBOOL ok = Q_FALSE;
+
+  if (mps->order > QCIRCUIT_STATE_ORDER_MAX)
+  {
+    q_set_last_error ("qmps_get_state: too many qubits for a state vector");
+    return Q_FALSE;
+  }
+
+  if ((cur = malloc (sizeof (QCOMPLEX))) == NULL)
+    goto done;
+
+  cur[0] = 1;
+  length = 1;
+
+  /* cur[b * bond[i] + m] */
+  for (i = 0; i < mps->order; ++i)
+  {
+    l = mps->bond[i];
+    r = mps->bond[i + 1];
+
+    if ((next = calloc (2 * length * r, sizeof (QCOMPLEX))) == NULL)
+      goto done;
+
+    for (b = 0; b < length; ++b)
+      for (s = 0; s < 2; ++s)
+        for (m = 0; m < l; ++m)
+          for (rr = 0; rr < r; ++rr)
+            next[(b | (uint64_t) s << i) * r + rr] +=
+              cur[b * l + m] * mps->site[i][(m * 2 + s) * r + rr];
+
+    free (cur);
+
+    cur    = next;
+    next   = NULL;
+    length <<= 1;
+  }
+
+  memcpy (psi, cur, length * sizeof (QCOMPLEX));
+
+  ok = Q_TRUE;
+
+done:
+  if (!ok)
+    q_set_last_error ("qmps_get_state: memory exhausted");
+
+  if (cur != NULL)
+    free (cur);
+
+  return ok;
+}
+
+/**************************** Circuit simulation ***************************/
+/* Site holding a physical qubit. Sites follow the logical qubits:
+ * relabeling sorts qubits by usage, which would otherwise break the
+ * adjacency of nearest-neighbour gates. */
+unsigned int
+qcircuit_mps_site (const qcircuit_t *circuit, unsigned int physical)
+{
+  unsigned int i;
+
+  if (circuit->layout != NULL)
+    for (i = 0; i < circuit->order; ++i)
+      if (circuit->layout[i] == physical)
+        return i;
+
+  return physical;
+}
+
+/* Run the circuit on a matrix product state, starting from a basis
+ * state. Gates of 1 and 2 qubits are supported; the cost depends on the
+ * entanglement (bond dimension) rather than on the number of qubits.
+ * Bonds are cut at bond_max and singular values dropped while their
+ * weight is below threshold: see qcircuit_get_truncation_error. */
+QBOOL
+qcircuit_simulate_mps (
+    qcircuit_t *circuit,
+    uint64_t basis,
+    unsigned int bond_max,
+    double threshold)
+{
+  const qwiring_t *this;
+  QCOMPLEX u[16];
+  unsigned int i, j, length;
+
+  for (this = circuit->wiring_head; this != NULL; this = this->next)
+    if (this->gate->order > QMPS_GATE_ORDER_MAX || this->gate->sparse == NULL)
+    {
+      q_set_last_error (
+          "gate `%s' too big for the MPS simulator (%d qubits)",
+          this->gate->name,
+          this->gate->order);
+      return Q_FALSE;
+    }
+
+  qcircuit_discard_state (circuit);
+
+  if ((circuit->mps = qmps_new (circuit->order, bond_max, threshold)) == NULL)
+    goto fail;
+
+  if ((circuit->collapsed_mps = qmps_new (circuit->order, bond_max, threshold)) == NULL)
+    goto fail;
+
+  for (i = 0; i < circuit->order && i < 64; ++i)
+    if (basis & (1ull << i))
+      qmps_apply_x (circuit->mps, i);
+
+  for (this = circuit->wiring_head; this != NULL; this = this->next)
+  {
+    length = 1 << this->gate->order;
+
+    for (i = 0; i < length; ++i)
+      for (j = 0; j < length; ++j)
+        u[i * length + j] = qsparse_get (this->gate->sparse, i, j);
+
+    if (this->gate->order == 1)
+      qmps_apply_1 (circuit->mps, qcircuit_mps_site (circuit, this->remap[0]), u);
+    else if (!qmps_apply_2 (
+        circuit->mps,
+        qcircuit_mps_site (circuit, this->remap[0]),
+        qcircuit_mps_site (circuit, this->remap[1]),
+        u))
+      goto fail;
+  }
+
+  if (!qcircuit_measure_reset (circuit))
+    goto fail;
+
+  circuit->has_state = Q_TRUE;
+
+  return Q_TRUE;
+
+fail:
+  qcircuit_discard_state (circuit);
+
+  return Q_FALSE;
+}
+
+/* Weight discarded by the MPS simulator (0 for the exact ones). The
+ * fidelity of the state is roughly 1 - error. */
+double
+qcircuit_get_truncation_error (const qcircuit_t *circuit)
+{
+  return circuit->mps != NULL ? circuit->mps->error : 0;
+}
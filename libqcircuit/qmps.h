@@ -0,0 +1,75 @@
+/*
+  qmps.h: Matrix product state simulation
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _LIBQCIRCUIT_QMPS_H
+#define _LIBQCIRCUIT_QMPS_H
+
+#include <qsparse.h>
+#include <stdint.h>
+
+/* Defaults used by qcircuit_simulate_basis. Bonds are cut at
+ * QMPS_BOND_MAX_DEFAULT, and singular values are dropped as long as
+ * the discarded weight stays below QMPS_THRESHOLD_DEFAULT. */
+#define QMPS_BOND_MAX_DEFAULT  64
+#define QMPS_THRESHOLD_DEFAULT 1e-12
+
+/* Widest gate (in qubits) the MPS simulator applies */
+#define QMPS_GATE_ORDER_MAX 2
+
+/* One-sided Jacobi SVD */
+#define QMPS_SVD_EPSILON    1e-15
+#define QMPS_SVD_SWEEPS_MAX 64
+
+/* Site i holds qubit i as a bond[i] x 2 x bond[i + 1] tensor, stored
+ * at site[i][(l * 2 + s) * bond[i + 1] + r]. Sites left of center are
+ * left-canonical and sites right of it right-canonical, so the norm of
+ * the state is the norm of site[center]. */
+struct qmps
+{
+  unsigned int order;
+
+  unsigned int bond_max;
+  double threshold;
+
+  /* Accumulated discarded weight (sum of squared singular values
+   * dropped, relative to the norm of the state at each truncation) */
+  double error;
+
+  unsigned int center;
+  unsigned int *bond; /* order + 1 entries, bond[0] = bond[order] = 1 */
+  QCOMPLEX **site;
+};
+
+typedef struct qmps qmps_t;
+
+qmps_t *qmps_new (unsigned int, unsigned int, double);
+QBOOL qmps_copy (qmps_t *, const qmps_t *);
+void qmps_destroy (qmps_t *);
+
+void qmps_apply_x (qmps_t *, unsigned int);
+void qmps_apply_1 (qmps_t *, unsigned int, const QCOMPLEX *);
+QBOOL qmps_apply_2 (qmps_t *, unsigned int, unsigned int, const QCOMPLEX *);
+QBOOL qmps_measure (qmps_t *, unsigned int, unsigned int *);
+QBOOL qmps_get_state (const qmps_t *, QCOMPLEX *);
+
+unsigned int qmps_get_bond_max (const qmps_t *);
+
+#endif /* _LIBQCIRCUIT_QMPS_H */
@@ -21,6 +21,10 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
 
 #include "qo.h"
 #include "qoplan.h"
@@ -29,6 +33,18 @@
 #define QOPLAN_OBJECT_TYPE_GATE    1
 #define QOPLAN_OBJECT_TYPE_CIRCUIT 2
 
+#ifndef IOV_MAX
+#  define IOV_MAX 1024
+#endif
+
+typedef uint32_t (*qoplan_serialize_fn_t) (const void *, void *, uint32_t);
+
+struct qoplan_job
+{
+  struct qoplan_object *obj;
+  qoplan_serialize_fn_t serialize_fn;
+};
+
 static void *
 __qoplan_object_destroy_cb (void *data, void *priv)
 {
@@ -81,6 +97,7 @@ qoplan_object_new (void *object)
   qobj->priv   = object;
   qobj->offset = 0;
   qobj->size   = 0;
+  qobj->buffer = NULL;
 
   return qobj;
 }
@@ -225,51 +242,104 @@ __depend_serialize_fn (const void *obj, void *buffer, uint32_t size)
 }
 
 
+/* Called from the worker threads: objects are only read, and each one
+ * is encoded into its own buffer.
+ */
 static QBOOL
-qoplan_dump_objects (FILE *fp, fastlist_t *fl, uint32_t (*serialize_fn) (const void *, void *, uint32_t))
+__qoplan_encode_job (unsigned int i, void *priv)
 {
-  unsigned int size;
-  unsigned int i;
-  unsigned int objsize;
-  void *buffer;
+  struct qoplan_job *job;
+
+  job = (struct qoplan_job *) priv + i;
+
+  job->obj->size = (job->serialize_fn) (job->obj->priv, NULL, 0);
+
+  if ((job->obj->buffer = malloc (job->obj->size)) == NULL)
+  {
+    q_set_last_error ("qoplan_encode_job: cannot create serialization buffer");
+    return Q_FALSE;
+  }
+
+  (void) (job->serialize_fn) (job->obj->priv, job->obj->buffer, job->obj->size);
+
+  return Q_TRUE;
+}
+
+static unsigned int
+qoplan_add_jobs (struct qoplan_job *jobs, fastlist_t *fl, qoplan_serialize_fn_t serialize_fn)
+{
+  unsigned int n = 0;
 
-  /* Dump all dependencies */
   FASTLIST_FOR_BEGIN (struct qoplan_object *, this, fl)
-    this->offset = ftell (fp);
-    this->size   = (serialize_fn) (this->priv, NULL, 0);
+    jobs[n].obj          = this;
+    jobs[n].serialize_fn = serialize_fn;
 
-    if ((buffer = malloc (this->size)) == NULL)
+    ++n;
+  FASTLIST_FOR_END
+
+  return n;
+}
+
+static QBOOL
+qoplan_writev (int fd, struct iovec *iov, unsigned int iovcnt, off_t offset)
+{
+  ssize_t written;
+  unsigned int chunk;
+
+  while (iovcnt > 0)
+  {
+    chunk = iovcnt > IOV_MAX ? IOV_MAX : iovcnt;
+
+    if ((written = pwritev (fd, iov, chunk, offset)) == -1)
     {
-      q_set_last_error ("qoplan_dump_objects: cannot create serialization buffer");
+      if (errno == EINTR)
+        continue;
+
+      q_set_last_error ("qoplan_dump_to_file: write failed: %s", strerror (errno));
       return Q_FALSE;
     }
 
-    (serialize_fn) (this->priv, buffer, this->size);
+    offset += written;
 
-    if (fwrite (buffer, this->size, 1, fp) < 1)
+    /* Skip whatever was written. Short writes may leave us in the
+     * middle of a buffer. */
+    while (iovcnt > 0 && (size_t) written >= iov->iov_len)
     {
-      q_set_last_error ("qoplan_dump_objects: write error: %s", strerror (errno));
-
-      free (buffer);
-      return Q_FALSE;
+      written -= iov->iov_len;
+      ++iov;
+      --iovcnt;
     }
 
-    free (buffer);
-  FASTLIST_FOR_END
+    if (iovcnt > 0)
+    {
+      iov->iov_base = (uint8_t *) iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
 
   return Q_TRUE;
 }
 
+/* Objects are encoded concurrently into independent buffers. Once all
+ * sizes are known, offsets are assigned with a prefix sum and the whole
+ * file (header, descriptors and payloads) goes out in a single vectored
+ * write sequence.
+ */
 QBOOL
 qoplan_dump_to_file (qoplan_t *plan, const char *output)
 {
-  FILE *fp = NULL;
+  int fd = -1;
   struct qo_header header;
   struct qo_descriptor *descriptors = NULL;
+  struct qoplan_job *jobs = NULL;
+  struct iovec *iov = NULL;
 
   unsigned int descriptor_count;
+  unsigned int depnum, gatenum, circuitnum;
   unsigned int i;
-  unsigned int size;
+  uint32_t offset;
+
+  QBOOL ok = Q_FALSE;
 
   descriptor_count = fastlist_size (&plan->circuits) +
                      fastlist_size (&plan->gates)    +
@@ -278,120 +348,110 @@ qoplan_dump_to_file (qoplan_t *plan, const char *output)
   if (descriptor_count == 0)
   {
     q_set_last_error ("qoplan_dump_to_file: will not dump empty plan");
-    goto fail;
+    goto done;
   }
 
-  if ((fp = fopen (output, "wb")) == NULL)
+  if ((jobs = calloc (descriptor_count, sizeof (struct qoplan_job))) == NULL ||
+      (descriptors = calloc (descriptor_count,
+                             sizeof (struct qo_descriptor))) == NULL ||
+      (iov = calloc (descriptor_count + 2, sizeof (struct iovec))) == NULL)
   {
-    q_set_last_error ("qoplan_dump_to_file: cannot open %s for writing: %s",
-                      output, strerror (errno));
-    goto fail;
-  }
-
-  /* Populate header */
-  memset (&header, 0, sizeof (struct qo_header));
-  memcpy (header.qh_sig, QO_HEADER_SIGNATURE, 4);
-
-  /* Write placeholder */
-  if (fwrite (&header, sizeof (struct qo_header), 1, fp) < 1)
-  {
-    q_set_last_error ("qoplan_dump_to_file: write failed: %s", strerror (errno));
-    goto fail;
+    q_set_last_error ("qoplan_dump_to_file: memory exhausted");
+    goto done;
   }
 
-  /* Initialize descriptors */
-  if ((descriptors = calloc (descriptor_count,
-                             sizeof (struct qo_descriptor))) == NULL)
-    goto fail;
+  /* Descriptor order: depends, gates and circuits */
+  depnum     = qoplan_add_jobs (jobs, &plan->depends, __depend_serialize_fn);
+  gatenum    = qoplan_add_jobs (jobs + depnum, &plan->gates, __qgate_serialize_fn);
+  circuitnum = qoplan_add_jobs (jobs + depnum + gatenum, &plan->circuits, __qcircuit_serialize_fn);
 
-  /* Write placeholder */
-  if (fwrite (descriptors, sizeof (struct qo_descriptor), descriptor_count, fp) < descriptor_count)
-  {
-    q_set_last_error ("qoplan_dump_to_file: write failed: %s", strerror (errno));
-    goto fail;
-  }
-
-  /* Dump objects */
-  if (!qoplan_dump_objects (fp, &plan->depends,  __depend_serialize_fn))
-    goto fail;
+  /* Holes in the fastlists are skipped */
+  descriptor_count = depnum + gatenum + circuitnum;
 
-  if (!qoplan_dump_objects (fp, &plan->gates,    __qgate_serialize_fn))
-    goto fail;
+  /* Encode objects */
+  if (!q_parallel_for (descriptor_count, __qoplan_encode_job, jobs))
+    goto done;
 
-  if (!qoplan_dump_objects (fp, &plan->circuits, __qcircuit_serialize_fn))
-    goto fail;
-
-  /* Repopulate header */
-  if (fseek (fp, 0, SEEK_SET) == -1)
-  {
-    q_set_last_error ("qoplan_dump_to_file: seek failed: %s", strerror (errno));
-    goto fail;
-  }
+  /* Populate header */
+  memset (&header, 0, sizeof (struct qo_header));
+  memcpy (header.qh_sig, QO_HEADER_SIGNATURE, 4);
 
-  header.qh_depnum     = __qsb_htof32 (fastlist_size (&plan->depends));
-  header.qh_gatenum    = __qsb_htof32 (fastlist_size (&plan->gates));
-  header.qh_circuitnum = __qsb_htof32 (fastlist_size (&plan->circuits));
+  header.qh_depnum     = __qsb_htof32 (depnum);
+  header.qh_gatenum    = __qsb_htof32 (gatenum);
+  header.qh_circuitnum = __qsb_htof32 (circuitnum);
 
   header.qh_depoff     = __qsb_htof32 (sizeof (struct qo_header));
   header.qh_gateoff    = __qsb_htof32 (sizeof (struct qo_header) +
-                                       sizeof (struct qo_descriptor) * header.qh_depnum);
-
+                                       sizeof (struct qo_descriptor) * depnum);
   header.qh_circuitoff = __qsb_htof32 (sizeof (struct qo_header) +
                                        sizeof (struct qo_descriptor) *
-                                       (header.qh_depnum + header.qh_circuitnum));
+                                       (depnum + gatenum));
+
+  /* Assign offsets: prefix sum of object sizes */
+  offset = sizeof (struct qo_header) +
+           sizeof (struct qo_descriptor) * descriptor_count;
 
-  /* Write header */
-  if (fwrite (&header, sizeof (struct qo_header), 1, fp) < 1)
+  for (i = 0; i < descriptor_count; ++i)
   {
-    q_set_last_error ("qoplan_dump_to_file: write failed: %s", strerror (errno));
-    goto fail;
-  }
+    jobs[i].obj->offset = offset;
 
-  /* Repopulate descriptors */
-  i = 0;
+    descriptors[i].qd_offset = __qsb_htof32 (offset);
+    descriptors[i].qd_size   = __qsb_htof32 (jobs[i].obj->size);
 
-  FASTLIST_FOR_BEGIN (struct qoplan_object *, this, &plan->depends)
-    descriptors[i].qd_offset = __qsb_htof32 (this->offset);
-    descriptors[i].qd_size   = __qsb_htof32 (this->size);
+    iov[i + 2].iov_base = jobs[i].obj->buffer;
+    iov[i + 2].iov_len  = jobs[i].obj->size;
 
-    ++i;
-  FASTLIST_FOR_END
+    offset += jobs[i].obj->size;
+  }
 
-  FASTLIST_FOR_BEGIN (struct qoplan_object *, this, &plan->gates)
-    descriptors[i].qd_offset = __qsb_htof32 (this->offset);
-    descriptors[i].qd_size   = __qsb_htof32 (this->size);
+  iov[0].iov_base = &header;
+  iov[0].iov_len  = sizeof (struct qo_header);
 
-    ++i;
-  FASTLIST_FOR_END
+  iov[1].iov_base = descriptors;
+  iov[1].iov_len  = sizeof (struct qo_descriptor) * descriptor_count;
 
-  FASTLIST_FOR_BEGIN (struct qoplan_object *, this, &plan->circuits)
-    descriptors[i].qd_offset = __qsb_htof32 (this->offset);
-    descriptors[i].qd_size   = __qsb_htof32 (this->size);
+  if ((fd = open (output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+  {
+    q_set_last_error ("qoplan_dump_to_file: cannot open %s for writing: %s",
+                      output, strerror (errno));
+    goto done;
+  }
 
-    ++i;
-  FASTLIST_FOR_END
+  if (!qoplan_writev (fd, iov, descriptor_count + 2, 0))
+    goto done;
 
-  /* Write descriptors */
-  if (fwrite (descriptors, sizeof (struct qo_descriptor), descriptor_count, fp) < descriptor_count)
+  if (close (fd) == -1)
   {
-    q_set_last_error ("qoplan_dump_to_file: write failed: %s", strerror (errno));
-    goto fail;
+    fd = -1;
+    q_set_last_error ("qoplan_dump_to_file: close failed: %s", strerror (errno));
+    goto done;
   }
 
-  free (descriptors);
+  fd = -1;
 
-  fclose (fp);
+  ok = Q_TRUE;
 
-  return Q_TRUE;
+done:
+  if (fd != -1)
+    close (fd);
 
-fail:
-  if (fp != NULL)
-    fclose (fp);
+  if (jobs != NULL)
+  {
+    for (i = 0; i < descriptor_count; ++i)
+      if (jobs[i].obj != NULL && jobs[i].obj->buffer != NULL)
+      {
+        free (jobs[i].obj->buffer);
+        jobs[i].obj->buffer = NULL;
+      }
+
+    free (jobs);
+  }
 
   if (descriptors != NULL)
     free (descriptors);
 
-  return Q_FALSE;
-}
-
+  if (iov != NULL)
+    free (iov);
 
+  return ok;
+}
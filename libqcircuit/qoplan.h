@@ -36,6 +36,8 @@ struct qoplan_object
 
   uint32_t offset;
   uint32_t size;
+
+  void *buffer; /* Serialized object, only valid while dumping */
 };
 
 struct qoplan
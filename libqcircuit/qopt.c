@@ -0,0 +1,593 @@
+/*
+  qopt.c: Circuit optimization passes
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <complex.h>
+
+#include "qopt.h"
+
+#define QOPT_NAME_MAX 32
+
+static uint64_t
+qwiring_get_support (const qwiring_t *wiring)
+{
+  uint64_t support = 0;
+  unsigned int i;
+
+  for (i = 0; i < wiring->gate->order; ++i)
+    support |= 1ull << wiring->remap[i];
+
+  return support;
+}
+
+static unsigned int
+qopt_popcount (uint64_t mask)
+{
+  unsigned int count = 0;
+
+  while (mask != 0)
+  {
+    mask &= mask - 1;
+    ++count;
+  }
+
+  return count;
+}
+
+/* Look for a gate with exactly the same coefficients. Reusing gates
+ * keeps the database small and lets the expansion cache share the
+ * expanded matrices of identical fused groups. Parametric gates are not
+ * candidates: their coefficients change. */
+static qgate_t *
+qdb_lookup_qgate_by_coef (const qdb_t *db, unsigned int order, const QCOMPLEX *coef)
+{
+  FASTLIST_FOR_BEGIN (qgate_t *, gate, &db->qgates)
+    if (gate->order == order && gate->coef != NULL && gate->sparse != NULL &&
+        !qgate_is_parametric (gate))
+      if (memcmp (gate->coef, coef, (1 << (order << 1)) * sizeof (QCOMPLEX)) == 0)
+        return gate;
+  FASTLIST_FOR_END
+
+  return NULL;
+}
+
+/* Local indices of the qubits in support, in ascending order */
+static unsigned int
+qopt_get_local_map (uint64_t support, unsigned int *local)
+{
+  unsigned int i, order;
+
+  for (i = order = 0; i < 64; ++i)
+    if (support & (1ull << i))
+      local[i] = order++;
+
+  return order;
+}
+
+/* *u = wiring * (*u), with wiring restricted to the qubits of U */
+static QBOOL
+qopt_apply_wiring (qsparse_t **u, const qwiring_t *wiring, const unsigned int *local)
+{
+  unsigned int remap[QSPARSE_ORDER_MAX];
+  unsigned int i;
+  qsparse_t *expanded, *result;
+
+  for (i = 0; i < wiring->gate->order; ++i)
+    remap[i] = local[wiring->remap[i]];
+
+  if ((expanded = qgate_expand (wiring->gate, (*u)->order, remap)) == NULL)
+    return Q_FALSE;
+
+  result = qsparse_mul (expanded, *u);
+
+  qsparse_destroy (expanded);
+
+  if (result == NULL)
+    return Q_FALSE;
+
+  qsparse_destroy (*u);
+
+  *u = result;
+
+  return Q_TRUE;
+}
+
+/* Get a gate whose matrix is U, creating it if necessary */
+static qgate_t *
+qopt_get_gate (qdb_t *db, const qsparse_t *u, const char *desc)
+{
+  unsigned int length, i, j;
+  char name[QOPT_NAME_MAX];
+  QCOMPLEX *coef;
+  qgate_t *gate;
+
+  length = QSPARSE_LENGTH (u);
+
+  if ((coef = malloc (length * length * sizeof (QCOMPLEX))) == NULL)
+  {
+    q_set_last_error ("qopt: memory exhausted");
+    return NULL;
+  }
+
+  for (j = 0; j < length; ++j)
+    for (i = 0; i < length; ++i)
+      coef[i + j * length] = qsparse_get (u, j, i);
+
+  if ((gate = qdb_lookup_qgate_by_coef (db, u->order, coef)) == NULL)
+  {
+    i = fastlist_size (&db->qgates);
+
+    do
+      snprintf (name, sizeof (name), QOPT_FUSED_GATE_PREFIX "%u", i++);
+    while (qdb_lookup_qgate (db, name) != NULL);
+
+    if ((gate = qgate_new (u->order, name, desc, coef)) != NULL)
+      if (!qdb_register_qgate (db, gate))
+      {
+        q_set_last_error ("qopt: cannot register synthetic gate");
+        qgate_destroy (gate);
+        gate = NULL;
+      }
+  }
+
+  free (coef);
+
+  return gate;
+}
+
+/* Build the gate equivalent to the wirings [first, last], acting on
+ * the qubits in support (in ascending order). */
+static qgate_t *
+qopt_fuse_group (qdb_t *db, const qwiring_t *first, const qwiring_t *last, uint64_t support)
+{
+  unsigned int local[64];
+  const qwiring_t *this;
+  qsparse_t *u;
+  qgate_t *gate = NULL;
+
+  if ((u = qsparse_eye_new (qopt_get_local_map (support, local))) == NULL)
+    return NULL;
+
+  for (this = first; this != last->next; this = this->next)
+    if (!qopt_apply_wiring (&u, this, local))
+      goto done;
+
+  gate = qopt_get_gate (db, u, "Fused gate");
+
+done:
+  qsparse_destroy (u);
+
+  return gate;
+}
+
+/* Replace runs of consecutive wirings acting on at most max_order
+ * qubits altogether by a single wiring of a fused gate. Fewer, denser
+ * gates are cheaper to expand and multiply than many small ones.
+ */
+QBOOL
+qcircuit_fuse (qcircuit_t *circuit, qdb_t *db, unsigned int max_order)
+{
+  qwiring_t *first, *last, *next, *new;
+  qgate_t *gate;
+  uint64_t support, extended;
+  unsigned int remap[QSPARSE_ORDER_MAX];
+  unsigned int i, n, count;
+
+  if (max_order > QSPARSE_ORDER_MAX)
+    max_order = QSPARSE_ORDER_MAX;
+
+  if (circuit->order > 64)
+  {
+    q_set_last_error ("qcircuit_fuse: circuit too big");
+    return Q_FALSE;
+  }
+
+  for (first = circuit->wiring_head; first != NULL; first = next)
+  {
+    support = qwiring_get_support (first);
+    last    = first;
+    count   = 1;
+
+    if (qopt_popcount (support) <= max_order &&
+        !qgate_is_parametric (first->gate))
+      while (last->next != NULL && !qgate_is_parametric (last->next->gate))
+      {
+        extended = support | qwiring_get_support (last->next);
+
+        if (qopt_popcount (extended) > max_order)
+          break;
+
+        support = extended;
+        last    = last->next;
+        ++count;
+      }
+
+    next = last->next;
+
+    if (count < 2)
+      continue;
+
+    if ((gate = qopt_fuse_group (db, first, last, support)) == NULL)
+      return Q_FALSE;
+
+    for (i = n = 0; i < 64; ++i)
+      if (support & (1ull << i))
+        remap[n++] = i;
+
+    if ((new = qwiring_new (gate, remap)) == NULL)
+    {
+      q_set_last_error ("qcircuit_fuse: memory exhausted");
+      return Q_FALSE;
+    }
+
+    /* Remove all wirings of the group but the first, then replace it */
+    while (first->next != next)
+    {
+      last = first->next;
+
+      qcircuit_remove_wiring (circuit, last);
+      qwiring_destroy (last);
+    }
+
+    if (!qcircuit_replace_wiring (circuit, first, new))
+    {
+      qwiring_destroy (new);
+      return Q_FALSE;
+    }
+
+    qwiring_destroy (first);
+  }
+
+  return Q_TRUE;
+}
+
+/* Peephole optimizer */
+static QBOOL
+qopt_sparse_equal (const qsparse_t *a, const qsparse_t *b)
+{
+  unsigned int i, j, length;
+
+  length = QSPARSE_LENGTH (a);
+
+  for (i = 0; i < length; ++i)
+    for (j = 0; j < length; ++j)
+      if (cabs (qsparse_get (a, i, j) - qsparse_get (b, i, j)) > QOPT_EPSILON)
+        return Q_FALSE;
+
+  return Q_TRUE;
+}
+
+static QBOOL
+qopt_sparse_is_diagonal (const qsparse_t *sparse)
+{
+  qsparse_iterator_t it;
+
+  for (
+        qsparse_iterator_init (sparse, &it);
+        !qsparse_iterator_end (&it);
+        qsparse_iterator_next (&it)
+        )
+    if (qsparse_iterator_row (&it) != qsparse_iterator_col (&it))
+      return Q_FALSE;
+
+  return Q_TRUE;
+}
+
+static QBOOL
+qopt_next_permutation (unsigned int *perm, unsigned int n)
+{
+  unsigned int i, j, tmp;
+
+  if (n < 2)
+    return Q_FALSE;
+
+  for (i = n - 1; i > 0 && perm[i - 1] >= perm[i]; --i);
+
+  if (i == 0)
+    return Q_FALSE;
+
+  for (j = n - 1; perm[j] <= perm[i - 1]; --j);
+
+  tmp = perm[i - 1]; perm[i - 1] = perm[j]; perm[j] = tmp;
+
+  for (j = n - 1; i < j; ++i, --j)
+  {
+    tmp = perm[i]; perm[i] = perm[j]; perm[j] = tmp;
+  }
+
+  return Q_TRUE;
+}
+
+/* Look for a gate (under any qubit ordering) whose matrix is U. On
+ * success, perm holds the local qubit each gate qubit is wired to. */
+static const qgate_t *
+qopt_match_gate (const qdb_t *db, const qsparse_t *u, unsigned int *perm)
+{
+  unsigned int i;
+  qsparse_t *expanded;
+  QBOOL equal;
+
+  FASTLIST_FOR_BEGIN (const qgate_t *, gate, &db->qgates)
+    if (gate->order == u->order && gate->sparse != NULL &&
+        !qgate_is_parametric (gate))
+    {
+      for (i = 0; i < gate->order; ++i)
+        perm[i] = i;
+
+      do
+      {
+        if ((expanded = qgate_expand (gate, u->order, perm)) == NULL)
+          return NULL;
+
+        equal = qopt_sparse_equal (expanded, u);
+
+        qsparse_destroy (expanded);
+
+        if (equal)
+          return gate;
+      }
+      while (qopt_next_permutation (perm, gate->order));
+    }
+  FASTLIST_FOR_END
+
+  return NULL;
+}
+
+/* Parametric gates must stay as they are, so that rebinding them
+ * changes the circuit. They are never merged nor commuted. */
+static QBOOL
+qwiring_is_fixed (const qwiring_t *wiring)
+{
+  return wiring->gate->sparse != NULL && !qgate_is_parametric (wiring->gate);
+}
+
+static QBOOL
+qwiring_is_diagonal (const qwiring_t *wiring)
+{
+  return qwiring_is_fixed (wiring) &&
+      qopt_sparse_is_diagonal (wiring->gate->sparse);
+}
+
+/* Try to simplify wiring followed by later, which acts on the same
+ * qubits. If both cancel out, both are removed. If their product is
+ * a known gate (or both are diagonal, and therefore merge into a
+ * single phase gate), they are replaced by a single wiring placed
+ * where later was.
+ *
+ * Returns Q_TRUE if the circuit was changed, Q_FALSE otherwise.
+ */
+static QBOOL
+qopt_simplify_pair (
+    qcircuit_t *circuit,
+    qdb_t *db,
+    qwiring_t *wiring,
+    qwiring_t *later,
+    QBOOL *failed)
+{
+  unsigned int local[64], qubits[QSPARSE_ORDER_MAX];
+  unsigned int perm[QSPARSE_ORDER_MAX], remap[QSPARSE_ORDER_MAX];
+  uint64_t support;
+  unsigned int i, order;
+  qsparse_t *u = NULL, *eye = NULL;
+  const qgate_t *gate;
+  qwiring_t *new;
+  QBOOL changed = Q_FALSE;
+
+  support = qwiring_get_support (wiring);
+  order   = qopt_get_local_map (support, local);
+
+  for (i = 0; i < 64; ++i)
+    if (support & (1ull << i))
+      qubits[local[i]] = i;
+
+  if ((u = qsparse_eye_new (order)) == NULL ||
+      (eye = qsparse_eye_new (order)) == NULL)
+    goto fail;
+
+  if (!qopt_apply_wiring (&u, wiring, local) ||
+      !qopt_apply_wiring (&u, later, local))
+    goto fail;
+
+  if (qopt_sparse_equal (u, eye))
+  {
+    qcircuit_remove_wiring (circuit, later);
+    qwiring_destroy (later);
+
+    changed = Q_TRUE;
+  }
+  else
+  {
+    if ((gate = qopt_match_gate (db, u, perm)) == NULL)
+    {
+      if (!qwiring_is_diagonal (wiring) || !qwiring_is_diagonal (later))
+        goto done;
+
+      if ((gate = qopt_get_gate (db, u, "Merged phase gate")) == NULL)
+        goto fail;
+
+      for (i = 0; i < order; ++i)
+        perm[i] = i;
+    }
+
+    for (i = 0; i < order; ++i)
+      remap[i] = qubits[perm[i]];
+
+    if ((new = qwiring_new (gate, remap)) == NULL)
+    {
+      q_set_last_error ("qcircuit_optimize: memory exhausted");
+      goto fail;
+    }
+
+    if (!qcircuit_replace_wiring (circuit, later, new))
+    {
+      qwiring_destroy (new);
+      goto fail;
+    }
+
+    qwiring_destroy (later);
+
+    changed = Q_TRUE;
+  }
+
+  if (changed)
+  {
+    qcircuit_remove_wiring (circuit, wiring);
+    qwiring_destroy (wiring);
+  }
+
+  goto done;
+
+fail:
+  *failed = Q_TRUE;
+
+done:
+  if (u != NULL)
+    qsparse_destroy (u);
+
+  if (eye != NULL)
+    qsparse_destroy (eye);
+
+  return changed;
+}
+
+/* Remove gates that cancel out and merge gates whose product is known.
+ * A wiring is compared against the next one acting on the same qubits,
+ * as long as everything in between commutes with it: either because
+ * it acts on other qubits or because both are diagonal.
+ */
+QBOOL
+qcircuit_optimize (qcircuit_t *circuit, qdb_t *db)
+{
+  qwiring_t *this, *later, *prev = NULL;
+  uint64_t support, other;
+  QBOOL diagonal, changed, failed = Q_FALSE;
+
+  if (circuit->order > 64)
+  {
+    q_set_last_error ("qcircuit_optimize: circuit too big");
+    return Q_FALSE;
+  }
+
+  this = circuit->wiring_head;
+
+  while (this != NULL)
+  {
+    support  = qwiring_get_support (this);
+    diagonal = qwiring_is_diagonal (this);
+    changed  = Q_FALSE;
+
+    for (later = this->next; later != NULL; later = later->next)
+    {
+      other = qwiring_get_support (later);
+
+      /* Gates too big for qsparse are left alone */
+      if (other == support &&
+          qwiring_is_fixed (this) && qwiring_is_fixed (later))
+      {
+        prev = this->prev;
+
+        if ((changed = qopt_simplify_pair (circuit, db, this, later, &failed)))
+          break;
+
+        if (failed)
+          return Q_FALSE;
+      }
+
+      if ((other & support) != 0 && !(diagonal && qwiring_is_diagonal (later)))
+        break;
+    }
+
+    /* Go back one wiring: the removal may have made new pairs adjacent */
+    if (changed)
+      this = prev != NULL ? prev : circuit->wiring_head;
+    else
+      this = this->next;
+  }
+
+  return Q_TRUE;
+}
+
+/* Qubit relabeling */
+struct qopt_qubit_usage
+{
+  unsigned int qubit;
+  unsigned int count;
+};
+
+static int
+qopt_qubit_usage_cmp (const void *a, const void *b)
+{
+  const struct qopt_qubit_usage *ua = (const struct qopt_qubit_usage *) a;
+  const struct qopt_qubit_usage *ub = (const struct qopt_qubit_usage *) b;
+
+  if (ua->count != ub->count)
+    return ua->count > ub->count ? -1 : 1;
+
+  return (int) ua->qubit - (int) ub->qubit;
+}
+
+/* Move the most used qubits to the lowest bits. Gates on low qubits
+ * touch amplitudes close to each other, and the blocked simulator only
+ * needs to relabel the qubits above the block when they are used. The
+ * user keeps seeing the original qubits (see qcircuit_permute_qubits).
+ */
+QBOOL
+qcircuit_relabel (qcircuit_t *circuit)
+{
+  struct qopt_qubit_usage usage[64];
+  unsigned int perm[64];
+  const qwiring_t *this;
+  unsigned int i;
+  QBOOL identity = Q_TRUE;
+
+  if (circuit->order > 64)
+  {
+    q_set_last_error ("qcircuit_relabel: circuit too big");
+    return Q_FALSE;
+  }
+
+  for (i = 0; i < circuit->order; ++i)
+  {
+    usage[i].qubit = i;
+    usage[i].count = 0;
+  }
+
+  for (this = circuit->wiring_head; this != NULL; this = this->next)
+    for (i = 0; i < this->gate->order; ++i)
+      ++usage[this->remap[i]].count;
+
+  qsort (usage, circuit->order, sizeof (struct qopt_qubit_usage), qopt_qubit_usage_cmp);
+
+  for (i = 0; i < circuit->order; ++i)
+  {
+    perm[usage[i].qubit] = i;
+
+    if (usage[i].qubit != i)
+      identity = Q_FALSE;
+  }
+
+  if (identity)
+    return Q_TRUE;
+
+  return qcircuit_permute_qubits (circuit, perm);
+}
@@ -0,0 +1,42 @@
+/*
+  qopt.h: Circuit optimization passes
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _LIBQCIRCUIT_QOPT_H
+#define _LIBQCIRCUIT_QOPT_H
+
+#include "qcircuit.h"
+
+/* Largest gate (in qubits) produced by default when fusing wirings */
+#define QOPT_FUSE_ORDER_DEFAULT 3
+
+#define QOPT_FUSED_GATE_PREFIX "__fused"
+
+/* Tolerance when comparing gate products */
+#define QOPT_EPSILON 1e-9
+
+/* Passes rewrite the wiring list of a circuit in place. Gates they
+ * synthesize are registered in (and owned by) the database, so that
+ * they get dumped along with the circuit. */
+QBOOL qcircuit_fuse (qcircuit_t *, qdb_t *, unsigned int);
+QBOOL qcircuit_optimize (qcircuit_t *, qdb_t *);
+QBOOL qcircuit_relabel (qcircuit_t *);
+
+#endif /* _LIBQCIRCUIT_QOPT_H */
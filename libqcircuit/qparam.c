@@ -0,0 +1,512 @@
+/*
+  qparam.c: Parametric gates and circuits
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "qparam.h"
+
+/* Gate families. Bit 0 is the target of controlled families. */
+static void
+qgate_fill_rx (const double *p, QCOMPLEX *coef)
+{
+  coef[0] = cos (p[0] / 2);
+  coef[1] = -I * sin (p[0] / 2);
+  coef[2] = -I * sin (p[0] / 2);
+  coef[3] = cos (p[0] / 2);
+}
+
+static void
+qgate_fill_ry (const double *p, QCOMPLEX *coef)
+{
+  coef[0] = cos (p[0] / 2);
+  coef[1] = -sin (p[0] / 2);
+  coef[2] = sin (p[0] / 2);
+  coef[3] = cos (p[0] / 2);
+}
+
+static void
+qgate_fill_rz (const double *p, QCOMPLEX *coef)
+{
+  coef[0] = cexp (-I * p[0] / 2);
+  coef[1] = 0;
+  coef[2] = 0;
+  coef[3] = cexp (I * p[0] / 2);
+}
+
+static void
+qgate_fill_phase (const double *p, QCOMPLEX *coef)
+{
+  coef[0] = 1;
+  coef[1] = 0;
+  coef[2] = 0;
+  coef[3] = cexp (I * p[0]);
+}
+
+/* U3 (theta, phi, lambda) */
+static void
+qgate_fill_u3 (const double *p, QCOMPLEX *coef)
+{
+  coef[0] = cos (p[0] / 2);
+  coef[1] = -cexp (I * p[2]) * sin (p[0] / 2);
+  coef[2] = cexp (I * p[1]) * sin (p[0] / 2);
+  coef[3] = cexp (I * (p[1] + p[2])) * cos (p[0] / 2);
+}
+
+static void
+qgate_fill_diagonal (QCOMPLEX *coef, QCOMPLEX d0, QCOMPLEX d1, QCOMPLEX d2, QCOMPLEX d3)
+{
+  unsigned int i;
+
+  for (i = 0; i < 16; ++i)
+    coef[i] = 0;
+
+  coef[0]  = d0;
+  coef[5]  = d1;
+  coef[10] = d2;
+  coef[15] = d3;
+}
+
+static void
+qgate_fill_cphase (const double *p, QCOMPLEX *coef)
+{
+  qgate_fill_diagonal (coef, 1, 1, 1, cexp (I * p[0]));
+}
+
+static void
+qgate_fill_crz (const double *p, QCOMPLEX *coef)
+{
+  qgate_fill_diagonal (coef, 1, 1, cexp (-I * p[0] / 2), cexp (I * p[0] / 2));
+}
+
+/* exp (-i theta / 2 Z x Z) */
+static void
+qgate_fill_rzz (const double *p, QCOMPLEX *coef)
+{
+  qgate_fill_diagonal (
+      coef,
+      cexp (-I * p[0] / 2),
+      cexp (I * p[0] / 2),
+      cexp (I * p[0] / 2),
+      cexp (-I * p[0] / 2));
+}
+
+static const struct qgate_family qgate_families[] =
+{
+    {"rx",     1, 1, qgate_fill_rx},
+    {"ry",     1, 1, qgate_fill_ry},
+    {"rz",     1, 1, qgate_fill_rz},
+    {"phase",  1, 1, qgate_fill_phase},
+    {"u3",     1, 3, qgate_fill_u3},
+    {"cphase", 2, 1, qgate_fill_cphase},
+    {"crz",    2, 1, qgate_fill_crz},
+    {"rzz",    2, 1, qgate_fill_rzz},
+    {NULL,     0, 0, NULL}
+};
+
+const struct qgate_family *
+qgate_family_lookup (const char *name)
+{
+  unsigned int i;
+
+  for (i = 0; qgate_families[i].name != NULL; ++i)
+    if (strcmp (qgate_families[i].name, name) == 0)
+      return &qgate_families[i];
+
+  return NULL;
+}
+
+/* Distinct parametric gates of a circuit, in order of first use. Their
+ * parameters, one gate after the other, are the parameters of the
+ * circuit: a gate wired several times shares its parameters. */
+struct qparam_set
+{
+  const qgate_t **gates;
+  unsigned int count;
+
+  /* Open addressing: slot -> index in gates + 1, 0 if free */
+  unsigned int *table;
+  uint64_t mask;
+};
+
+static inline uint64_t
+qparam_set_hash (const qgate_t *gate)
+{
+  return ((uintptr_t) gate >> 4) * 0x9e3779b97f4a7c15ull;
+}
+
+/* Index of gate in set, or -1 */
+static int
+qparam_set_find (const struct qparam_set *set, const qgate_t *gate)
+{
+  uint64_t slot;
+
+  if (set->table == NULL)
+    return -1;
+
+  for (
+      slot = qparam_set_hash (gate) & set->mask;
+      set->table[slot] != 0;
+      slot = (slot + 1) & set->mask)
+    if (set->gates[set->table[slot] - 1] == gate)
+      return set->table[slot] - 1;
+
+  return -1;
+}
+
+static void
+qparam_set_finalize (struct qparam_set *set)
+{
+  if (set->gates != NULL)
+    free (set->gates);
+
+  if (set->table != NULL)
+    free (set->table);
+}
+
+static QBOOL
+qparam_set_init (struct qparam_set *set, const qcircuit_t *circuit)
+{
+  const qwiring_t *this;
+  uint64_t slot, size = 1;
+  unsigned int wirings = 0;
+
+  memset (set, 0, sizeof (struct qparam_set));
+
+  for (this = circuit->wiring_head; this != NULL; this = this->next)
+    if (qgate_is_parametric (this->gate))
+      ++wirings;
+
+  if (wirings == 0)
+    return Q_TRUE;
+
+  while (size < 2 * (uint64_t) wirings)
+    size <<= 1;
+
+  set->mask = size - 1;
+
+  if ((set->gates = malloc (wirings * sizeof (qgate_t *))) == NULL ||
+      (set->table = calloc (size, sizeof (unsigned int))) == NULL)
+  {
+    q_set_last_error ("memory exhausted");
+    qparam_set_finalize (set);
+    return Q_FALSE;
+  }
+
+  for (this = circuit->wiring_head; this != NULL; this = this->next)
+    if (qgate_is_parametric (this->gate) &&
+        qparam_set_find (set, this->gate) == -1)
+    {
+      for (
+          slot = qparam_set_hash (this->gate) & set->mask;
+          set->table[slot] != 0;
+          slot = (slot + 1) & set->mask);
+
+      set->gates[set->count++] = this->gate;
+      set->table[slot] = set->count;
+    }
+
+  return Q_TRUE;
+}
+
+unsigned int
+qcircuit_get_param_count (const qcircuit_t *circuit)
+{
+  struct qparam_set set;
+  unsigned int i, count = 0;
+
+  if (!qparam_set_init (&set, circuit))
+    return 0;
+
+  for (i = 0; i < set.count; ++i)
+    count += set.gates[i]->family->params;
+
+  qparam_set_finalize (&set);
+
+  return count;
+}
+
+/* Wirings whose parametric gate was rebound since their products were
+ * computed are marked dirty, and the operator is no longer up to date.
+ * Gates belong to the database, so this also catches binds done through
+ * another circuit wiring the same gate (including wirings inlined by a
+ * call). */
+void
+qcircuit_check_params (qcircuit_t *circuit)
+{
+  qwiring_t *this;
+
+  for (this = circuit->wiring_head; this != NULL; this = this->next)
+    if (qgate_is_parametric (this->gate) &&
+        this->serial != this->gate->serial)
+    {
+      this->serial = this->gate->serial;
+      qwiring_mark_dirty (this);
+
+      circuit->updated = Q_FALSE;
+    }
+}
+
+/* Bind all parametric gates of the circuit. Wirings of these gates are
+ * marked dirty, so qcircuit_update only recomputes the products that
+ * depend on them. The state must be simulated again. */
+QBOOL
+qcircuit_bind (qcircuit_t *circuit, const double *params)
+{
+  struct qparam_set set;
+  unsigned int i;
+  QBOOL ok = Q_TRUE;
+
+  if (!qparam_set_init (&set, circuit))
+    return Q_FALSE;
+
+  for (i = 0; ok && i < set.count; ++i)
+  {
+    /* Gates belong to the database, which is where they are shared */
+    ok = qgate_bind ((qgate_t *) set.gates[i], params);
+    params += set.gates[i]->family->params;
+  }
+
+  qparam_set_finalize (&set);
+
+  qcircuit_check_params (circuit);
+
+  circuit->updated   = Q_FALSE;
+  circuit->has_state = Q_FALSE;
+
+  return ok;
+}
+
+/* Batch evaluation. Each worker has a copy of the circuit whose
+ * parametric gates are private: the wiring list, the fixed gates (and
+ * their sparse matrices) and the state vector allocation are reused
+ * across bindings, and only the parametric gates are refilled. */
+struct qbatch_worker
+{
+  qcircuit_t *circuit;
+  qgate_t **gates;
+};
+
+struct qbatch
+{
+  const qcircuit_t *circuit;
+  struct qparam_set set;
+  unsigned int param_count;
+
+  uint64_t basis;
+  const double *bindings;
+  unsigned int count;
+
+  qcircuit_batch_fn_t fn;
+  void *priv;
+
+  struct qbatch_worker *workers;
+  unsigned int worker_count;
+};
+
+static void
+qbatch_worker_finalize (struct qbatch *batch, struct qbatch_worker *worker)
+{
+  unsigned int i;
+
+  if (worker->circuit != NULL)
+    qcircuit_destroy (worker->circuit);
+
+  if (worker->gates != NULL)
+  {
+    for (i = 0; i < batch->set.count; ++i)
+      if (worker->gates[i] != NULL)
+        qgate_destroy (worker->gates[i]);
+
+    free (worker->gates);
+  }
+}
+
+static QBOOL
+qbatch_worker_init (struct qbatch *batch, struct qbatch_worker *worker)
+{
+  const qcircuit_t *circuit = batch->circuit;
+  const qgate_t *gate;
+  const qwiring_t *this;
+  qwiring_t *wiring;
+  unsigned int i;
+  int index;
+
+  if ((worker->circuit = qcircuit_new (circuit->order, circuit->name)) == NULL)
+    goto fail;
+
+  if (batch->set.count > 0 &&
+      (worker->gates = calloc (batch->set.count, sizeof (qgate_t *))) == NULL)
+    goto fail;
+
+  for (i = 0; i < batch->set.count; ++i)
+    if ((worker->gates[i] = qgate_param_new (
+        batch->set.gates[i]->family->name,
+        batch->set.gates[i]->name,
+        batch->set.gates[i]->description,
+        batch->set.gates[i]->params)) == NULL)
+      return Q_FALSE;
+
+  if (circuit->storage != NULL &&
+      !qcircuit_set_storage (worker->circuit, circuit->storage))
+    return Q_FALSE;
+
+  /* Wirings are copied as they are, on physical qubits */
+  if (circuit->layout != NULL)
+  {
+    if ((worker->circuit->layout =
+        malloc (circuit->order * sizeof (unsigned int))) == NULL)
+      goto fail;
+
+    memcpy (
+        worker->circuit->layout,
+        circuit->layout,
+        circuit->order * sizeof (unsigned int));
+  }
+
+  for (this = circuit->wiring_head; this != NULL; this = this->next)
+  {
+    gate = this->gate;
+
+    if ((index = qparam_set_find (&batch->set, gate)) != -1)
+      gate = worker->gates[index];
+
+    if ((wiring = qwiring_new (gate, this->remap)) == NULL)
+      goto fail;
+
+    if (!qcircuit_append_wiring (worker->circuit, wiring))
+    {
+      qwiring_destroy (wiring);
+      return Q_FALSE;
+    }
+  }
+
+  return Q_TRUE;
+
+fail:
+  q_set_last_error ("qcircuit_simulate_batch: memory exhausted");
+
+  return Q_FALSE;
+}
+
+static QBOOL
+qbatch_run (unsigned int job, void *priv)
+{
+  struct qbatch *batch = (struct qbatch *) priv;
+  struct qbatch_worker *worker = &batch->workers[job];
+  const double *params;
+  unsigned int i, k;
+
+  for (i = job; i < batch->count; i += batch->worker_count)
+  {
+    params = batch->bindings + (uint64_t) i * batch->param_count;
+
+    for (k = 0; k < batch->set.count; ++k)
+    {
+      if (!qgate_bind (worker->gates[k], params))
+        return Q_FALSE;
+
+      params += worker->gates[k]->family->params;
+    }
+
+    if (!qcircuit_simulate_basis (worker->circuit, batch->basis))
+      return Q_FALSE;
+
+    if (!(batch->fn) (worker->circuit, i, batch->priv))
+      return Q_FALSE;
+  }
+
+  return Q_TRUE;
+}
+
+/* Simulate the circuit on a basis state for count bindings of its
+ * parameters (bindings holds count rows of qcircuit_get_param_count
+ * values), calling fn with the result of each. Small circuits run one
+ * binding per thread; circuits big enough to split a single simulation
+ * among threads run bindings one after the other. The circuit and its
+ * gates are not modified. */
+QBOOL
+qcircuit_simulate_batch (
+    const qcircuit_t *circuit,
+    uint64_t basis,
+    const double *bindings,
+    unsigned int count,
+    qcircuit_batch_fn_t fn,
+    void *priv)
+{
+  struct qbatch batch;
+  unsigned int i;
+  QBOOL ok = Q_FALSE;
+
+  memset (&batch, 0, sizeof (struct qbatch));
+
+  if (count == 0)
+    return Q_TRUE;
+
+  if (!qparam_set_init (&batch.set, circuit))
+    return Q_FALSE;
+
+  batch.circuit  = circuit;
+  batch.basis    = basis;
+  batch.bindings = bindings;
+  batch.count    = count;
+  batch.fn       = fn;
+  batch.priv     = priv;
+
+  for (i = 0; i < batch.set.count; ++i)
+    batch.param_count += batch.set.gates[i]->family->params;
+
+  batch.worker_count = 1;
+
+  if (circuit->order < QCIRCUIT_PARALLEL_SWEEP_ORDER_MIN)
+    batch.worker_count = q_get_thread_count ();
+
+  if (batch.worker_count > count)
+    batch.worker_count = count;
+
+  if ((batch.workers = calloc (
+      batch.worker_count,
+      sizeof (struct qbatch_worker))) == NULL)
+  {
+    q_set_last_error ("qcircuit_simulate_batch: memory exhausted");
+    goto done;
+  }
+
+  for (i = 0; i < batch.worker_count; ++i)
+    if (!qbatch_worker_init (&batch, &batch.workers[i]))
+      goto done;
+
+  ok = q_parallel_for (batch.worker_count, qbatch_run, &batch);
+
+done:
+  if (batch.workers != NULL)
+  {
+    for (i = 0; i < batch.worker_count; ++i)
+      qbatch_worker_finalize (&batch, &batch.workers[i]);
+
+    free (batch.workers);
+  }
+
+  qparam_set_finalize (&batch.set);
+
+  return ok;
+}
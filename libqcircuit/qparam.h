@@ -0,0 +1,53 @@
+/*
+  qparam.h: Parametric gates and circuits
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _LIBQCIRCUIT_QPARAM_H
+#define _LIBQCIRCUIT_QPARAM_H
+
+#include <stdint.h>
+
+#include "qcircuit.h"
+
+/* A family of gates of fixed order, whose coefficients are a function
+ * of a few real parameters. fill writes the row-major matrix. */
+struct qgate_family
+{
+  const char *name;
+  unsigned int order;
+  unsigned int params;
+  void (*fill) (const double *, QCOMPLEX *);
+};
+
+/* Called once per binding, with the circuit simulated for it. Calls may
+ * come from several threads at once, each with its own circuit. */
+typedef QBOOL (*qcircuit_batch_fn_t) (const qcircuit_t *, unsigned int, void *);
+
+const struct qgate_family *qgate_family_lookup (const char *);
+
+QBOOL qcircuit_simulate_batch (
+    const qcircuit_t *,
+    uint64_t,
+    const double *,
+    unsigned int,
+    qcircuit_batch_fn_t,
+    void *);
+
+#endif /* _LIBQCIRCUIT_QPARAM_H */
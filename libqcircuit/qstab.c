@@ -0,0 +1,596 @@
+/*
+  qstab.c: Stabilizer tableau simulation of Clifford circuits
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "qcircuit.h"
+#include "qstab.h"
+
+#define QSTAB_ROW(stab, row) ((row) * (stab)->words)
+#define QSTAB_BIT(qubit) (1ull << ((qubit) & 63))
+#define QSTAB_WORD(qubit) ((qubit) >> 6)
+
+static inline unsigned int
+qpauli_popcount (uint64_t bits)
+{
+  return __builtin_popcountll (bits);
+}
+
+/* i^e */
+static inline QCOMPLEX
+qpauli_phase (unsigned int e)
+{
+  static const QCOMPLEX phases[4] = {1, I, -1, -I};
+
+  return phases[e & 3];
+}
+
+/* (e, x, z) <- (e, x, z) * (e2, x2, z2). Moving Z^z past X^x2 flips the
+ * sign once per qubit where both are present. */
+static inline void
+qpauli_mul (
+    unsigned int *e,
+    uint32_t *x,
+    uint32_t *z,
+    unsigned int e2,
+    uint32_t x2,
+    uint32_t z2)
+{
+  *e  = (*e + e2 + 2 * qpauli_popcount (*z & x2)) & 3;
+  *x ^= x2;
+  *z ^= z2;
+}
+
+/****************************** Clifford gates *****************************/
+/* Find e, x, z such that m = i^e X^x Z^z. X^x Z^z |c> is
+ * (-1)^|c & z| |c ^ x>, so x is given by the nonzero row of the first
+ * column and z by the sign of the columns of a single bit. */
+static QBOOL
+qclifford_find_pauli (
+    const QCOMPLEX *m,
+    unsigned int order,
+    unsigned int *e,
+    uint32_t *x,
+    uint32_t *z)
+{
+  unsigned int i, length;
+  uint32_t r, c;
+  QCOMPLEX s, expected;
+
+  length = 1 << order;
+
+  for (r = 0; r < length; ++r)
+    if (cabs (m[r * length]) > .5)
+      break;
+
+  if (r == length)
+    return Q_FALSE;
+
+  *x = r;
+  *z = 0;
+  s  = m[r * length];
+
+  for (i = 0; i < order; ++i)
+    if (creal (m[(r ^ (1 << i)) * length + (1 << i)] / s) < 0)
+      *z |= 1 << i;
+
+  /* Hermitian Paulis have phases +1 or -1 */
+  for (*e = 0; *e < 4; ++*e)
+    if (cabs (s - qpauli_phase (*e)) < QCLIFFORD_EPSILON)
+      break;
+
+  if (*e == 4 || ((*e - qpauli_popcount (*x & *z)) & 1))
+    return Q_FALSE;
+
+  for (r = 0; r < length; ++r)
+    for (c = 0; c < length; ++c)
+    {
+      if (r == (c ^ *x))
+        expected = qpauli_phase (*e + 2 * qpauli_popcount (c & *z));
+      else
+        expected = 0;
+
+      if (cabs (m[r * length + c] - expected) > QCLIFFORD_EPSILON)
+        return Q_FALSE;
+    }
+
+  return Q_TRUE;
+}
+
+/* A unitary is Clifford if it maps every X_j and Z_j to a Pauli
+ * operator by conjugation. Returns NULL if the gate is not Clifford (or
+ * if memory is exhausted: either way, it cannot go to a tableau). */
+qclifford_t *
+qclifford_new (const qsparse_t *sparse, unsigned int order)
+{
+  QCOMPLEX u[1 << (2 * QCLIFFORD_ORDER_MAX)];
+  QCOMPLEX a[1 << (2 * QCLIFFORD_ORDER_MAX)];
+  QCOMPLEX m[1 << (2 * QCLIFFORD_ORDER_MAX)];
+  qclifford_t *new;
+  unsigned int e, g, j, length;
+  uint32_t r, c, k, bit;
+
+  if (order > QCLIFFORD_ORDER_MAX)
+    return NULL;
+
+  if ((new = calloc (1, sizeof (qclifford_t))) == NULL)
+    return NULL;
+
+  new->order = order;
+  length     = 1 << order;
+
+  for (r = 0; r < length; ++r)
+    for (c = 0; c < length; ++c)
+      u[r * length + c] = qsparse_get (sparse, r, c);
+
+  for (g = 0; g < 2 * order; ++g)
+  {
+    j   = g >> 1;
+    bit = 1 << j;
+
+    /* a = U P */
+    for (r = 0; r < length; ++r)
+      for (c = 0; c < length; ++c)
+        if (g & 1)
+          a[r * length + c] = (c & bit) ? -u[r * length + c] : u[r * length + c];
+        else
+          a[r * length + c] = u[r * length + (c ^ bit)];
+
+    /* m = U P U^dagger */
+    for (r = 0; r < length; ++r)
+      for (c = 0; c < length; ++c)
+      {
+        m[r * length + c] = 0;
+
+        for (k = 0; k < length; ++k)
+          m[r * length + c] += a[r * length + k] * conj (u[c * length + k]);
+      }
+
+    if (!qclifford_find_pauli (m, order, &e, new->x + g, new->z + g))
+    {
+      free (new);
+
+      return NULL;
+    }
+
+    new->e[g] = e;
+  }
+
+  return new;
+}
+
+void
+qclifford_destroy (qclifford_t *clifford)
+{
+  free (clifford);
+}
+
+/********************************* Tableau *********************************/
+void
+qstab_destroy (qstab_t *stab)
+{
+  if (stab->x != NULL)
+    free (stab->x);
+
+  if (stab->z != NULL)
+    free (stab->z);
+
+  if (stab->r != NULL)
+    free (stab->r);
+
+  free (stab);
+}
+
+/* Tableau of |0...0>: destabilizers X_i, stabilizers Z_i */
+void
+qstab_reset (qstab_t *stab)
+{
+  unsigned int i, rows = 2 * stab->order + 1;
+
+  memset (stab->x, 0, rows * stab->words * sizeof (uint64_t));
+  memset (stab->z, 0, rows * stab->words * sizeof (uint64_t));
+  memset (stab->r, 0, rows * sizeof (uint8_t));
+
+  for (i = 0; i < stab->order; ++i)
+  {
+    stab->x[QSTAB_ROW (stab, i) + QSTAB_WORD (i)] |= QSTAB_BIT (i);
+    stab->z[QSTAB_ROW (stab, i + stab->order) + QSTAB_WORD (i)] |= QSTAB_BIT (i);
+  }
+}
+
+qstab_t *
+qstab_new (unsigned int order)
+{
+  qstab_t *new;
+  unsigned int rows;
+
+  if ((new = calloc (1, sizeof (qstab_t))) == NULL)
+    goto fail;
+
+  new->order = order;
+  new->words = (order + 63) >> 6;
+
+  rows = 2 * order + 1;
+
+  if ((new->x = calloc (rows * new->words, sizeof (uint64_t))) == NULL)
+    goto fail;
+
+  if ((new->z = calloc (rows * new->words, sizeof (uint64_t))) == NULL)
+    goto fail;
+
+  if ((new->r = calloc (rows, sizeof (uint8_t))) == NULL)
+    goto fail;
+
+  qstab_reset (new);
+
+  return new;
+
+fail:
+  if (new != NULL)
+    qstab_destroy (new);
+
+  q_set_last_error ("qstab_new: memory exhausted");
+
+  return NULL;
+}
+
+/* Both tableaus must have the same order */
+void
+qstab_copy (qstab_t *dest, const qstab_t *src)
+{
+  unsigned int rows = 2 * src->order + 1;
+
+  memcpy (dest->x, src->x, rows * src->words * sizeof (uint64_t));
+  memcpy (dest->z, src->z, rows * src->words * sizeof (uint64_t));
+  memcpy (dest->r, src->r, rows * sizeof (uint8_t));
+}
+
+/* X anticommutes with every row having a Z (or Y) on the qubit */
+void
+qstab_apply_x (qstab_t *stab, unsigned int qubit)
+{
+  unsigned int i;
+
+  for (i = 0; i < 2 * stab->order; ++i)
+    if (stab->z[QSTAB_ROW (stab, i) + QSTAB_WORD (qubit)] & QSTAB_BIT (qubit))
+      stab->r[i] ^= 1;
+}
+
+/* Conjugate every row by the gate. The part of the row on the gate
+ * qubits is written as a product of X_j and Z_j, which are replaced by
+ * their images. */
+void
+qstab_apply (qstab_t *stab, const qclifford_t *clifford, const unsigned int *remap)
+{
+  unsigned int i, j, e;
+  uint32_t lx, lz, x, z;
+  uint64_t *rx, *rz;
+
+  for (i = 0; i < 2 * stab->order; ++i)
+  {
+    rx = stab->x + QSTAB_ROW (stab, i);
+    rz = stab->z + QSTAB_ROW (stab, i);
+
+    lx = lz = 0;
+
+    for (j = 0; j < clifford->order; ++j)
+    {
+      if (rx[QSTAB_WORD (remap[j])] & QSTAB_BIT (remap[j]))
+        lx |= 1 << j;
+
+      if (rz[QSTAB_WORD (remap[j])] & QSTAB_BIT (remap[j]))
+        lz |= 1 << j;
+    }
+
+    /* Rows with identities on all gate qubits are left alone */
+    if (lx == 0 && lz == 0)
+      continue;
+
+    e = x = z = 0;
+
+    for (j = 0; j < clifford->order; ++j)
+      if (lx & (1 << j))
+        qpauli_mul (&e, &x, &z, clifford->e[2 * j], clifford->x[2 * j], clifford->z[2 * j]);
+
+    for (j = 0; j < clifford->order; ++j)
+      if (lz & (1 << j))
+        qpauli_mul (
+            &e,
+            &x,
+            &z,
+            clifford->e[2 * j + 1],
+            clifford->x[2 * j + 1],
+            clifford->z[2 * j + 1]);
+
+    /* Y = iXZ on both sides */
+    e = 2 * stab->r[i] + qpauli_popcount (lx & lz) + e - qpauli_popcount (x & z);
+    stab->r[i] = (e & 3) >> 1;
+
+    for (j = 0; j < clifford->order; ++j)
+    {
+      rx[QSTAB_WORD (remap[j])] &= ~QSTAB_BIT (remap[j]);
+      rz[QSTAB_WORD (remap[j])] &= ~QSTAB_BIT (remap[j]);
+
+      if (x & (1 << j))
+        rx[QSTAB_WORD (remap[j])] |= QSTAB_BIT (remap[j]);
+
+      if (z & (1 << j))
+        rz[QSTAB_WORD (remap[j])] |= QSTAB_BIT (remap[j]);
+    }
+  }
+}
+
+/* Row h <- row i * row h */
+static void
+qstab_rowsum (qstab_t *stab, unsigned int h, unsigned int i)
+{
+  uint64_t *hx, *hz, *ix, *iz;
+  unsigned int w, e;
+
+  hx = stab->x + QSTAB_ROW (stab, h);
+  hz = stab->z + QSTAB_ROW (stab, h);
+  ix = stab->x + QSTAB_ROW (stab, i);
+  iz = stab->z + QSTAB_ROW (stab, i);
+
+  e = 2 * (stab->r[h] + stab->r[i]);
+
+  for (w = 0; w < stab->words; ++w)
+  {
+    e += qpauli_popcount (hx[w] & hz[w]) + qpauli_popcount (ix[w] & iz[w]);
+    e += 2 * qpauli_popcount (iz[w] & hx[w]);
+
+    hx[w] ^= ix[w];
+    hz[w] ^= iz[w];
+
+    e -= qpauli_popcount (hx[w] & hz[w]);
+  }
+
+  stab->r[h] = (e & 3) >> 1;
+}
+
+static void
+qstab_row_copy (qstab_t *stab, unsigned int dest, unsigned int src)
+{
+  memcpy (
+      stab->x + QSTAB_ROW (stab, dest),
+      stab->x + QSTAB_ROW (stab, src),
+      stab->words * sizeof (uint64_t));
+  memcpy (
+      stab->z + QSTAB_ROW (stab, dest),
+      stab->z + QSTAB_ROW (stab, src),
+      stab->words * sizeof (uint64_t));
+
+  stab->r[dest] = stab->r[src];
+}
+
+static void
+qstab_row_clear (qstab_t *stab, unsigned int row)
+{
+  memset (stab->x + QSTAB_ROW (stab, row), 0, stab->words * sizeof (uint64_t));
+  memset (stab->z + QSTAB_ROW (stab, row), 0, stab->words * sizeof (uint64_t));
+
+  stab->r[row] = 0;
+}
+
+/* Measure a qubit in the computational basis, collapsing the state. The
+ * outcome is random iff some stabilizer anticommutes with Z on it: then
+ * it is drawn with rand () if sample is set, and 0 otherwise. */
+static unsigned int
+__qstab_measure (qstab_t *stab, unsigned int qubit, QBOOL sample)
+{
+  unsigned int i, p, n;
+  unsigned int word;
+  uint64_t bit;
+
+  n    = stab->order;
+  word = QSTAB_WORD (qubit);
+  bit  = QSTAB_BIT (qubit);
+
+  for (p = n; p < 2 * n; ++p)
+    if (stab->x[QSTAB_ROW (stab, p) + word] & bit)
+      break;
+
+  if (p < 2 * n)
+  {
+    for (i = 0; i < 2 * n; ++i)
+      if (i != p && (stab->x[QSTAB_ROW (stab, i) + word] & bit))
+        qstab_rowsum (stab, i, p);
+
+    qstab_row_copy (stab, p - n, p);
+    qstab_row_clear (stab, p);
+
+    stab->z[QSTAB_ROW (stab, p) + word] |= bit;
+    stab->r[p] = sample && rand () > RAND_MAX / 2;
+
+    return stab->r[p];
+  }
+
+  /* Deterministic: Z on the qubit is a product of stabilizers */
+  qstab_row_clear (stab, 2 * n);
+
+  for (i = 0; i < n; ++i)
+    if (stab->x[QSTAB_ROW (stab, i) + word] & bit)
+      qstab_rowsum (stab, 2 * n, i + n);
+
+  return stab->r[2 * n];
+}
+
+unsigned int
+qstab_measure (qstab_t *stab, unsigned int qubit)
+{
+  return __qstab_measure (stab, qubit, Q_TRUE);
+}
+
+/* Expand the state into 1 << order amplitudes. Measuring a copy gives a
+ * basis state b in the support of psi (random outcomes are taken as 0,
+ * so that rand () is not touched), and projecting |b> onto the
+ * stabilized subspace gives psi (up to the global phase, which is lost
+ * in the stabilizer formalism: the amplitude of b is real positive). */
+QBOOL
+qstab_get_state (const qstab_t *stab, QCOMPLEX *psi)
+{
+  qstab_t *copy = NULL;
+  QCOMPLEX *tmp = NULL;
+  uint64_t b = 0, c, x, z, length;
+  unsigned int i, e;
+  double norm = 0;
+  QBOOL ok = Q_FALSE;
+
+  if (stab->order > QCIRCUIT_STATE_ORDER_MAX)
+  {
+    q_set_last_error ("qstab_get_state: too many qubits for a state vector");
+    return Q_FALSE;
+  }
+
+  length = 1ull << stab->order;
+
+  if ((copy = qstab_new (stab->order)) == NULL)
+    goto done;
+
+  if ((tmp = malloc (length * sizeof (QCOMPLEX))) == NULL)
+  {
+    q_set_last_error ("qstab_get_state: memory exhausted");
+    goto done;
+  }
+
+  qstab_copy (copy, stab);
+
+  for (i = 0; i < stab->order; ++i)
+    if (__qstab_measure (copy, i, Q_FALSE))
+      b |= 1ull << i;
+
+  memset (psi, 0, length * sizeof (QCOMPLEX));
+  psi[b] = 1;
+
+  /* psi <- (1 + S) psi / 2 for every stabilizer S */
+  for (i = stab->order; i < 2 * stab->order; ++i)
+  {
+    x = stab->x[QSTAB_ROW (stab, i)];
+    z = stab->z[QSTAB_ROW (stab, i)];
+    e = 2 * stab->r[i] + qpauli_popcount (x & z);
+
+    for (c = 0; c < length; ++c)
+      tmp[c ^ x] = qpauli_phase (e + 2 * qpauli_popcount (c & z)) * psi[c];
+
+    for (c = 0; c < length; ++c)
+      psi[c] = .5 * (psi[c] + tmp[c]);
+  }
+
+  for (c = 0; c < length; ++c)
+    norm += creal (psi[c] * conj (psi[c]));
+
+  norm = sqrt (norm);
+
+  for (c = 0; c < length; ++c)
+    psi[c] /= norm;
+
+  ok = Q_TRUE;
+
+done:
+  if (copy != NULL)
+    qstab_destroy (copy);
+
+  if (tmp != NULL)
+    free (tmp);
+
+  return ok;
+}
+
+void
+qstab_debug (const qstab_t *stab)
+{
+  unsigned int i, j;
+  uint64_t xb, zb;
+
+  for (i = stab->order; i < 2 * stab->order; ++i)
+  {
+    printf ("    %c", stab->r[i] ? '-' : '+');
+
+    for (j = 0; j < stab->order; ++j)
+    {
+      xb = stab->x[QSTAB_ROW (stab, i) + QSTAB_WORD (j)] & QSTAB_BIT (j);
+      zb = stab->z[QSTAB_ROW (stab, i) + QSTAB_WORD (j)] & QSTAB_BIT (j);
+
+      putchar (xb ? (zb ? 'Y' : 'X') : (zb ? 'Z' : 'I'));
+    }
+
+    putchar ('\n');
+  }
+}
+
+/**************************** Circuit simulation ***************************/
+QBOOL
+qcircuit_is_clifford (const qcircuit_t *circuit)
+{
+  const qwiring_t *this;
+
+  for (this = circuit->wiring_head; this != NULL; this = this->next)
+    if (this->gate->clifford == NULL)
+      return Q_FALSE;
+
+  return Q_TRUE;
+}
+
+/* Run a Clifford circuit on a tableau, starting from a basis state. The
+ * state vector is not touched (nor allocated): the cost is polynomial
+ * in the number of qubits. */
+QBOOL
+qcircuit_simulate_tableau (qcircuit_t *circuit, uint64_t basis)
+{
+  const qwiring_t *this;
+  unsigned int i;
+
+  if (!qcircuit_is_clifford (circuit))
+  {
+    q_set_last_error ("circuit `%s' is not a Clifford circuit", circuit->name);
+    return Q_FALSE;
+  }
+
+  qcircuit_discard_state (circuit);
+
+  if ((circuit->tableau = qstab_new (circuit->order)) == NULL)
+    return Q_FALSE;
+
+  if ((circuit->collapsed_tableau = qstab_new (circuit->order)) == NULL)
+  {
+    qcircuit_discard_state (circuit);
+    return Q_FALSE;
+  }
+
+  basis = qcircuit_to_physical (circuit, basis);
+
+  for (i = 0; i < circuit->order && i < 64; ++i)
+    if (basis & (1ull << i))
+      qstab_apply_x (circuit->tableau, i);
+
+  for (this = circuit->wiring_head; this != NULL; this = this->next)
+    qstab_apply (circuit->tableau, this->gate->clifford, this->remap);
+
+  if (!qcircuit_measure_reset (circuit))
+    return Q_FALSE;
+
+  circuit->has_state = Q_TRUE;
+
+  return Q_TRUE;
+}
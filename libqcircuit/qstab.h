@@ -0,0 +1,79 @@
+/*
+  qstab.h: Stabilizer tableau simulation of Clifford circuits
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _LIBQCIRCUIT_QSTAB_H
+#define _LIBQCIRCUIT_QSTAB_H
+
+#include <qsparse.h>
+#include <stdint.h>
+
+/* Gates up to this order are checked for being Clifford */
+#define QCLIFFORD_ORDER_MAX 4
+
+/* Tolerance when recognizing Pauli matrices */
+#define QCLIFFORD_EPSILON 1e-9
+
+/* Pauli operators are kept as i^e X^x Z^z, where bit j of x (z) puts
+ * an X (Z) on qubit j. A Clifford gate is described by the image of
+ * X_j (index 2j) and Z_j (index 2j + 1) under U P U^dagger. */
+struct qclifford
+{
+  unsigned int order;
+
+  uint8_t  e[2 * QCLIFFORD_ORDER_MAX];
+  uint32_t x[2 * QCLIFFORD_ORDER_MAX];
+  uint32_t z[2 * QCLIFFORD_ORDER_MAX];
+};
+
+typedef struct qclifford qclifford_t;
+
+/* Aaronson-Gottesman tableau: rows 0 .. order - 1 are destabilizers,
+ * rows order .. 2 * order - 1 stabilizers and row 2 * order is scratch.
+ * Each row has words 64-bit words of X bits and as many of Z bits, and
+ * a sign bit r, so that row = (-1)^r * P_0 P_1 ... (with Y = iXZ). */
+struct qstab
+{
+  unsigned int order;
+  unsigned int words;
+
+  uint64_t *x;
+  uint64_t *z;
+  uint8_t  *r;
+};
+
+typedef struct qstab qstab_t;
+
+qclifford_t *qclifford_new (const qsparse_t *, unsigned int);
+void qclifford_destroy (qclifford_t *);
+
+qstab_t *qstab_new (unsigned int);
+void qstab_reset (qstab_t *);
+void qstab_copy (qstab_t *, const qstab_t *);
+void qstab_destroy (qstab_t *);
+
+void qstab_apply_x (qstab_t *, unsigned int);
+void qstab_apply (qstab_t *, const qclifford_t *, const unsigned int *);
+unsigned int qstab_measure (qstab_t *, unsigned int);
+QBOOL qstab_get_state (const qstab_t *, QCOMPLEX *);
+
+void qstab_debug (const qstab_t *);
+
+#endif /* _LIBQCIRCUIT_QSTAB_H */
@@ -24,6 +24,11 @@
 #include "qcircuit.h"
 #include "qdb.h"
 
+/* The gate kind is stored in the upper bits of the order field, so
+ * matrix gates keep their original layout */
+#define QGATE_KIND_SHIFT 16
+#define QGATE_ORDER_MASK ((1 << QGATE_KIND_SHIFT) - 1)
+
 uint32_t
 qgate_serialize (const qgate_t *gate, void *buffer, uint32_t size)
 {
@@ -32,14 +37,31 @@ qgate_serialize (const qgate_t *gate, void *buffer, uint32_t size)
 
   qsb_init (&s, buffer, size);
 
-  qsb_write_uint32_t (&s, gate->order);
+  qsb_write_uint32_t (&s, gate->order | (gate->kind << QGATE_KIND_SHIFT));
 
   qsb_write_string (&s, gate->name);
 
   qsb_write_string (&s, gate->description);
 
+  /* Controlled gates refer to their target by name */
+  if (gate->kind == QGATE_KIND_CONTROLLED)
+  {
+    qsb_write_uint32_t (&s, gate->controls);
+    qsb_write_uint64_t (&s, gate->pattern);
+    qsb_write_string (&s, gate->target->name);
+
+    return qsb_tell (&s);
+  }
+  else if (gate->kind == QGATE_KIND_ORACLE)
+  {
+    for (i = 0; i < 1 << gate->order; ++i)
+      qsb_write_uint32_t (&s, gate->table[i]);
+
+    return qsb_tell (&s);
+  }
+
   /* TODO: if order > threshold, serialize sparse matrix directly */
-  length = 1 << (gate->order + 1);
+  length = 1 << (gate->order << 1);
 
   for (i = 0; i < length; ++i)
     qsb_write_complex (&s, gate->coef[i]);
@@ -48,14 +70,18 @@ qgate_serialize (const qgate_t *gate, void *buffer, uint32_t size)
 }
 
 qgate_t *
-qgate_deserialize (const void *buffer, uint32_t size)
+qgate_deserialize (const qdb_t *db, const void *buffer, uint32_t size)
 {
   struct qsb s;
   qgate_t *new = NULL;
+  const qgate_t *target;
   char *name = NULL;
   char *description = NULL;
-  unsigned int order, i, length;
-  QCOMPLEX coef;
+  char *target_name = NULL;
+  unsigned int order, kind, i, length;
+  uint32_t controls;
+  uint64_t pattern;
+  uint32_t *table = NULL;
 
   qsb_init (&s, (void *) buffer, size);
 
@@ -89,7 +115,73 @@ qgate_deserialize (const void *buffer, uint32_t size)
     goto fail;
   }
 
-  length = 1 << (order + 1);
+  kind   = order >> QGATE_KIND_SHIFT;
+  order &= QGATE_ORDER_MASK;
+
+  if (kind == QGATE_KIND_CONTROLLED)
+  {
+    if (!qsb_read_uint32_t (&s, &controls) ||
+        !qsb_read_uint64_t (&s, &pattern) ||
+        !qsb_read_string (&s, &target_name))
+    {
+      q_set_last_error ("Unexpected end-of-buffer while deserializing quantum gate");
+      goto fail;
+    }
+
+    if (target_name == NULL)
+    {
+      q_set_last_error ("Memory exhausted while deserializing quantum gate");
+      goto fail;
+    }
+
+    if ((target = qdb_lookup_qgate (db, target_name)) == NULL)
+    {
+      q_set_last_error ("Cannot find target gate '%s' in database", target_name);
+      goto fail;
+    }
+
+    if (target->order + controls != order)
+    {
+      q_set_last_error ("Order mismatch in controlled gate '%s'", name);
+      goto fail;
+    }
+
+    if ((new = qgate_controlled_new (name, description, target, controls, pattern)) == NULL)
+      goto fail;
+
+    goto done;
+  }
+  else if (kind == QGATE_KIND_ORACLE && order <= QGATE_ORACLE_ORDER_MAX)
+  {
+    length = 1 << order;
+
+    if (!qsb_ensure (&s, length * sizeof (uint32_t)))
+    {
+      q_set_last_error ("Unexpected end-of-buffer while reading oracle table");
+      goto fail;
+    }
+
+    if ((table = malloc (length * sizeof (uint32_t))) == NULL)
+    {
+      q_set_last_error ("Memory exhausted while deserializing quantum gate");
+      goto fail;
+    }
+
+    for (i = 0; i < length; ++i)
+      (void) qsb_read_uint32_t (&s, table + i);
+
+    if ((new = qgate_oracle_new (order, name, description, table)) == NULL)
+      goto fail;
+
+    goto done;
+  }
+  else if (kind != QGATE_KIND_MATRIX || order > QSPARSE_ORDER_MAX)
+  {
+    q_set_last_error ("Unsupported quantum gate '%s'", name);
+    goto fail;
+  }
+
+  length = 1 << (order << 1);
 
   if (!qsb_ensure (&s, length * QSB_QCOMPLEX_SERIALIZED_SIZE))
   {
@@ -109,9 +201,19 @@ qgate_deserialize (const void *buffer, uint32_t size)
   for (i = 0; i < length; ++i)
     (void) qsb_read_complex (&s, new->coef + i);
 
+  if (!qgate_init_sparse (new))
+    goto fail;
+
+done:
   free (name);
   free (description);
 
+  if (target_name != NULL)
+    free (target_name);
+
+  if (table != NULL)
+    free (table);
+
   return new;
 
 fail:
@@ -124,6 +226,12 @@ fail:
   if (description != NULL)
     free (description);
 
+  if (target_name != NULL)
+    free (target_name);
+
+  if (table != NULL)
+    free (table);
+
   return NULL;
 }
 
@@ -133,7 +241,7 @@ qwiring_serialize (const qwiring_t *wiring, void *buffer, uint32_t size)
   struct qsb s;
   unsigned int length, i;
 
-  length = 1 << wiring->gate->order;
+  length = wiring->gate->order;
 
   qsb_init (&s, buffer, size);
 
@@ -235,7 +343,7 @@ uint32_t
 qcircuit_serialize (const qcircuit_t *circuit, void *buffer, uint32_t size)
 {
   struct qsb s;
-  unsigned int wirings;
+  unsigned int wirings, i;
   qwiring_t *this;
   uint32_t wiring_size;
 
@@ -265,11 +373,18 @@ qcircuit_serialize (const qcircuit_t *circuit, void *buffer, uint32_t size)
     qsb_write_uint32_t (&s, wiring_size);
 
     /* Skip serialized wiring */
-    qsb_advance (&s, size);
+    qsb_advance (&s, wiring_size);
 
     this = qwiring_next (this);
   }
 
+  /* Qubit layout. Older files end right after the wirings. */
+  qsb_write_uint32_t (&s, circuit->layout != NULL);
+
+  if (circuit->layout != NULL)
+    for (i = 0; i < circuit->order; ++i)
+      qsb_write_uint32_t (&s, circuit->layout[i]);
+
   return qsb_tell (&s);
 }
 
@@ -281,6 +396,8 @@ qcircuit_deserialize (const qdb_t *db, const void *buffer, uint32_t size)
   uint32_t order;
   char *name = NULL;
   uint32_t wirings;
+  uint32_t has_layout, value;
+  uint64_t *used = NULL;
   qcircuit_t *circuit = NULL;
   qwiring_t *wiring;
 
@@ -316,6 +433,8 @@ qcircuit_deserialize (const qdb_t *db, const void *buffer, uint32_t size)
     goto fail;
   }
 
+  qcircuit_set_expcache (circuit, db->expcache);
+
   for (i = 0; i < wirings; ++i)
   {
     if (!qsb_read_uint32_t (&s, &wiring_size) || wiring_size > qsb_remainder (&s))
@@ -336,6 +455,38 @@ qcircuit_deserialize (const qdb_t *db, const void *buffer, uint32_t size)
     }
   }
 
+  if (qsb_remainder (&s) >= sizeof (uint32_t))
+  {
+    (void) qsb_read_uint32_t (&s, &has_layout);
+
+    if (has_layout)
+    {
+      /* Physical qubits already taken, one bit each */
+      if ((circuit->layout = malloc (order * sizeof (unsigned int))) == NULL ||
+          (used = calloc ((order + 63) / 64, sizeof (uint64_t))) == NULL)
+      {
+        q_set_last_error ("Memory exhausted while deserializing circuit");
+        goto fail;
+      }
+
+      for (i = 0; i < order; ++i)
+        if (!qsb_read_uint32_t (&s, &value) || value >= order ||
+            (used[value >> 6] & (1ull << (value & 63))))
+        {
+          q_set_last_error ("Invalid qubit layout while deserializing circuit");
+          goto fail;
+        }
+        else
+        {
+          circuit->layout[i] = value;
+          used[value >> 6] |= 1ull << (value & 63);
+        }
+    }
+  }
+
+  if (used != NULL)
+    free (used);
+
   free (name);
 
   return circuit;
@@ -344,6 +495,9 @@ fail:
   if (circuit != NULL)
     qcircuit_destroy (circuit);
 
+  if (used != NULL)
+    free (used);
+
   if (name != NULL)
     free (name);
 
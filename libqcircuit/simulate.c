@@ -0,0 +1,944 @@
+/*
+  simulate.c: State vector simulation of quantum circuits
+
+  Copyright (C) 2015 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qcircuit.h"
+#include "qmps.h"
+
+#define QSWEEP_JOBS_PER_THREAD 4
+
+static uint64_t
+qwiring_get_support (const qwiring_t *wiring)
+{
+  uint64_t support = 0;
+  unsigned int i;
+
+  for (i = 0; i < wiring->gate->order; ++i)
+    support |= 1ull << wiring->remap[i];
+
+  return support;
+}
+
+static unsigned int
+qmask_get_bits (uint64_t mask, unsigned int *bits)
+{
+  unsigned int i, n = 0;
+
+  for (i = 0; i < 64; ++i)
+    if (mask & (1ull << i))
+      bits[n++] = i;
+
+  return n;
+}
+
+/* Spread the bits of x over the given bit positions */
+static inline uint64_t
+qmask_deposit (uint64_t x, const unsigned int *bits, unsigned int n)
+{
+  uint64_t result = 0;
+  unsigned int i;
+
+  for (i = 0; i < n; ++i)
+    if (x & (1ull << i))
+      result |= 1ull << bits[i];
+
+  return result;
+}
+
+void
+qschedule_destroy (qschedule_t *schedule)
+{
+  if (schedule->layers != NULL)
+    free (schedule->layers);
+
+  if (schedule->wirings != NULL)
+    free (schedule->wirings);
+
+  free (schedule);
+}
+
+/* Place every wiring in the earliest layer after the last layer that
+ * touches any of its qubits. Moving a wiring before wirings acting on
+ * other qubits does not change the circuit, as they commute. */
+qschedule_t *
+qcircuit_schedule (const qcircuit_t *circuit)
+{
+  qschedule_t *new = NULL;
+  const qwiring_t *this;
+  unsigned int last[64];
+  unsigned int *layer_of = NULL;
+  unsigned int *offset = NULL;
+  unsigned int i, n, count = 0, layer;
+
+  if (circuit->order > 64)
+  {
+    q_set_last_error ("qcircuit_schedule: circuit too big");
+    return NULL;
+  }
+
+  for (this = circuit->wiring_head; this != NULL; this = this->next)
+    ++count;
+
+  if ((new = calloc (1, sizeof (qschedule_t))) == NULL)
+    goto fail;
+
+  if (count == 0)
+    return new;
+
+  if ((layer_of = malloc (count * sizeof (unsigned int))) == NULL)
+    goto fail;
+
+  memset (last, 0, sizeof (last));
+
+  for (n = 0, this = circuit->wiring_head; this != NULL; this = this->next, ++n)
+  {
+    layer = 0;
+
+    for (i = 0; i < this->gate->order; ++i)
+      if (last[this->remap[i]] > layer)
+        layer = last[this->remap[i]];
+
+    for (i = 0; i < this->gate->order; ++i)
+      last[this->remap[i]] = layer + 1;
+
+    layer_of[n] = layer;
+
+    if (layer + 1 > new->count)
+      new->count = layer + 1;
+  }
+
+  if ((new->layers = calloc (new->count, sizeof (struct qlayer))) == NULL ||
+      (new->wirings = malloc (count * sizeof (qwiring_t *))) == NULL ||
+      (offset = calloc (new->count, sizeof (unsigned int))) == NULL)
+    goto fail;
+
+  for (n = 0; n < count; ++n)
+    ++new->layers[layer_of[n]].count;
+
+  for (i = 1; i < new->count; ++i)
+    offset[i] = offset[i - 1] + new->layers[i - 1].count;
+
+  for (i = 0; i < new->count; ++i)
+  {
+    new->layers[i].wirings = new->wirings + offset[i];
+    new->layers[i].count   = 0;
+  }
+
+  for (n = 0, this = circuit->wiring_head; this != NULL; this = this->next, ++n)
+  {
+    layer = layer_of[n];
+
+    new->layers[layer].wirings[new->layers[layer].count++] = this;
+    new->layers[layer].support |= qwiring_get_support (this);
+  }
+
+  free (offset);
+  free (layer_of);
+
+  return new;
+
+fail:
+  q_set_last_error ("qcircuit_schedule: memory exhausted");
+
+  if (offset != NULL)
+    free (offset);
+
+  if (layer_of != NULL)
+    free (layer_of);
+
+  if (new != NULL)
+    qschedule_destroy (new);
+
+  return NULL;
+}
+
+/* A sweep applies a group of wirings acting on disjoint qubits in a
+ * single pass over the state vector. The amplitudes of the qubits of
+ * the group are gathered into a small buffer for every combination of
+ * the remaining qubits, all gates are applied to the buffer while it
+ * is in cache, and the result is written back.
+ */
+struct qsweep_entry
+{
+  unsigned int row;
+  unsigned int col;
+  QCOMPLEX value;
+};
+
+struct qsweep_gate
+{
+  uint64_t mask;        /* Gate qubits within the gathered buffer */
+  uint64_t ctrl;        /* Control qubits of mask that must be set */
+  uint64_t high_mask;   /* Control qubits above the buffer... */
+  uint64_t high_value;  /* ...and their required state */
+  uint64_t *offsets;    /* Buffer offset of each target basis state */
+  unsigned int length;  /* 1 << target order */
+  unsigned int count;   /* Number of nonzero coefficients */
+  struct qsweep_entry *entries;
+  const uint32_t *table; /* Oracles: basis state permutation */
+};
+
+struct qsweep
+{
+  QCOMPLEX *state;
+
+  unsigned int local_order;
+  uint64_t *offsets;    /* State offset of each buffer index */
+
+  unsigned int free_order;
+  unsigned int free_bits[64];
+
+  unsigned int gate_count;
+  struct qsweep_gate *gates;
+  unsigned int scratch; /* Longest gate */
+
+  uint64_t blocks;
+  uint64_t blocks_per_job;
+};
+
+static void
+qsweep_gate_finalize (struct qsweep_gate *gate)
+{
+  if (gate->offsets != NULL)
+    free (gate->offsets);
+
+  if (gate->entries != NULL)
+    free (gate->entries);
+}
+
+/* Prepare a wiring for qsweep_apply_gate. Qubit q of the circuit is
+ * bit local[q] of the buffer the gate will be applied to. Controls
+ * placed at or above local_order are checked by the caller against
+ * high_mask and high_value, and never need to be in the buffer.
+ *
+ * Controlled gates are applied as their target, only to the amplitudes
+ * whose control bits match. Oracles just move amplitudes around.
+ */
+static QBOOL
+qsweep_gate_init (
+    struct qsweep_gate *gate,
+    const qwiring_t *wiring,
+    const unsigned int *local,
+    unsigned int local_order)
+{
+  unsigned int gate_bits[QGATE_ORACLE_ORDER_MAX];
+  unsigned int j, n, bit, order;
+  const qsparse_t *sparse;
+  qsparse_iterator_t it;
+
+  memset (gate, 0, sizeof (struct qsweep_gate));
+
+  order  = qgate_target_order (wiring->gate);
+  sparse = wiring->gate->kind == QGATE_KIND_CONTROLLED ?
+      wiring->gate->target->sparse : wiring->gate->sparse;
+
+  if (wiring->gate->kind == QGATE_KIND_ORACLE)
+    gate->table = wiring->gate->table;
+  else if (sparse == NULL)
+  {
+    q_set_last_error ("qcircuit_simulate: gate `%s' not initialized", wiring->gate->name);
+    return Q_FALSE;
+  }
+
+  for (j = 0; j < wiring->gate->order; ++j)
+  {
+    bit = local[wiring->remap[j]];
+
+    if (j < order)
+    {
+      gate_bits[j] = bit;
+      gate->mask  |= 1ull << bit;
+    }
+    else if (bit < local_order)
+    {
+      gate->mask |= 1ull << bit;
+
+      if (wiring->gate->pattern & (1ull << (j - order)))
+        gate->ctrl |= 1ull << bit;
+    }
+    else
+    {
+      gate->high_mask |= 1ull << bit;
+
+      if (wiring->gate->pattern & (1ull << (j - order)))
+        gate->high_value |= 1ull << bit;
+    }
+  }
+
+  gate->length = 1 << order;
+
+  if ((gate->offsets = malloc (gate->length * sizeof (uint64_t))) == NULL)
+    goto fail;
+
+  for (j = 0; j < gate->length; ++j)
+    gate->offsets[j] = qmask_deposit (j, gate_bits, order);
+
+  if (gate->table != NULL)
+    return Q_TRUE;
+
+  for (
+        qsparse_iterator_init (sparse, &it);
+        !qsparse_iterator_end (&it);
+        qsparse_iterator_next (&it)
+        )
+    ++gate->count;
+
+  if ((gate->entries = malloc (
+      gate->count * sizeof (struct qsweep_entry))) == NULL)
+    goto fail;
+
+  n = 0;
+
+  for (
+        qsparse_iterator_init (sparse, &it);
+        !qsparse_iterator_end (&it);
+        qsparse_iterator_next (&it)
+        )
+  {
+    gate->entries[n].row   = qsparse_iterator_row (&it);
+    gate->entries[n].col   = qsparse_iterator_col (&it);
+    gate->entries[n].value = qsparse_get_from_iterator (sparse, &it);
+    ++n;
+  }
+
+  return Q_TRUE;
+
+fail:
+  q_set_last_error ("qcircuit_simulate: memory exhausted");
+
+  qsweep_gate_finalize (gate);
+
+  return Q_FALSE;
+}
+
+static void
+qsweep_finalize (struct qsweep *sweep)
+{
+  unsigned int i;
+
+  if (sweep->gates != NULL)
+  {
+    for (i = 0; i < sweep->gate_count; ++i)
+      qsweep_gate_finalize (&sweep->gates[i]);
+
+    free (sweep->gates);
+  }
+
+  if (sweep->offsets != NULL)
+    free (sweep->offsets);
+}
+
+static QBOOL
+qsweep_init (
+    struct qsweep *sweep,
+    qcircuit_t *circuit,
+    const qwiring_t **wirings,
+    unsigned int count,
+    uint64_t support)
+{
+  unsigned int local_bits[64], local[64];
+  unsigned int i;
+
+  memset (sweep, 0, sizeof (struct qsweep));
+
+  sweep->state       = circuit->state;
+  sweep->local_order = qmask_get_bits (support, local_bits);
+  sweep->free_order  = qmask_get_bits (
+      ~support & ((1ull << circuit->order) - 1),
+      sweep->free_bits);
+  sweep->blocks      = 1ull << sweep->free_order;
+
+  for (i = 0; i < sweep->local_order; ++i)
+    local[local_bits[i]] = i;
+
+  if ((sweep->offsets = malloc (
+      (1 << sweep->local_order) * sizeof (uint64_t))) == NULL)
+  {
+    q_set_last_error ("qcircuit_simulate: memory exhausted");
+    goto fail;
+  }
+
+  for (i = 0; i < 1 << sweep->local_order; ++i)
+    sweep->offsets[i] = qmask_deposit (i, local_bits, sweep->local_order);
+
+  if ((sweep->gates = calloc (count, sizeof (struct qsweep_gate))) == NULL)
+  {
+    q_set_last_error ("qcircuit_simulate: memory exhausted");
+    goto fail;
+  }
+
+  sweep->gate_count = count;
+
+  for (i = 0; i < count; ++i)
+  {
+    if (!qsweep_gate_init (&sweep->gates[i], wirings[i], local, sweep->local_order))
+      goto fail;
+
+    if (sweep->gates[i].length > sweep->scratch)
+      sweep->scratch = sweep->gates[i].length;
+  }
+
+  return Q_TRUE;
+
+fail:
+  qsweep_finalize (sweep);
+
+  return Q_FALSE;
+}
+
+/* Complex products are spelled out: the C99 operator checks for
+ * infinities and NaNs through a library call, which dominates the cost
+ * of these loops. */
+static void
+qsweep_apply_gate (const struct qsweep_gate *gate, QCOMPLEX *buffer, unsigned int length, QCOMPLEX *in)
+{
+  const struct qsweep_entry *entry;
+  QCOMPLEX *group, *out;
+  unsigned int base, i;
+
+  /* Enumerate all indices with the gate bits cleared, and select the
+   * ones whose controls match */
+  for (base = 0; base < length; base = ((base | gate->mask) + 1) & ~gate->mask)
+  {
+    group = buffer + (base | gate->ctrl);
+
+    if (gate->table != NULL)
+    {
+      for (i = 0; i < gate->length; ++i)
+        in[i] = group[gate->offsets[i]];
+
+      for (i = 0; i < gate->length; ++i)
+        group[gate->offsets[gate->table[i]]] = in[i];
+
+      continue;
+    }
+
+    for (i = 0; i < gate->length; ++i)
+    {
+      in[i] = group[gate->offsets[i]];
+      group[gate->offsets[i]] = 0;
+    }
+
+    for (i = 0; i < gate->count; ++i)
+    {
+      entry = &gate->entries[i];
+      out   = &group[gate->offsets[entry->row]];
+
+      *out += (creal (entry->value) * creal (in[entry->col]) -
+               cimag (entry->value) * cimag (in[entry->col])) +
+          I * (creal (entry->value) * cimag (in[entry->col]) +
+               cimag (entry->value) * creal (in[entry->col]));
+    }
+  }
+}
+
+static QBOOL
+qsweep_run (unsigned int job, void *priv)
+{
+  struct qsweep *sweep = (struct qsweep *) priv;
+  QCOMPLEX *buffer, *in;
+  uint64_t block, last, base;
+  unsigned int length, i, j;
+
+  length = 1 << sweep->local_order;
+
+  if ((buffer = malloc ((length + sweep->scratch) * sizeof (QCOMPLEX))) == NULL)
+  {
+    q_set_last_error ("qcircuit_simulate: memory exhausted");
+    return Q_FALSE;
+  }
+
+  in = buffer + length;
+
+  block = job * sweep->blocks_per_job;
+  last  = block + sweep->blocks_per_job;
+
+  if (last > sweep->blocks)
+    last = sweep->blocks;
+
+  for (; block < last; ++block)
+  {
+    base = qmask_deposit (block, sweep->free_bits, sweep->free_order);
+
+    for (i = 0; i < length; ++i)
+      buffer[i] = sweep->state[base + sweep->offsets[i]];
+
+    for (j = 0; j < sweep->gate_count; ++j)
+      qsweep_apply_gate (&sweep->gates[j], buffer, length, in);
+
+    for (i = 0; i < length; ++i)
+      sweep->state[base + sweep->offsets[i]] = buffer[i];
+  }
+
+  free (buffer);
+
+  return Q_TRUE;
+}
+
+/* Split units of work into jobs for q_parallel_for */
+static unsigned int
+qcircuit_get_jobs (const qcircuit_t *circuit, uint64_t units, uint64_t *per_job)
+{
+  uint64_t jobs = 1;
+
+  if (circuit->order >= QCIRCUIT_PARALLEL_SWEEP_ORDER_MIN)
+  {
+    jobs = q_get_thread_count () * QSWEEP_JOBS_PER_THREAD;
+
+    if (jobs > units)
+      jobs = units;
+  }
+
+  *per_job = (units + jobs - 1) / jobs;
+
+  return (units + *per_job - 1) / *per_job;
+}
+
+static QBOOL
+qcircuit_sweep (qcircuit_t *circuit, const qwiring_t **wirings, unsigned int count, uint64_t support)
+{
+  struct qsweep sweep;
+  unsigned int jobs;
+  QBOOL ok;
+
+  if (!qsweep_init (&sweep, circuit, wirings, count, support))
+    return Q_FALSE;
+
+  jobs = qcircuit_get_jobs (circuit, sweep.blocks, &sweep.blocks_per_job);
+
+  ok = q_parallel_for (jobs, qsweep_run, &sweep);
+
+  qsweep_finalize (&sweep);
+
+  return ok;
+}
+
+/* Cache-blocked execution. When every gate of a run acts on qubits
+ * below QCIRCUIT_BLOCK_ORDER, each contiguous block of
+ * 1 << QCIRCUIT_BLOCK_ORDER amplitudes evolves independently, so the
+ * whole run is applied to one block (which stays in cache) before
+ * moving to the next one.
+ *
+ * Gates on higher qubits are brought down by relabeling: the high
+ * qubit is physically swapped with a low one, and a logical to
+ * physical map keeps track of where each qubit is. The low qubit given
+ * away is the one whose next use is farthest ahead. The original
+ * layout is restored at the end. Control qubits are never brought
+ * down: a control above the block selects whole blocks.
+ */
+struct qblock_run
+{
+  QCOMPLEX *state;
+  uint64_t blocks;
+  uint64_t blocks_per_job;
+
+  unsigned int gate_count;
+  struct qsweep_gate *gates;
+  unsigned int scratch; /* Longest gate */
+};
+
+static QBOOL
+qblock_run_job (unsigned int job, void *priv)
+{
+  struct qblock_run *run = (struct qblock_run *) priv;
+  QCOMPLEX *in;
+  QCOMPLEX *block;
+  uint64_t i, last;
+  unsigned int j;
+
+  if ((in = malloc (run->scratch * sizeof (QCOMPLEX))) == NULL)
+  {
+    q_set_last_error ("qcircuit_simulate: memory exhausted");
+    return Q_FALSE;
+  }
+
+  i    = job * run->blocks_per_job;
+  last = i + run->blocks_per_job;
+
+  if (last > run->blocks)
+    last = run->blocks;
+
+  for (; i < last; ++i)
+  {
+    block = run->state + (i << QCIRCUIT_BLOCK_ORDER);
+
+    for (j = 0; j < run->gate_count; ++j)
+      if (((i << QCIRCUIT_BLOCK_ORDER) & run->gates[j].high_mask) ==
+          run->gates[j].high_value)
+        qsweep_apply_gate (&run->gates[j], block, 1 << QCIRCUIT_BLOCK_ORDER, in);
+  }
+
+  free (in);
+
+  return Q_TRUE;
+}
+
+static QBOOL
+qblock_run_flush (const qcircuit_t *circuit, struct qblock_run *run)
+{
+  unsigned int jobs, i;
+  QBOOL ok;
+
+  if (run->gate_count == 0)
+    return Q_TRUE;
+
+  jobs = qcircuit_get_jobs (circuit, run->blocks, &run->blocks_per_job);
+
+  ok = q_parallel_for (jobs, qblock_run_job, run);
+
+  for (i = 0; i < run->gate_count; ++i)
+    qsweep_gate_finalize (&run->gates[i]);
+
+  run->gate_count = 0;
+  run->scratch    = 0;
+
+  return ok;
+}
+
+struct qswap
+{
+  QCOMPLEX *state;
+  uint64_t low;  /* Mask of the lower qubit */
+  uint64_t high; /* Mask of the higher qubit */
+  uint64_t length;
+  uint64_t per_job;
+};
+
+static QBOOL
+qswap_job (unsigned int job, void *priv)
+{
+  struct qswap *swap = (struct qswap *) priv;
+  QCOMPLEX tmp;
+  uint64_t i, last, j;
+
+  i    = job * swap->per_job;
+  last = i + swap->per_job;
+
+  if (last > swap->length)
+    last = swap->length;
+
+  for (; i < last; ++i)
+    if ((i & swap->high) && !(i & swap->low))
+    {
+      j = i ^ swap->high ^ swap->low;
+
+      tmp = swap->state[i];
+      swap->state[i] = swap->state[j];
+      swap->state[j] = tmp;
+    }
+
+  return Q_TRUE;
+}
+
+/* Exchange physical qubits a and b, and update the qubit maps */
+static QBOOL
+qcircuit_swap_qubits (
+    qcircuit_t *circuit,
+    unsigned int *map,
+    unsigned int *inv,
+    unsigned int a,
+    unsigned int b)
+{
+  struct qswap swap;
+  unsigned int jobs, tmp;
+
+  swap.state  = circuit->state;
+  swap.low    = 1ull << (a < b ? a : b);
+  swap.high   = 1ull << (a < b ? b : a);
+  swap.length = 1ull << circuit->order;
+
+  jobs = qcircuit_get_jobs (circuit, swap.length, &swap.per_job);
+
+  if (!q_parallel_for (jobs, qswap_job, &swap))
+    return Q_FALSE;
+
+  map[inv[a]] = b;
+  map[inv[b]] = a;
+
+  tmp    = inv[a];
+  inv[a] = inv[b];
+  inv[b] = tmp;
+
+  return Q_TRUE;
+}
+
+/* Low physical qubit (not in busy) whose logical qubit is needed last */
+static unsigned int
+qcircuit_pick_victim (const qwiring_t *wiring, const unsigned int *inv, uint64_t busy)
+{
+  const qwiring_t *this;
+  uint64_t candidates, used;
+  unsigned int i, n, p, victim = 0;
+
+  candidates = ((1ull << QCIRCUIT_BLOCK_ORDER) - 1) & ~busy;
+
+  for (
+      this = wiring->next, n = 0;
+      this != NULL && n < QCIRCUIT_RELABEL_LOOKAHEAD;
+      this = this->next, ++n)
+  {
+    used = 0;
+
+    for (p = 0; p < QCIRCUIT_BLOCK_ORDER; ++p)
+      if (candidates & (1ull << p))
+        for (i = 0; i < this->gate->order; ++i)
+          if (this->remap[i] == inv[p])
+            used |= 1ull << p;
+
+    if ((candidates & ~used) == 0)
+      break;
+
+    candidates &= ~used;
+  }
+
+  /* Any of the remaining candidates is as good as the others */
+  while (!(candidates & (1ull << victim)))
+    ++victim;
+
+  return victim;
+}
+
+static QBOOL
+qcircuit_simulate_blocked (qcircuit_t *circuit)
+{
+  struct qblock_run run;
+  const qwiring_t *this;
+  unsigned int map[64], inv[64];
+  unsigned int i, count = 0;
+  uint64_t busy;
+  QBOOL ok = Q_FALSE;
+
+  for (this = circuit->wiring_head; this != NULL; this = this->next)
+    ++count;
+
+  memset (&run, 0, sizeof (struct qblock_run));
+
+  run.state  = circuit->state;
+  run.blocks = 1ull << (circuit->order - QCIRCUIT_BLOCK_ORDER);
+
+  if (count > 0)
+    if ((run.gates = malloc (count * sizeof (struct qsweep_gate))) == NULL)
+    {
+      q_set_last_error ("qcircuit_simulate: memory exhausted");
+      return Q_FALSE;
+    }
+
+  for (i = 0; i < circuit->order; ++i)
+    map[i] = inv[i] = i;
+
+  for (this = circuit->wiring_head; this != NULL; this = this->next)
+  {
+    if (qgate_target_order (this->gate) > QCIRCUIT_BLOCK_ORDER)
+    {
+      q_set_last_error (
+          "qcircuit_simulate: gate `%s' does not fit in a block",
+          this->gate->name);
+      goto done;
+    }
+
+    busy = 0;
+
+    for (i = 0; i < qgate_target_order (this->gate); ++i)
+      if (map[this->remap[i]] < QCIRCUIT_BLOCK_ORDER)
+        busy |= 1ull << map[this->remap[i]];
+
+    /* Controls may stay above the block */
+    for (i = 0; i < qgate_target_order (this->gate); ++i)
+      if (map[this->remap[i]] >= QCIRCUIT_BLOCK_ORDER)
+      {
+        if (!qblock_run_flush (circuit, &run))
+          goto done;
+
+        if (!qcircuit_swap_qubits (
+            circuit,
+            map,
+            inv,
+            map[this->remap[i]],
+            qcircuit_pick_victim (this, inv, busy)))
+          goto done;
+
+        busy |= 1ull << map[this->remap[i]];
+      }
+
+    if (!qsweep_gate_init (
+        &run.gates[run.gate_count],
+        this,
+        map,
+        QCIRCUIT_BLOCK_ORDER))
+      goto done;
+
+    if (run.gates[run.gate_count].length > run.scratch)
+      run.scratch = run.gates[run.gate_count].length;
+
+    ++run.gate_count;
+  }
+
+  if (!qblock_run_flush (circuit, &run))
+    goto done;
+
+  /* Restore the original layout */
+  for (i = 0; i < circuit->order; ++i)
+    if (map[i] != i)
+      if (!qcircuit_swap_qubits (circuit, map, inv, map[i], i))
+        goto done;
+
+  ok = Q_TRUE;
+
+done:
+  for (i = 0; i < run.gate_count; ++i)
+    qsweep_gate_finalize (&run.gates[i]);
+
+  if (run.gates != NULL)
+    free (run.gates);
+
+  return ok;
+}
+
+/* All wirings of a layer share a single pass over the state vector (or
+ * a few, if the layer touches more than QCIRCUIT_SWEEP_ORDER_MAX
+ * qubits) */
+static QBOOL
+qcircuit_simulate_layers (qcircuit_t *circuit)
+{
+  qschedule_t *schedule;
+  const struct qlayer *layer;
+  uint64_t support;
+  unsigned int i, first, last, order;
+  QBOOL ok = Q_TRUE;
+
+  if ((schedule = qcircuit_schedule (circuit)) == NULL)
+    return Q_FALSE;
+
+  for (i = 0; ok && i < schedule->count; ++i)
+  {
+    layer = &schedule->layers[i];
+
+    for (first = 0; ok && first < layer->count; first = last)
+    {
+      support = 0;
+      order   = 0;
+
+      for (last = first; last < layer->count; ++last)
+      {
+        if (last > first &&
+            order + layer->wirings[last]->gate->order > QCIRCUIT_SWEEP_ORDER_MAX)
+          break;
+
+        support |= qwiring_get_support (layer->wirings[last]);
+        order   += layer->wirings[last]->gate->order;
+      }
+
+      ok = qcircuit_sweep (circuit, layer->wirings + first, last - first, support);
+    }
+  }
+
+  qschedule_destroy (schedule);
+
+  return ok;
+}
+
+/* States that fit in cache are processed layer by layer, bigger states
+ * in cache-sized blocks. */
+static QBOOL
+qcircuit_simulate_state (qcircuit_t *circuit)
+{
+  QBOOL ok;
+
+  if (circuit->order > QCIRCUIT_BLOCK_ORDER)
+    ok = qcircuit_simulate_blocked (circuit);
+  else
+    ok = qcircuit_simulate_layers (circuit);
+
+  if (!ok)
+    return Q_FALSE;
+
+  if (!qcircuit_measure_reset (circuit))
+    return Q_FALSE;
+
+  circuit->has_state = Q_TRUE;
+
+  return Q_TRUE;
+}
+
+/* Apply the circuit to psi without building its operator */
+QBOOL
+qcircuit_simulate (qcircuit_t *circuit, const QCOMPLEX *psi)
+{
+  if (!qcircuit_alloc_state (circuit))
+    return Q_FALSE;
+
+  qcircuit_import_state (circuit, psi, circuit->state);
+
+  return qcircuit_simulate_state (circuit);
+}
+
+/* Apply the circuit to a basis state, on a state vector (possibly
+ * out-of-core, see qcircuit_set_storage) whenever it fits. Bigger
+ * Clifford circuits go to the stabilizer tableau, which scales to
+ * hundreds of qubits (qubits above the 64th start at |0>) but loses the
+ * global phase: callers that do not need it can ask for the tableau
+ * with qcircuit_simulate_tableau. Anything else made of 1 and 2 qubit
+ * gates goes to a matrix product state with the default truncation.
+ */
+QBOOL
+qcircuit_simulate_basis (qcircuit_t *circuit, uint64_t basis)
+{
+  if (circuit->order < 64 && (basis >> circuit->order) != 0)
+  {
+    q_set_last_error ("qcircuit_simulate_basis: invalid basis state");
+    return Q_FALSE;
+  }
+
+  if (circuit->order <= qcircuit_state_order_max (circuit))
+    return qcircuit_simulate_basis_state (circuit, basis);
+
+  if (qcircuit_is_clifford (circuit))
+    return qcircuit_simulate_tableau (circuit, basis);
+
+  return qcircuit_simulate_mps (
+      circuit,
+      basis,
+      QMPS_BOND_MAX_DEFAULT,
+      QMPS_THRESHOLD_DEFAULT);
+}
+
+/* Same, always on a state vector */
+QBOOL
+qcircuit_simulate_basis_state (qcircuit_t *circuit, uint64_t basis)
+{
+  if (circuit->order < 64 && (basis >> circuit->order) != 0)
+  {
+    q_set_last_error ("qcircuit_simulate_basis_state: invalid basis state");
+    return Q_FALSE;
+  }
+
+  if (!qcircuit_alloc_state (circuit))
+    return Q_FALSE;
+
+  memset (circuit->state, 0, (1ull << circuit->order) * sizeof (QCOMPLEX));
+
+  circuit->state[qcircuit_to_physical (circuit, basis)] = 1;
+
+  return qcircuit_simulate_state (circuit);
+}
@@ -70,6 +70,12 @@ main (int argc, char *argv[])
   QCOMPLEX state[8] = {0};
   qcircuit_t *send, *recv;
   unsigned int measure;
+  qcache_t *cache;
+  const char *cache_dir;
+  const char *fuse_order;
+  const char *optimize;
+  const char *relabel;
+  const char *dd;
 
   if (argc != 3)
   {
@@ -96,6 +102,34 @@ main (int argc, char *argv[])
     exit (EXIT_FAILURE);
   }
 
+  if ((cache_dir = getenv (QAS_CACHE_DIR_ENV)) != NULL && *cache_dir != '\0')
+  {
+    if ((cache = qcache_new (cache_dir)) == NULL)
+    {
+      fprintf (stderr, "%s: cannot open operator cache: %s\n",
+               argv[0],
+               q_get_last_error ());
+
+      qas_close (ctx);
+
+      exit (EXIT_FAILURE);
+    }
+
+    qdb_set_cache (ctx->qdb, cache);
+  }
+
+  if ((optimize = getenv (QAS_OPTIMIZE_ENV)) != NULL && *optimize != '\0')
+    ctx->optimize = atoi (optimize) != 0;
+
+  if ((fuse_order = getenv (QAS_FUSE_ORDER_ENV)) != NULL && *fuse_order != '\0')
+    ctx->fuse_order = atoi (fuse_order);
+
+  if ((relabel = getenv (QAS_RELABEL_ENV)) != NULL && *relabel != '\0')
+    ctx->relabel = atoi (relabel) != 0;
+
+  if ((dd = getenv (QAS_DD_ENV)) != NULL && *dd != '\0')
+    ctx->dd = atoi (dd) != 0;
+
   if (!qas_parse (ctx))
   {
     fprintf (stderr, "error: %s:%d: %s\n",
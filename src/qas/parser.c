@@ -158,8 +158,15 @@ QINSTDECL(circuit);
 QINSTDECL(end);
 QINSTDECL(include);
 QINSTDECL(gate);
+QINSTDECL(cgate);
+QINSTDECL(pgate);
+QINSTDECL(oracle);
 QINSTDECL(coef);
+QINSTDECL(map);
+QINSTDECL(xor);
 QINSTDECL(qubit);
+QINSTDECL(repeat);
+QINSTDECL(call);
 
 QINSTDECL(__generic_gate);
 
@@ -167,10 +174,17 @@ struct qas_instruction instructions[] =
 {
     {".circuit", QINSTFUNC (circuit)},
     {".gate",    QINSTFUNC (gate)},
+    {".cgate",   QINSTFUNC (cgate)},
+    {".pgate",   QINSTFUNC (pgate)},
+    {".oracle",  QINSTFUNC (oracle)},
+    {".map",     QINSTFUNC (map)},
+    {".xor",     QINSTFUNC (xor)},
     {".end",     QINSTFUNC (end)},
     {".include", QINSTFUNC (include)},
     {".coef",    QINSTFUNC (coef)},
     {".qubit",   QINSTFUNC (qubit)},
+    {".repeat",  QINSTFUNC (repeat)},
+    {".call",    QINSTFUNC (call)},
     {NULL,       QINSTFUNC (__generic_gate)} /* Generic gate parser */
 };
 
@@ -198,140 +212,1137 @@ QINSTDECL(circuit)
   if ((ctx->curr_circuit = qcircuit_new (qubits, Q_ARG (0))) == NULL)
     return Q_FALSE;
 
+  qcircuit_set_expcache (ctx->curr_circuit, ctx->qdb->expcache);
+
   ctx->ctx_kind = QAS_CTX_KIND_CIRCUIT;
 
-  return Q_TRUE;
+  return Q_TRUE;
+}
+
+QINSTDECL(gate)
+{
+  unsigned int qubits;
+  char *desc;
+
+  Q_ENSURE_ARGS (3);
+  Q_ENSURE_CONTEXT (QAS_CTX_KIND_GLOBAL);
+
+  Q_ENSURE_IDENTIFIER (0);
+  Q_ENSURE_NUM (1);
+  Q_ENSURE_STRING (2);
+
+  /* Avoid gate redefinitions */
+  if (qdb_lookup_qgate (ctx->qdb, Q_ARG (0)) != NULL)
+  {
+    qas_set_error (ctx, "redefinition of quantum gate `%s'", Q_ARG (0));
+
+    return Q_FALSE;
+  }
+
+  Q_PARSE_NUM (1, qubits);
+
+  /* Create gate */
+  if ((desc = q_string_remove_quotes (Q_ARG (2))) == NULL)
+  {
+    qas_set_error (ctx, "memory exhausted");
+
+    return Q_FALSE;
+  }
+
+  if ((ctx->curr_gate = qgate_new (qubits, Q_ARG (0), desc, NULL)) == NULL)
+  {
+    qas_set_error (ctx, "failed to create gate: %s", q_get_last_error ());
+
+    free (desc);
+
+    return Q_FALSE;
+  }
+
+  ctx->curr_coef   = 0;
+  ctx->curr_inputs = 0;
+
+  free (desc);
+
+  ctx->ctx_kind = QAS_CTX_KIND_GATE;
+
+  return Q_TRUE;
+}
+
+/* .cgate name, controls, target, "description"[, pattern]
+ *
+ * Defines a gate applying target to its first qubits when the next
+ * `controls' qubits are set (or, if pattern is given, when control k
+ * equals bit k of pattern). The full matrix is never built, so any
+ * number of controls is allowed.
+ */
+QINSTDECL(cgate)
+{
+  unsigned int controls;
+  uint64_t pattern;
+  const qgate_t *target;
+  qgate_t *gate;
+  char *desc, *end;
+
+  Q_ENSURE_MIN_ARGS (4);
+  Q_ENSURE_CONTEXT (QAS_CTX_KIND_GLOBAL);
+
+  if (fastlist_size (args) > 5)
+  {
+    qas_set_error (ctx, "%s: too many arguments", inst);
+
+    return Q_FALSE;
+  }
+
+  Q_ENSURE_IDENTIFIER (0);
+  Q_ENSURE_NUM (1);
+  Q_ENSURE_IDENTIFIER (2);
+  Q_ENSURE_STRING (3);
+
+  if (qdb_lookup_qgate (ctx->qdb, Q_ARG (0)) != NULL)
+  {
+    qas_set_error (ctx, "redefinition of quantum gate `%s'", Q_ARG (0));
+
+    return Q_FALSE;
+  }
+
+  if ((target = qdb_lookup_qgate (ctx->qdb, Q_ARG (2))) == NULL)
+  {
+    qas_set_error (ctx, "unrecognized gate `%s'", Q_ARG (2));
+
+    return Q_FALSE;
+  }
+
+  Q_PARSE_NUM (1, controls);
+
+  if (controls == 0 || controls > 64)
+  {
+    qas_set_error (ctx, "%s: invalid number of controls", inst);
+
+    return Q_FALSE;
+  }
+
+  pattern = controls == 64 ? ~0ull : (1ull << controls) - 1;
+
+  if (fastlist_size (args) == 5)
+  {
+    Q_ENSURE_NUM (4);
+
+    pattern = strtoull (Q_ARG (4), &end, 0);
+
+    if (*end != '\0')
+    {
+      qas_set_error (ctx, "%s: argument 5 not a number", inst);
+
+      return Q_FALSE;
+    }
+  }
+
+  if ((desc = q_string_remove_quotes (Q_ARG (3))) == NULL)
+  {
+    qas_set_error (ctx, "memory exhausted");
+
+    return Q_FALSE;
+  }
+
+  gate = qgate_controlled_new (Q_ARG (0), desc, target, controls, pattern);
+
+  free (desc);
+
+  if (gate == NULL)
+  {
+    qas_set_error (ctx, "failed to create gate: %s", q_get_last_error ());
+
+    return Q_FALSE;
+  }
+
+  if (!qdb_register_qgate (ctx->qdb, gate))
+  {
+    qas_set_error (ctx, "cannot register gate: %s", q_get_last_error ());
+
+    qgate_destroy (gate);
+
+    return Q_FALSE;
+  }
+
+  return Q_TRUE;
+}
+
+/* .pgate name, family, "description"[, param...]
+ *
+ * Defines a gate of a parametric family (rx, ry, rz, phase, u3, cphase,
+ * crz, rzz), bound to the given parameters (0 if omitted). It can be
+ * rebound later without rebuilding the circuits using it.
+ */
+QINSTDECL(pgate)
+{
+  const struct qgate_family *family;
+  double params[QGATE_PARAMS_MAX] = {0};
+  unsigned int i;
+  qgate_t *gate;
+  char *desc, *end;
+
+  Q_ENSURE_MIN_ARGS (3);
+  Q_ENSURE_CONTEXT (QAS_CTX_KIND_GLOBAL);
+
+  Q_ENSURE_IDENTIFIER (0);
+  Q_ENSURE_IDENTIFIER (1);
+  Q_ENSURE_STRING (2);
+
+  if (qdb_lookup_qgate (ctx->qdb, Q_ARG (0)) != NULL)
+  {
+    qas_set_error (ctx, "redefinition of quantum gate `%s'", Q_ARG (0));
+
+    return Q_FALSE;
+  }
+
+  if ((family = qgate_family_lookup (Q_ARG (1))) == NULL)
+  {
+    qas_set_error (ctx, "%s: unknown gate family `%s'", inst, Q_ARG (1));
+
+    return Q_FALSE;
+  }
+
+  if (fastlist_size (args) > 3 + family->params)
+  {
+    qas_set_error (
+        ctx,
+        "%s: family `%s' takes %d parameters",
+        inst,
+        family->name,
+        family->params);
+
+    return Q_FALSE;
+  }
+
+  for (i = 3; i < fastlist_size (args); ++i)
+  {
+    params[i - 3] = strtod (Q_ARG (i), &end);
+
+    if (*end != '\0')
+    {
+      qas_set_error (ctx, "%s: argument %d not a number", inst, i + 1);
+
+      return Q_FALSE;
+    }
+  }
+
+  if ((desc = q_string_remove_quotes (Q_ARG (2))) == NULL)
+  {
+    qas_set_error (ctx, "memory exhausted");
+
+    return Q_FALSE;
+  }
+
+  gate = qgate_param_new (family->name, Q_ARG (0), desc, params);
+
+  free (desc);
+
+  if (gate == NULL)
+  {
+    qas_set_error (ctx, "failed to create gate: %s", q_get_last_error ());
+
+    return Q_FALSE;
+  }
+
+  if (!qdb_register_qgate (ctx->qdb, gate))
+  {
+    qas_set_error (ctx, "cannot register gate: %s", q_get_last_error ());
+
+    qgate_destroy (gate);
+
+    return Q_FALSE;
+  }
+
+  return Q_TRUE;
+}
+
+/* .oracle name, qubits, "description"[, inputs]
+ *
+ * Defines a reversible classical function, applied as a permutation
+ * of basis states. States not listed in .map / .xor are left alone.
+ */
+QINSTDECL(oracle)
+{
+  unsigned int qubits, inputs = 0;
+  char *desc;
+
+  Q_ENSURE_MIN_ARGS (3);
+  Q_ENSURE_CONTEXT (QAS_CTX_KIND_GLOBAL);
+
+  if (fastlist_size (args) > 4)
+  {
+    qas_set_error (ctx, "%s: too many arguments", inst);
+
+    return Q_FALSE;
+  }
+
+  Q_ENSURE_IDENTIFIER (0);
+  Q_ENSURE_NUM (1);
+  Q_ENSURE_STRING (2);
+
+  if (qdb_lookup_qgate (ctx->qdb, Q_ARG (0)) != NULL)
+  {
+    qas_set_error (ctx, "redefinition of quantum gate `%s'", Q_ARG (0));
+
+    return Q_FALSE;
+  }
+
+  Q_PARSE_NUM (1, qubits);
+
+  if (fastlist_size (args) == 4)
+  {
+    Q_ENSURE_NUM (3);
+    Q_PARSE_NUM (3, inputs);
+
+    if (inputs == 0 || inputs >= qubits)
+    {
+      qas_set_error (ctx, "%s: invalid number of input qubits", inst);
+
+      return Q_FALSE;
+    }
+  }
+
+  if ((desc = q_string_remove_quotes (Q_ARG (2))) == NULL)
+  {
+    qas_set_error (ctx, "memory exhausted");
+
+    return Q_FALSE;
+  }
+
+  if ((ctx->curr_gate = qgate_oracle_new (qubits, Q_ARG (0), desc, NULL)) == NULL)
+  {
+    qas_set_error (ctx, "failed to create gate: %s", q_get_last_error ());
+
+    free (desc);
+
+    return Q_FALSE;
+  }
+
+  free (desc);
+
+  ctx->curr_inputs = inputs;
+  ctx->ctx_kind    = QAS_CTX_KIND_GATE;
+
+  return Q_TRUE;
+}
+
+/* .map in, out: basis state `in' becomes `out' */
+QINSTDECL(map)
+{
+  unsigned int in, out;
+
+  Q_ENSURE_ARGS (2);
+  Q_ENSURE_CONTEXT (QAS_CTX_KIND_GATE);
+
+  Q_ENSURE_NUM (0);
+  Q_ENSURE_NUM (1);
+
+  Q_PARSE_NUM (0, in);
+  Q_PARSE_NUM (1, out);
+
+  if (!qgate_oracle_map (ctx->curr_gate, in, out))
+  {
+    Q_GATE_ERROR (ctx, "%s", q_get_last_error ());
+
+    return Q_FALSE;
+  }
+
+  return Q_TRUE;
+}
+
+/* .xor in, value: for input qubits in state `in', XOR `value' into
+ * the remaining qubits */
+QINSTDECL(xor)
+{
+  unsigned int in, value, y, outputs;
+
+  Q_ENSURE_ARGS (2);
+  Q_ENSURE_CONTEXT (QAS_CTX_KIND_GATE);
+
+  Q_ENSURE_NUM (0);
+  Q_ENSURE_NUM (1);
+
+  if (ctx->curr_inputs == 0)
+  {
+    Q_GATE_ERROR (ctx, "%s requires an oracle with input qubits", inst);
+
+    return Q_FALSE;
+  }
+
+  Q_PARSE_NUM (0, in);
+  Q_PARSE_NUM (1, value);
+
+  outputs = ctx->curr_gate->order - ctx->curr_inputs;
+
+  if (in >= (1u << ctx->curr_inputs) || value >= (1u << outputs))
+  {
+    Q_GATE_ERROR (ctx, "%s: value out of range", inst);
+
+    return Q_FALSE;
+  }
+
+  for (y = 0; y < 1u << outputs; ++y)
+    if (!qgate_oracle_map (
+        ctx->curr_gate,
+        in | (y << ctx->curr_inputs),
+        in | ((y ^ value) << ctx->curr_inputs)))
+    {
+      Q_GATE_ERROR (ctx, "%s", q_get_last_error ());
+
+      return Q_FALSE;
+    }
+
+  return Q_TRUE;
+}
+
+QINSTDECL(coef)
+{
+  unsigned int i;
+  unsigned int matrix_length;
+  QCOMPLEX coef;
+
+  Q_ENSURE_MIN_ARGS (1);
+
+  Q_ENSURE_CONTEXT (QAS_CTX_KIND_GATE);
+
+  if (ctx->curr_gate->coef == NULL)
+  {
+    Q_GATE_ERROR (ctx, "gate has no coefficient matrix");
+
+    return Q_FALSE;
+  }
+
+  matrix_length = 1 << (ctx->curr_gate->order << 1);
+
+  for (i = 0; i < fastlist_size (args); ++i)
+  {
+    Q_PARSE_COMPLEX (i, coef);
+
+    if (ctx->curr_coef >= matrix_length)
+    {
+      Q_GATE_ERROR (ctx,
+                    "gate matrix coefficient count exceeded (%d)",
+                     matrix_length);
+
+      return Q_FALSE;
+    }
+
+    ctx->curr_gate->coef[ctx->curr_coef++] = coef;
+  }
+
+  return Q_TRUE;
+}
+
+static fastlist_ref_t
+qas_ctx_resolve_qubit_alias (const qas_ctx_t *ctx, const char *name)
+{
+  FASTLIST_FOR_BEGIN (const char *, alias, &ctx->qubit_aliases)
+    if (strcmp (alias, name) == 0)
+      return FASTLIST_FOR_INNERMOST_REF;
+  FASTLIST_FOR_END
+
+  return FASTLIST_INVALID_REF;
+}
+
+QINSTDECL(qubit)
+{
+  char *dup;
+
+  Q_ENSURE_ARGS (1);
+
+  Q_ENSURE_CONTEXT (QAS_CTX_KIND_CIRCUIT);
+
+  if (fastlist_size (&ctx->qubit_aliases) >= ctx->curr_circuit->order)
+  {
+    Q_CIRCUIT_ERROR (ctx, "too many qubits");
+
+    return Q_FALSE;
+  }
+
+  if (qas_ctx_resolve_qubit_alias (ctx, Q_ARG (0)) != FASTLIST_INVALID_REF)
+  {
+    Q_CIRCUIT_ERROR (ctx, "qubit `%s' already declared", Q_ARG (0));
+
+    return Q_FALSE;
+  }
+
+  if ((dup = strdup (Q_ARG (0))) == NULL)
+  {
+    Q_CIRCUIT_ERROR (ctx, "memory exhausted");
+
+    return Q_FALSE;
+  }
+
+  if (fastlist_append(&ctx->qubit_aliases, dup) == 0)
+  {
+    Q_CIRCUIT_ERROR (ctx, "memory exhausted");
+
+    free (dup);
+
+    return Q_FALSE;
+  }
+
+  return Q_TRUE;
+}
+
+/* Objects shared by included files live in the root context */
+static inline qas_ctx_t *
+qas_ctx_get_root (qas_ctx_t *ctx)
+{
+  while (ctx->parent != NULL)
+    ctx = ctx->parent;
+
+  return ctx;
+}
+
+/* Wirings go to the innermost open .repeat block, if any */
+static inline qcircuit_t *
+qas_ctx_get_target (const qas_ctx_t *ctx)
+{
+  if (ctx->repeat_depth > 0)
+    return ctx->repeats[ctx->repeat_depth - 1].block;
+
+  return ctx->curr_circuit;
+}
+
+/* Resolve count qubit arguments, starting at first, into rewire */
+static QBOOL
+qas_ctx_resolve_qubits (
+    qas_ctx_t *ctx,
+    const char *inst,
+    const fastlist_t *args,
+    unsigned int first,
+    unsigned int count,
+    unsigned int *rewire)
+{
+  unsigned int i, j;
+  fastlist_ref_t wireref;
+
+  for (i = 0; i < count; ++i)
+  {
+    Q_ENSURE_IDENTIFIER (first + i);
+
+    if ((wireref = qas_ctx_resolve_qubit_alias (ctx, Q_ARG (first + i))) == FASTLIST_INVALID_REF)
+    {
+      Q_CIRCUIT_ERROR (ctx, "qubit `%s' undeclared", Q_ARG (first + i));
+
+      return Q_FALSE;
+    }
+
+    rewire[i] = wireref;
+
+    /* Verification of the no-cloning theorem */
+    for (j = 0; j < i; ++j)
+      if (rewire[j] == wireref)
+      {
+        Q_CIRCUIT_ERROR (ctx, "cannot clone quantum states");
+
+        return Q_FALSE;
+      }
+  }
+
+  return Q_TRUE;
+}
+
+/* .repeat count
+ *
+ * Applies the wirings up to the matching .end count times. Blocks on
+ * few qubits are compiled to a single gate by repeated squaring of
+ * their operator (see qcircuit_power), the rest are unrolled.
+ */
+QINSTDECL(repeat)
+{
+  uint64_t count;
+  qcircuit_t *block;
+  char *end;
+
+  Q_ENSURE_ARGS (1);
+  Q_ENSURE_CONTEXT (QAS_CTX_KIND_CIRCUIT);
+
+  Q_ENSURE_NUM (0);
+
+  count = strtoull (Q_ARG (0), &end, 0);
+
+  if (*end != '\0')
+  {
+    qas_set_error (ctx, "%s: argument 1 not a number", inst);
+
+    return Q_FALSE;
+  }
+
+  if (ctx->repeat_depth == QAS_REPEAT_DEPTH_MAX)
+  {
+    Q_CIRCUIT_ERROR (ctx, "too many nested %s blocks", inst);
+
+    return Q_FALSE;
+  }
+
+  if ((block = qcircuit_new (
+      ctx->curr_circuit->order,
+      ctx->curr_circuit->name)) == NULL)
+  {
+    Q_CIRCUIT_ERROR (ctx, "memory exhausted");
+
+    return Q_FALSE;
+  }
+
+  ctx->repeats[ctx->repeat_depth].block = block;
+  ctx->repeats[ctx->repeat_depth].count = count;
+
+  ++ctx->repeat_depth;
+
+  return Q_TRUE;
+}
+
+/* Wirings of block on the qubits of support, renumbered from 0 in
+ * ascending order */
+static qcircuit_t *
+qas_repeat_compact (const qcircuit_t *block, uint64_t support)
+{
+  unsigned int local[64], remap[QSPARSE_ORDER_MAX];
+  unsigned int i, n;
+  const qwiring_t *this;
+  qcircuit_t *compact;
+
+  for (i = n = 0; i < 64; ++i)
+    if (support & (1ull << i))
+      local[i] = n++;
+
+  if ((compact = qcircuit_new (n, block->name)) == NULL)
+    return NULL;
+
+  for (this = block->wiring_head; this != NULL; this = this->next)
+  {
+    for (i = 0; i < this->gate->order; ++i)
+      remap[i] = local[this->remap[i]];
+
+    if (!qcircuit_wire (compact, this->gate, remap))
+    {
+      qcircuit_destroy (compact);
+      return NULL;
+    }
+  }
+
+  return compact;
 }
 
-QINSTDECL(gate)
+static uint32_t
+qas_repeat_hash (const qcircuit_t *compact, uint64_t count)
 {
-  unsigned int qubits;
-  char *desc;
-
-  Q_ENSURE_ARGS (3);
-  Q_ENSURE_CONTEXT (QAS_CTX_KIND_GLOBAL);
+  const qwiring_t *this;
+  uint32_t hash = 2166136261u;
+  unsigned int i;
 
-  Q_ENSURE_IDENTIFIER (0);
-  Q_ENSURE_NUM (1);
-  Q_ENSURE_STRING (2);
+  hash = (hash ^ (uint32_t) count) * 16777619u;
+  hash = (hash ^ (uint32_t) (count >> 32)) * 16777619u;
 
-  /* Avoid gate redefinitions */
-  if (qdb_lookup_qgate (ctx->qdb, Q_ARG (0)) != NULL)
+  for (this = compact->wiring_head; this != NULL; this = this->next)
   {
-    qas_set_error (ctx, "redefinition of quantum gate `%s'", Q_ARG (0));
+    hash = (hash ^ (uint32_t) (uintptr_t) this->gate) * 16777619u;
 
-    return Q_FALSE;
+    for (i = 0; i < this->gate->order; ++i)
+      hash = (hash ^ this->remap[i]) * 16777619u;
   }
 
-  Q_PARSE_NUM (1, qubits);
+  return hash;
+}
 
-  /* Create gate */
-  if ((desc = q_string_remove_quotes (Q_ARG (2))) == NULL)
-  {
-    qas_set_error (ctx, "memory exhausted");
+static QBOOL
+qas_repeat_equal (const qcircuit_t *a, const qcircuit_t *b)
+{
+  const qwiring_t *p, *q;
 
+  if (a->order != b->order)
     return Q_FALSE;
+
+  for (p = a->wiring_head, q = b->wiring_head;
+       p != NULL && q != NULL;
+       p = p->next, q = q->next)
+    if (p->gate != q->gate ||
+        memcmp (p->remap, q->remap, p->gate->order * sizeof (unsigned int)) != 0)
+      return Q_FALSE;
+
+  return p == NULL && q == NULL;
+}
+
+/* Gate applying the wirings of compact count times */
+static qgate_t *
+qas_ctx_compile_repeat (
+    qas_ctx_t *ctx,
+    qcircuit_t *compact,
+    uint64_t count)
+{
+  unsigned int i, j, length;
+  qsparse_t *u = NULL;
+  QCOMPLEX *coef = NULL;
+  qgate_t *gate = NULL;
+  char name[64], desc[64];
+
+  if ((u = qcircuit_power (compact, count)) == NULL)
+    goto done;
+
+  length = 1 << compact->order;
+
+  if ((coef = malloc (length * length * sizeof (QCOMPLEX))) == NULL)
+  {
+    q_set_last_error ("memory exhausted");
+    goto done;
   }
 
-  if ((ctx->curr_gate = qgate_new (qubits, Q_ARG (0), desc, NULL)) == NULL)
+  for (j = 0; j < length; ++j)
+    for (i = 0; i < length; ++i)
+      coef[i + j * length] = qsparse_get (u, j, i);
+
+  i = 0;
+
+  do
+    snprintf (name, sizeof (name), "%s.repeat%d", compact->name, ++i);
+  while (qdb_lookup_qgate (ctx->qdb, name) != NULL);
+
+  snprintf (desc, sizeof (desc), "Block repeated %llu times",
+            (unsigned long long) count);
+
+  if ((gate = qgate_new (compact->order, name, desc, coef)) == NULL)
+    goto done;
+
+  if (!qdb_register_qgate (ctx->qdb, gate))
   {
-    qas_set_error (ctx, "failed to create gate: %s", q_get_last_error ());
+    qgate_destroy (gate);
+    gate = NULL;
+  }
 
-    free (desc);
+done:
+  if (u != NULL)
+    qsparse_destroy (u);
 
-    return Q_FALSE;
+  if (coef != NULL)
+    free (coef);
+
+  return gate;
+}
+
+/* Gate applying the wirings of block count times on the qubits of
+ * support (in ascending order). Blocks with the same wirings relative
+ * to their support share the gate, compiled only once. */
+static qgate_t *
+qas_ctx_get_repeat_gate (
+    qas_ctx_t *ctx,
+    const qcircuit_t *block,
+    uint64_t count,
+    uint64_t support)
+{
+  struct qas_repeat_gate *entry = NULL;
+  qcircuit_t *compact;
+  qgate_t *gate = NULL;
+  uint32_t hash;
+
+  if ((compact = qas_repeat_compact (block, support)) == NULL)
+    goto fail;
+
+  hash = qas_repeat_hash (compact, count);
+
+  FASTLIST_FOR_BEGIN (
+      const struct qas_repeat_gate *,
+      this,
+      &qas_ctx_get_root (ctx)->repeat_gates)
+    if (this->hash == hash &&
+        this->count == count &&
+        qas_repeat_equal (this->block, compact))
+    {
+      gate = this->gate;
+      goto done;
+    }
+  FASTLIST_FOR_END
+
+  if ((gate = qas_ctx_compile_repeat (ctx, compact, count)) == NULL)
+    goto done;
+
+  if ((entry = malloc (sizeof (struct qas_repeat_gate))) == NULL)
+    goto fail;
+
+  entry->block = compact;
+  entry->count = count;
+  entry->hash  = hash;
+  entry->gate  = gate;
+
+  if (fastlist_append (
+      &qas_ctx_get_root (ctx)->repeat_gates,
+      entry) == FASTLIST_INVALID_REF)
+  {
+    free (entry);
+    goto fail;
   }
 
-  ctx->curr_coef = 0;
+  /* Owned by the entry now */
+  compact = NULL;
 
-  free (desc);
+  goto done;
 
-  ctx->ctx_kind = QAS_CTX_KIND_GATE;
+fail:
+  q_set_last_error ("memory exhausted");
+  gate = NULL;
 
-  return Q_TRUE;
+done:
+  if (compact != NULL)
+    qcircuit_destroy (compact);
+
+  return gate;
 }
 
-QINSTDECL(coef)
+/* Close the innermost .repeat block, moving its wirings (applied count
+ * times) to the enclosing block or circuit. Parametric gates must stay
+ * rebindable, so blocks using them are always unrolled. So are blocks
+ * of circuits too big for a state vector whose compiled gate would be
+ * too wide for the MPS simulator (and too wide for the tableau to
+ * tell whether it is Clifford). Unrolling is bounded by
+ * QAS_REPEAT_UNROLL_MAX wirings. */
+static QBOOL
+qas_ctx_close_repeat (qas_ctx_t *ctx)
 {
-  unsigned int i;
-  unsigned int matrix_length;
-  QCOMPLEX coef;
+  struct qas_repeat *repeat;
+  const qwiring_t *this;
+  qwiring_t *wiring;
+  qcircuit_t *target;
+  qgate_t *gate;
+  unsigned int i, n, width, remap[QSPARSE_ORDER_MAX];
+  uint64_t k, support = 0;
+  QBOOL compile;
+  QBOOL ok = Q_FALSE;
 
-  Q_ENSURE_MIN_ARGS (1);
+  repeat = &ctx->repeats[--ctx->repeat_depth];
+  target = qas_ctx_get_target (ctx);
 
-  Q_ENSURE_CONTEXT (QAS_CTX_KIND_GATE);
+  if (repeat->block->wiring_head == NULL)
+  {
+    ok = Q_TRUE;
+    goto done;
+  }
 
-  matrix_length = 1 << (ctx->curr_gate->order << 1);
+  compile = repeat->count > 1 && repeat->block->order <= 64;
 
-  for (i = 0; i < fastlist_size (args); ++i)
+  for (this = repeat->block->wiring_head; compile && this != NULL; this = this->next)
   {
-    Q_PARSE_COMPLEX (i, coef);
+    if (qgate_is_parametric (this->gate))
+      compile = Q_FALSE;
 
-    if (ctx->curr_coef >= matrix_length)
+    for (i = 0; i < this->gate->order; ++i)
+      support |= 1ull << this->remap[i];
+  }
+
+  width = ctx->curr_circuit->order > QCIRCUIT_STATE_ORDER_MAX ?
+      QMPS_GATE_ORDER_MAX : QSPARSE_ORDER_MAX;
+
+  if (compile && support != 0 && __builtin_popcountll (support) <= width)
+  {
+    if ((gate = qas_ctx_get_repeat_gate (
+        ctx,
+        repeat->block,
+        repeat->count,
+        support)) == NULL)
     {
-      Q_GATE_ERROR (ctx,
-                    "gate matrix coefficient count exceeded (%d)",
-                     matrix_length);
+      Q_CIRCUIT_ERROR (ctx, "cannot compile block: %s", q_get_last_error ());
+      goto done;
+    }
 
-      return Q_FALSE;
+    for (i = n = 0; i < 64; ++i)
+      if (support & (1ull << i))
+        remap[n++] = i;
+
+    if ((wiring = qwiring_new (gate, remap)) == NULL)
+    {
+      Q_CIRCUIT_ERROR (ctx, "cannot create wiring: memory exhausted");
+      goto done;
     }
 
-    ctx->curr_gate->coef[ctx->curr_coef++] = coef;
+    if (!qcircuit_append_wiring (target, wiring))
+    {
+      Q_CIRCUIT_ERROR (ctx, "%s", q_get_last_error ());
+      qwiring_destroy (wiring);
+      goto done;
+    }
   }
+  else
+  {
+    for (n = 0, this = repeat->block->wiring_head; this != NULL; this = this->next)
+      ++n;
 
-  return Q_TRUE;
+    if (repeat->count > 1 && repeat->count > QAS_REPEAT_UNROLL_MAX / n)
+    {
+      Q_CIRCUIT_ERROR (
+          ctx,
+          "block repeated %llu times is too big to unroll",
+          (unsigned long long) repeat->count);
+      goto done;
+    }
+
+    for (k = 0; k < repeat->count; ++k)
+      for (this = repeat->block->wiring_head; this != NULL; this = this->next)
+      {
+        if ((wiring = qwiring_new (this->gate, this->remap)) == NULL)
+        {
+          Q_CIRCUIT_ERROR (ctx, "cannot create wiring: memory exhausted");
+          goto done;
+        }
+
+        if (!qcircuit_append_wiring (target, wiring))
+        {
+          Q_CIRCUIT_ERROR (ctx, "%s", q_get_last_error ());
+          qwiring_destroy (wiring);
+          goto done;
+        }
+      }
+  }
+
+  ok = Q_TRUE;
+
+done:
+  qcircuit_destroy (repeat->block);
+
+  repeat->block = NULL;
+
+  return ok;
 }
 
-static fastlist_ref_t
-qas_ctx_resolve_qubit_alias (const qas_ctx_t *ctx, const char *name)
+/* Gate with the operator of circuit (in logical qubits), shared by
+ * every .call to it. It is built from the cached operator the first
+ * time and registered in the database as `circuit.call'. */
+static qgate_t *
+qas_ctx_get_call_gate (qas_ctx_t *ctx, qcircuit_t *callee)
 {
-  FASTLIST_FOR_BEGIN (const char *, alias, &ctx->qubit_aliases)
-    if (strcmp (alias, name) == 0)
-      return FASTLIST_FOR_INNERMOST_REF;
+  uint64_t i, j, length;
+  QCOMPLEX *coef = NULL;
+  qgate_t *gate = NULL;
+  char *name = NULL;
+  char desc[64];
+
+  if ((name = malloc (strlen (callee->name) + sizeof (".call"))) == NULL)
+    goto fail;
+
+  sprintf (name, "%s.call", callee->name);
+
+  if ((gate = qdb_lookup_qgate (ctx->qdb, name)) != NULL)
+    goto done;
+
+  if (!qcircuit_update (callee))
+    goto done;
+
+  length = 1ull << callee->order;
+
+  if ((coef = malloc (length * length * sizeof (QCOMPLEX))) == NULL)
+    goto fail;
+
+  /* The operator of relabeled circuits acts on physical qubits */
+  for (j = 0; j < length; ++j)
+    for (i = 0; i < length; ++i)
+      coef[i + j * length] = qsparse_get (
+          callee->u,
+          qcircuit_to_physical (callee, j),
+          qcircuit_to_physical (callee, i));
+
+  snprintf (desc, sizeof (desc), "Call to circuit %s", callee->name);
+
+  if ((gate = qgate_new (callee->order, name, desc, coef)) == NULL)
+    goto done;
+
+  if (!qdb_register_qgate (ctx->qdb, gate))
+  {
+    qgate_destroy (gate);
+    gate = NULL;
+  }
+
+  goto done;
+
+fail:
+  q_set_last_error ("memory exhausted");
+
+done:
+  if (name != NULL)
+    free (name);
+
+  if (coef != NULL)
+    free (coef);
+
+  return gate;
+}
+
+/* Copy of the wirings of circuit */
+static qcircuit_t *
+qas_circuit_copy (const qcircuit_t *circuit)
+{
+  const qwiring_t *this;
+  qcircuit_t *copy;
+
+  if ((copy = qcircuit_new (circuit->order, circuit->name)) == NULL)
+    return NULL;
+
+  for (this = circuit->wiring_head; this != NULL; this = this->next)
+    if (!qcircuit_wire (copy, this->gate, this->remap))
+    {
+      qcircuit_destroy (copy);
+      return NULL;
+    }
+
+  return copy;
+}
+
+/* Circuit as written, if the passes of .end may have changed it */
+static const qcircuit_t *
+qas_ctx_lookup_source (qas_ctx_t *ctx, const qcircuit_t *circuit)
+{
+  FASTLIST_FOR_BEGIN (const qcircuit_t *, source, &qas_ctx_get_root (ctx)->sources)
+    if (strcmp (source->name, circuit->name) == 0)
+      return source;
   FASTLIST_FOR_END
 
-  return FASTLIST_INVALID_REF;
+  return circuit;
 }
 
-QINSTDECL(qubit)
+/* Append the wirings of callee to target, with logical qubit i of
+ * callee moved to rewire[i] */
+static QBOOL
+qas_ctx_inline_call (
+    qas_ctx_t *ctx,
+    qcircuit_t *target,
+    const qcircuit_t *callee,
+    const unsigned int *rewire)
 {
-  char *dup;
+  const qwiring_t *this;
+  qwiring_t *wiring;
+  unsigned int *logical = NULL;
+  unsigned int i, remap[64];
+  QBOOL ok = Q_FALSE;
 
-  Q_ENSURE_ARGS (1);
+  if ((logical = malloc (callee->order * sizeof (unsigned int))) == NULL)
+  {
+    Q_CIRCUIT_ERROR (ctx, "memory exhausted");
+    goto done;
+  }
 
-  Q_ENSURE_CONTEXT (QAS_CTX_KIND_CIRCUIT);
+  for (i = 0; i < callee->order; ++i)
+    logical[callee->layout != NULL ? callee->layout[i] : i] = i;
 
-  if (fastlist_size (&ctx->qubit_aliases) >= ctx->curr_circuit->order)
+  for (this = callee->wiring_head; this != NULL; this = this->next)
   {
-    Q_CIRCUIT_ERROR (ctx, "too many qubits");
+    for (i = 0; i < this->gate->order; ++i)
+      remap[i] = rewire[logical[this->remap[i]]];
 
-    return Q_FALSE;
+    if ((wiring = qwiring_new (this->gate, remap)) == NULL)
+    {
+      Q_CIRCUIT_ERROR (ctx, "cannot create wiring: memory exhausted");
+      goto done;
+    }
+
+    if (!qcircuit_append_wiring (target, wiring))
+    {
+      Q_CIRCUIT_ERROR (ctx, "%s", q_get_last_error ());
+      qwiring_destroy (wiring);
+      goto done;
+    }
   }
 
-  if (qas_ctx_resolve_qubit_alias (ctx, Q_ARG (0)) != FASTLIST_INVALID_REF)
+  ok = Q_TRUE;
+
+done:
+  if (logical != NULL)
+    free (logical);
+
+  return ok;
+}
+
+/* .call circuit, qubit1, qubit2...
+ *
+ * Applies a previously defined circuit to the given qubits, as many as
+ * its order. In circuits small enough to have an operator, the call is
+ * a single gate built once and shared by all calls. Bigger circuits are
+ * simulated instead, and the tableau and MPS backends need the original
+ * gates, so calls are inlined there (as written, before the passes run
+ * on the callee). So are callees with parametric gates, which must stay
+ * rebindable.
+ */
+QINSTDECL(call)
+{
+  qcircuit_t *callee;
+  const qwiring_t *this;
+  qwiring_t *wiring = NULL;
+  qgate_t *gate;
+  unsigned int *rewire = NULL;
+  QBOOL inline_call;
+
+  Q_ENSURE_CONTEXT (QAS_CTX_KIND_CIRCUIT);
+  Q_ENSURE_MIN_ARGS (1);
+  Q_ENSURE_IDENTIFIER (0);
+
+  if ((callee = qdb_lookup_qcircuit (ctx->qdb, Q_ARG (0))) == NULL)
   {
-    Q_CIRCUIT_ERROR (ctx, "qubit `%s' already declared", Q_ARG (0));
+    Q_CIRCUIT_ERROR (ctx, "undefined circuit `%s'", Q_ARG (0));
 
     return Q_FALSE;
   }
 
-  if ((dup = strdup (Q_ARG (0))) == NULL)
+  Q_ENSURE_ARGS (callee->order + 1);
+
+  if ((rewire = malloc (sizeof (unsigned int) * callee->order)) == NULL)
   {
     Q_CIRCUIT_ERROR (ctx, "memory exhausted");
 
-    return Q_FALSE;
+    goto fail;
   }
 
-  if (fastlist_append(&ctx->qubit_aliases, dup) == 0)
+  if (!qas_ctx_resolve_qubits (ctx, inst, args, 1, callee->order, rewire))
+    goto fail;
+
+  /* Callees are never wider than their caller */
+  inline_call = ctx->curr_circuit->order > QSPARSE_ORDER_MAX;
+
+  for (this = callee->wiring_head; !inline_call && this != NULL; this = this->next)
+    if (qgate_is_parametric (this->gate))
+      inline_call = Q_TRUE;
+
+  if (inline_call)
   {
-    Q_CIRCUIT_ERROR (ctx, "memory exhausted");
+    if (!qas_ctx_inline_call (
+        ctx,
+        qas_ctx_get_target (ctx),
+        qas_ctx_lookup_source (ctx, callee),
+        rewire))
+      goto fail;
+  }
+  else if (callee->wiring_head != NULL)
+  {
+    if ((gate = qas_ctx_get_call_gate (ctx, callee)) == NULL)
+    {
+      Q_CIRCUIT_ERROR (ctx, "cannot compile call: %s", q_get_last_error ());
 
-    free (dup);
+      goto fail;
+    }
 
-    return Q_FALSE;
+    if ((wiring = qwiring_new (gate, rewire)) == NULL)
+    {
+      Q_CIRCUIT_ERROR (ctx, "cannot create wiring: memory exhausted");
+
+      goto fail;
+    }
+
+    if (!qcircuit_append_wiring (qas_ctx_get_target (ctx), wiring))
+    {
+      Q_CIRCUIT_ERROR (ctx, "%s", q_get_last_error ());
+
+      goto fail;
+    }
   }
 
+  free (rewire);
+
   return Q_TRUE;
+
+fail:
+  if (wiring != NULL)
+    qwiring_destroy (wiring);
+
+  if (rewire != NULL)
+    free (rewire);
+
+  return Q_FALSE;
 }
 
 QINSTDECL(include)
@@ -397,13 +1408,49 @@ QINSTDECL(include)
 QINSTDECL(end)
 {
   QBOOL result = Q_TRUE;
+  QBOOL wide;
+  unsigned int fuse_order;
+  qcircuit_t *source = NULL;
 
   Q_ENSURE_ARGS (0);
 
+  if (ctx->ctx_kind == QAS_CTX_KIND_CIRCUIT && ctx->repeat_depth > 0)
+    return qas_ctx_close_repeat (ctx);
+
   switch (ctx->ctx_kind)
   {
     case QAS_CTX_KIND_CIRCUIT:
-      result = qcircuit_update (ctx->curr_circuit);
+      /* Passes work on 64-bit qubit masks. Wider circuits (which can
+       * only be simulated on a stabilizer tableau) are kept as written */
+      wide = ctx->curr_circuit->order > 64;
+
+      if (!wide && (ctx->optimize || ctx->fuse_order > 1 || ctx->relabel))
+        if ((source = qas_circuit_copy (ctx->curr_circuit)) == NULL)
+          result = Q_FALSE;
+
+      if (result && ctx->optimize && !wide)
+        result = qcircuit_optimize (ctx->curr_circuit, ctx->qdb);
+
+      /* Non-Clifford circuits too big for a state vector go to the MPS
+       * simulator, which only takes gates of up to QMPS_GATE_ORDER_MAX
+       * qubits */
+      fuse_order = ctx->fuse_order;
+
+      if (ctx->curr_circuit->order > QCIRCUIT_STATE_ORDER_MAX &&
+          fuse_order > QMPS_GATE_ORDER_MAX)
+        fuse_order = QMPS_GATE_ORDER_MAX;
+
+      if (result && fuse_order > 1 && !wide)
+        result = qcircuit_fuse (ctx->curr_circuit, ctx->qdb, fuse_order);
+
+      if (result && ctx->relabel && !wide)
+        result = qcircuit_relabel (ctx->curr_circuit);
+
+      /* Circuits too big for an operator can only be simulated */
+      if (result && ctx->curr_circuit->order <= QSPARSE_ORDER_MAX)
+        result = ctx->dd ?
+            qcircuit_update_dd (ctx->curr_circuit) :
+            qcircuit_update_cached (ctx->curr_circuit, ctx->qdb->cache);
 
       if (!result)
       {
@@ -419,6 +1466,20 @@ QINSTDECL(end)
 
         result = Q_FALSE;
       }
+      else if (source != NULL &&
+               fastlist_append (
+                   &qas_ctx_get_root (ctx)->sources,
+                   source) == FASTLIST_INVALID_REF)
+      {
+        qas_set_error (ctx, "memory exhausted");
+
+        result = Q_FALSE;
+      }
+      else
+        source = NULL;
+
+      if (source != NULL)
+        qcircuit_destroy (source);
 
       ctx->curr_circuit = NULL;
 
@@ -435,7 +1496,7 @@ QINSTDECL(end)
 
       if (!result)
       {
-        Q_CIRCUIT_ERROR (ctx, "%s", q_get_last_error ());
+        Q_GATE_ERROR (ctx, "%s", q_get_last_error ());
 
         qgate_destroy (ctx->curr_gate);
       }
@@ -463,9 +1524,7 @@ QINSTDECL(end)
 QINSTDECL(__generic_gate)
 {
   qgate_t *gate;
-  unsigned int i, j;
   unsigned int *rewire = NULL;
-  fastlist_ref_t wireref;
   qwiring_t *wiring = NULL;
 
   Q_ENSURE_CONTEXT (QAS_CTX_KIND_CIRCUIT);
@@ -486,28 +1545,8 @@ QINSTDECL(__generic_gate)
     goto fail;
   }
 
-  for (i = 0; i < gate->order; ++i)
-  {
-    Q_ENSURE_IDENTIFIER (i);
-
-    if ((wireref = qas_ctx_resolve_qubit_alias (ctx, Q_ARG (i))) == FASTLIST_INVALID_REF)
-    {
-      Q_CIRCUIT_ERROR (ctx, "qubit `%s' undeclared", Q_ARG (i));
-
-      goto fail;
-    }
-
-    rewire[i] = wireref;
-
-    /* Verification of the no-cloning theorem */
-    for (j = 0; j < i; ++j)
-      if (rewire[j] == wireref)
-      {
-        Q_CIRCUIT_ERROR (ctx, "cannot clone quantum states");
-
-        goto fail;
-      }
-  }
+  if (!qas_ctx_resolve_qubits (ctx, inst, args, 0, gate->order, rewire))
+    goto fail;
 
   if ((wiring = qwiring_new (gate, rewire)) == NULL)
   {
@@ -520,7 +1559,7 @@ QINSTDECL(__generic_gate)
 
   rewire = NULL;
 
-  if (!qcircuit_append_wiring (ctx->curr_circuit, wiring))
+  if (!qcircuit_append_wiring (qas_ctx_get_target (ctx), wiring))
   {
     Q_CIRCUIT_ERROR (ctx, "%s", q_get_last_error ());
 
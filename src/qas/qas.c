@@ -42,6 +42,9 @@ qas_close (qas_ctx_t *ctx)
   if (ctx->path != NULL)
     free (ctx->path);
 
+  while (ctx->repeat_depth > 0)
+    qcircuit_destroy (ctx->repeats[--ctx->repeat_depth].block);
+
   if (ctx->curr_circuit != NULL)
     qcircuit_destroy (ctx->curr_circuit);
 
@@ -54,6 +57,19 @@ qas_close (qas_ctx_t *ctx)
 
   fastlist_free (&ctx->qubit_aliases);
 
+  FASTLIST_FOR_BEGIN (qcircuit_t *, source, &ctx->sources)
+    qcircuit_destroy (source);
+  FASTLIST_FOR_END
+
+  fastlist_free (&ctx->sources);
+
+  FASTLIST_FOR_BEGIN (struct qas_repeat_gate *, entry, &ctx->repeat_gates)
+    qcircuit_destroy (entry->block);
+    free (entry);
+  FASTLIST_FOR_END
+
+  fastlist_free (&ctx->repeat_gates);
+
   free (ctx);
 }
 
@@ -79,6 +95,12 @@ qas_ctx_new (const char *path, qas_ctx_t *parent)
 
   new->parent = parent;
 
+  new->optimize   = parent != NULL ? parent->optimize : Q_TRUE;
+  new->fuse_order = parent != NULL ?
+      parent->fuse_order : QOPT_FUSE_ORDER_DEFAULT;
+  new->relabel    = parent != NULL ? parent->relabel : Q_TRUE;
+  new->dd         = parent != NULL ? parent->dd : Q_FALSE;
+
   return new;
 fail:
   if (new != NULL)
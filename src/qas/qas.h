@@ -25,10 +25,37 @@
 #include <stdint.h>
 
 #include <qcircuit.h>
+#include <qcache.h>
+#include <qopt.h>
+#include <qparam.h>
+#include <qmps.h>
+#include <qdd.h>
 
 #define QAS_CTX_EOF -1
 #define QAS_ERROR_MAX 256
 
+/* Environment variable pointing to the compiled operator cache */
+#define QAS_CACHE_DIR_ENV "QAS_CACHE_DIR"
+
+/* Environment variable to disable the peephole optimizer (0: off) */
+#define QAS_OPTIMIZE_ENV "QAS_OPTIMIZE"
+
+/* Environment variable with the maximum order of fused gates (0: off) */
+#define QAS_FUSE_ORDER_ENV "QAS_FUSE_ORDER"
+
+/* Environment variable to disable qubit relabeling (0: off) */
+#define QAS_RELABEL_ENV "QAS_RELABEL"
+
+/* Environment variable to build operators as decision diagrams (1: on) */
+#define QAS_DD_ENV "QAS_DD"
+
+/* At most this many nested .repeat blocks */
+#define QAS_REPEAT_DEPTH_MAX 8
+
+/* Blocks that cannot be compiled may add at most this many wirings
+ * when unrolled */
+#define QAS_REPEAT_UNROLL_MAX (1u << 20)
+
 enum qas_ctx_kind
 {
   QAS_CTX_KIND_GLOBAL,
@@ -36,6 +63,23 @@ enum qas_ctx_kind
   QAS_CTX_KIND_GATE
 };
 
+/* A .repeat block collects its wirings (on the qubits of the circuit)
+ * until its .end, where they are applied count times */
+struct qas_repeat
+{
+  qcircuit_t *block;
+  uint64_t count;
+};
+
+/* Compiled .repeat block, shared by identical blocks on other qubits */
+struct qas_repeat_gate
+{
+  qcircuit_t *block; /* Wirings, on qubits 0 to n - 1 */
+  uint64_t count;
+  uint32_t hash;
+  qgate_t *gate;     /* Owned by the database */
+};
+
 struct qas_ctx
 {
   char *path;
@@ -65,10 +109,26 @@ struct qas_ctx
   /* For building circuits */
   qcircuit_t *curr_circuit;
   fastlist_t  qubit_aliases; /* Qubit aliases to ease programming */
+  QBOOL optimize;            /* Run the peephole optimizer on circuits */
+  unsigned int fuse_order;   /* Fuse gates up to this order (0: never) */
+  QBOOL relabel;             /* Move the most used qubits to low bits */
+  QBOOL dd;                  /* Operators as decision diagrams (uncached) */
+
+  /* Open .repeat blocks, innermost last */
+  struct qas_repeat repeats[QAS_REPEAT_DEPTH_MAX];
+  unsigned int repeat_depth;
+
+  /* Circuits as written, before the passes of .end. Calls inlined into
+   * other circuits start from these (root context only) */
+  fastlist_t sources;
+
+  /* Compiled .repeat blocks (root context only) */
+  fastlist_t repeat_gates;
 
   /* For building gates */
   qgate_t *curr_gate;
   unsigned int curr_coef;
+  unsigned int curr_inputs; /* Oracle input qubits (for .xor) */
 };
 
 typedef struct qas_ctx qas_ctx_t;